@@ -0,0 +1,128 @@
+#define _POSIX_C_SOURCE 200809L
+#include "pix_diff.h"
+#include "thread_pool.h"
+#include "image_io.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+/*
+Measures how diff_parallel_out() scales with the number of threads on synthetic images, printing
+one line per thread count: the best time of a few runs, the throughput over both inputs and the
+output, and the speedup over one thread. The table is printed twice, for images from plain malloc()
+and from image_alloc(), to show what the aligned, huge page backed buffers are worth.
+*/
+
+#define BENCH_RUNS	5
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void fill_images(uint32_t *img1, uint32_t *img2, uint32_t *dst, size_t num_pixels)	// Fills the inputs and touches every page before timing.
+{
+	uint32_t seed = 12345;
+	size_t px_idx;
+	for (px_idx = 0; px_idx < num_pixels; ++px_idx) {
+		seed = seed * 1664525u + 1013904223u;
+		img1[px_idx] = seed;
+		img2[px_idx] = seed ^ ((px_idx & 7) ? 0 : 0x00102030u);
+	}
+	memset(dst, 0, num_pixels * sizeof(uint32_t));
+}
+
+static void run_threads(diff_out_fn_t diff_fn, uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, int max_threads)
+{
+	fprintf(stdout, "threads	ms	GB/s	speedup\n");
+
+	double single_seconds = 0.0;
+	int threads = 1;
+	while (threads <= max_threads) {
+		thread_pool_t *pool = (threads > 1) ? thread_pool_create(threads) : NULL;
+		if (threads > 1 && pool == NULL) {
+			break;
+		}
+
+		double best = 0.0;
+		int run;
+		for (run = 0; run < BENCH_RUNS; ++run) {
+			double start = now_seconds();
+			diff_parallel_out(pool, diff_fn, dst, img1, img2, size, ABS);
+			double elapsed = now_seconds() - start;
+			if (run == 0 || elapsed < best) {
+				best = elapsed;
+			}
+		}
+		thread_pool_destroy(pool);
+
+		if (threads == 1) {
+			single_seconds = best;
+		}
+		fprintf(stdout, "%d	%.2f	%.2f	%.2f\n", threads, best * 1e3, 3.0 * (double)size / best * 1e-9, single_seconds / best);
+
+		if (threads == max_threads) {
+			break;
+		}
+		threads = (threads < 4) ? threads + 1 : threads * 2;	// Every count up to 4, then doubling, and always the maximum.
+		if (threads > max_threads) {
+			threads = max_threads;
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	long megapixels = (argc > 1) ? strtol(argv[1], NULL, 10) : 100;
+	diff_kernel_t kernel = KERNEL_AUTO;
+	if (megapixels < 1 || (argc > 2 && diff_kernel_parse(argv[2], &kernel) == -1)) {
+		fprintf(stderr, "Usage: %s [megapixels] [kernel] [max threads]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	int max_threads = (argc > 3) ? atoi(argv[3]) : thread_pool_online_cpus();
+	if (max_threads < 1) {
+		max_threads = 1;
+	}
+
+	diff_out_fn_t diff_fn = diff_kernel_out_fn(kernel);
+	if (diff_fn == NULL) {
+		fprintf(stderr, "Error(%s): The '%s' kernel is not supported by this build or processor.\n", __func__, diff_kernel_name(kernel));
+		return EXIT_FAILURE;
+	}
+	if (kernel == KERNEL_AUTO) {
+		kernel = diff_best_kernel();
+	}
+
+	size_t num_pixels = (size_t)megapixels * 1000000u;
+	size_t size = num_pixels * sizeof(uint32_t);
+	fprintf(stdout, "Kernel %s, %ld megapixels, %d online processors\n", diff_kernel_name(kernel), megapixels, thread_pool_online_cpus());
+
+	int aligned;
+	for (aligned = 0; aligned <= 1; ++aligned) {
+		uint32_t *img1 = aligned ? image_alloc(size) : malloc(size);
+		uint32_t *img2 = aligned ? image_alloc(size) : malloc(size);
+		uint32_t *dst = aligned ? image_alloc(size) : malloc(size);
+		if (img1 == NULL || img2 == NULL || dst == NULL) {
+			fprintf(stderr, "Error(%s): Unable to allocate three %zu byte images.\n", __func__, size);
+			return EXIT_FAILURE;
+		}
+		fill_images(img1, img2, dst, num_pixels);
+		fprintf(stdout, "Buffers from %s\n", aligned ? "image_alloc()" : "malloc()");
+		run_threads(diff_fn, dst, img1, img2, size, max_threads);
+		if (aligned) {
+			image_free(img1);
+			image_free(img2);
+			image_free(dst);
+		} else {
+			free(img1);
+			free(img2);
+			free(dst);
+		}
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,733 @@
+#include "deflate.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define WINDOW_SIZE	32768			// Largest distance a deflate match may reach back.
+#define WINDOW_MASK	(WINDOW_SIZE - 1)
+#define MIN_MATCH	3
+#define MAX_MATCH	258
+#define MIN_LOOKAHEAD	(MAX_MATCH + MIN_MATCH + 1)	// Input kept back until the stream is closed, so every match can run to MAX_MATCH.
+#define HASH_BITS	15
+#define HASH_SIZE	(1u << HASH_BITS)
+#define MAX_CHAIN	32			// Candidates tried per position.
+#define MAX_INSERT	32			// Longer matches only hash their first position, which keeps long runs cheap.
+#define TOO_FAR		4096			// A 3 byte match further back costs more bits than three literals.
+#define OUT_BYTES	(64u << 10)		// Compressed bytes collected before calling the sink.
+#define END_OF_BLOCK	256
+#define FAST_BITS	9			// Huffman codes up to this length decode with one table lookup.
+
+static const uint16_t LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t DIST_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t DIST_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t CODE_LENGTH_ORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void crc_table_init(void)
+{
+	uint32_t value;
+	for (value = 0; value < 256; ++value) {
+		uint32_t crc = value;
+		int bit;
+		for (bit = 0; bit < 8; ++bit) {
+			crc = (crc & 1) ? 0xEDB88320u ^ (crc >> 1) : crc >> 1;
+		}
+		crc_table[value] = crc;
+	}
+}
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len)
+{
+	pthread_once(&crc_table_once, crc_table_init);
+	crc = ~crc;
+	size_t idx;
+	for (idx = 0; idx < len; ++idx) {
+		crc = crc_table[(crc ^ data[idx]) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+uint32_t adler32_update(uint32_t adler, const uint8_t *data, size_t len)
+{
+	uint32_t a = adler & 0xFFFF, b = adler >> 16;
+	while (len > 0) {
+		size_t block = (len < 5552) ? len : 5552;	// The most bytes before b can overflow 32 bits.
+		len -= block;
+		while (block-- > 0) {
+			a += *data++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return (b << 16) | a;
+}
+
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2)	// As zlib: a = a1 + a2 - 1, b = b1 + b2 + len2 * (a1 - 1).
+{
+	const uint32_t base = 65521;
+	uint32_t rem = (uint32_t)(len2 % base);
+	uint32_t a1 = adler1 & 0xFFFF, b1 = adler1 >> 16;
+	uint32_t a2 = adler2 & 0xFFFF, b2 = adler2 >> 16;
+	uint32_t a = (a1 + a2 + base - 1) % base;
+	uint32_t b = (uint32_t)((b1 + b2 + (uint64_t)rem * a1 + base - rem) % base);
+	return (b << 16) | a;
+}
+
+static unsigned reverse_bits(unsigned code, unsigned num_bits)	// Huffman codes are sent most significant bit first into an LSB-first stream.
+{
+	unsigned reversed = 0;
+	while (num_bits-- > 0) {
+		reversed = (reversed << 1) | (code & 1);
+		code >>= 1;
+	}
+	return reversed;
+}
+
+/*
+Deflate. LZ77 over a hash chained 64KB window, coded with the fixed Huffman tables, like
+stb_image_write. The first half of the window holds history for matches, the second half takes new
+input and slides down once full.
+*/
+
+struct deflate_stream {
+	deflate_sink_fn_t sink;
+	void *ctx;
+	int failed;
+
+	uint8_t window[2 * WINDOW_SIZE];
+	int32_t head[HASH_SIZE];		// Newest window position per hash, -1 for none.
+	int32_t prev[WINDOW_SIZE];		// Older position with the same hash, by position & WINDOW_MASK.
+	size_t strstart;			// Next position to code.
+	size_t lookahead;			// Bytes from strstart not coded yet.
+	uint32_t adler;
+
+	uint64_t bit_buf;
+	unsigned bit_count;
+	uint8_t out[OUT_BYTES];
+	size_t out_len;
+
+	uint16_t lit_code[288];			// Fixed literal/length codes, already bit reversed.
+	uint8_t lit_bits[288];
+	uint8_t length_code[MAX_MATCH + 1];	// Match length to index into LENGTH_BASE.
+};
+
+static void flush_out(deflate_stream_t *stream)
+{
+	if (stream->out_len > 0 && !stream->failed && stream->sink(stream->ctx, stream->out, stream->out_len) == -1) {
+		stream->failed = 1;
+	}
+	stream->out_len = 0;
+}
+
+static void put_bits(deflate_stream_t *stream, unsigned value, unsigned num_bits)
+{
+	stream->bit_buf |= (uint64_t)value << stream->bit_count;
+	stream->bit_count += num_bits;
+	while (stream->bit_count >= 8) {
+		stream->out[stream->out_len++] = (uint8_t)stream->bit_buf;
+		stream->bit_buf >>= 8;
+		stream->bit_count -= 8;
+		if (stream->out_len == OUT_BYTES) {
+			flush_out(stream);
+		}
+	}
+}
+
+static void put_symbol(deflate_stream_t *stream, unsigned symbol)
+{
+	put_bits(stream, stream->lit_code[symbol], stream->lit_bits[symbol]);
+}
+
+static void put_match(deflate_stream_t *stream, size_t length, size_t distance)
+{
+	unsigned code = stream->length_code[length];
+	put_symbol(stream, 257 + code);
+	put_bits(stream, (unsigned)(length - LENGTH_BASE[code]), LENGTH_EXTRA[code]);
+
+	unsigned dist_code = 29;
+	while (DIST_BASE[dist_code] > distance) {
+		--dist_code;
+	}
+	put_bits(stream, reverse_bits(dist_code, 5), 5);
+	put_bits(stream, (unsigned)(distance - DIST_BASE[dist_code]), DIST_EXTRA[dist_code]);
+}
+
+static uint32_t hash3(const uint8_t *bytes)
+{
+	uint32_t key = ((uint32_t)bytes[0] << 16) | ((uint32_t)bytes[1] << 8) | bytes[2];
+	return (key * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static size_t match_length(const uint8_t *a, const uint8_t *b, size_t max_len)
+{
+	size_t len = 0;
+	while (len + 8 <= max_len) {			// Eight bytes per compare, the first differing byte from the lowest set bit.
+		uint64_t word_a, word_b;
+		memcpy(&word_a, a + len, 8);
+		memcpy(&word_b, b + len, 8);
+		if (word_a != word_b) {
+			return len + (size_t)__builtin_ctzll(word_a ^ word_b) / 8;
+		}
+		len += 8;
+	}
+	while (len < max_len && a[len] == b[len]) {
+		++len;
+	}
+	return len;
+}
+
+static size_t longest_match(const deflate_stream_t *stream, int32_t candidate, size_t max_len, size_t *distance)
+{
+	size_t pos = stream->strstart;
+	size_t limit = (pos > WINDOW_SIZE) ? pos - WINDOW_SIZE : 0;
+	size_t best_len = 0;
+	int chain = MAX_CHAIN;
+
+	while (candidate >= 0 && (size_t)candidate >= limit && chain-- > 0) {
+		const uint8_t *match = stream->window + candidate;
+		if (match[best_len] == stream->window[pos + best_len]) {	// Can only be longer if this byte matches.
+			size_t len = match_length(match, stream->window + pos, max_len);
+			if (len > best_len) {
+				best_len = len;
+				*distance = pos - (size_t)candidate;
+				if (len == max_len) {
+					break;
+				}
+			}
+		}
+		int32_t next = stream->prev[candidate & WINDOW_MASK];
+		if (next >= candidate) {		// The slot was reused by a newer position, the chain ends here.
+			break;
+		}
+		candidate = next;
+	}
+	return best_len;
+}
+
+static void insert_hash(deflate_stream_t *stream, size_t pos)
+{
+	uint32_t hash = hash3(stream->window + pos);
+	stream->prev[pos & WINDOW_MASK] = stream->head[hash];
+	stream->head[hash] = (int32_t)pos;
+}
+
+static void compress_window(deflate_stream_t *stream, int flush)	// Codes input until MIN_LOOKAHEAD is left, or all of it when flushing.
+{
+	size_t keep = flush ? 0 : MIN_LOOKAHEAD - 1;
+	while (stream->lookahead > keep) {
+		size_t pos = stream->strstart;
+		size_t max_len = (stream->lookahead < MAX_MATCH) ? stream->lookahead : MAX_MATCH;
+		size_t len = 0, distance = 0;
+
+		if (max_len >= MIN_MATCH) {
+			uint32_t hash = hash3(stream->window + pos);
+			len = longest_match(stream, stream->head[hash], max_len, &distance);
+			stream->prev[pos & WINDOW_MASK] = stream->head[hash];
+			stream->head[hash] = (int32_t)pos;
+		}
+
+		if (len > MIN_MATCH || (len == MIN_MATCH && distance <= TOO_FAR)) {
+			put_match(stream, len, distance);
+			if (len <= MAX_INSERT) {
+				size_t end = pos + stream->lookahead;
+				size_t next;
+				for (next = pos + 1; next < pos + len && next + MIN_MATCH <= end; ++next) {
+					insert_hash(stream, next);
+				}
+			}
+		} else {
+			len = 1;
+			put_symbol(stream, stream->window[pos]);
+		}
+		stream->strstart += len;
+		stream->lookahead -= len;
+	}
+}
+
+static void slide_window(deflate_stream_t *stream)
+{
+	memmove(stream->window, stream->window + WINDOW_SIZE, WINDOW_SIZE);
+	stream->strstart -= WINDOW_SIZE;
+
+	size_t idx;
+	for (idx = 0; idx < HASH_SIZE; ++idx) {
+		stream->head[idx] = (stream->head[idx] >= WINDOW_SIZE) ? stream->head[idx] - WINDOW_SIZE : -1;
+	}
+	for (idx = 0; idx < WINDOW_SIZE; ++idx) {
+		stream->prev[idx] = (stream->prev[idx] >= WINDOW_SIZE) ? stream->prev[idx] - WINDOW_SIZE : -1;
+	}
+}
+
+static deflate_stream_t *deflate_new(deflate_sink_fn_t sink, void *ctx)
+{
+	deflate_stream_t *stream = malloc(sizeof(*stream));
+	if (stream == NULL) {
+		fprintf(stderr, "Error(%s): Unable to allocate the deflate stream.\n", __func__);
+		return NULL;
+	}
+	memset(stream->head, 0xFF, sizeof(stream->head));
+	memset(stream->prev, 0xFF, sizeof(stream->prev));
+	stream->sink = sink;
+	stream->ctx = ctx;
+	stream->failed = 0;
+	stream->strstart = stream->lookahead = 0;
+	stream->adler = 1;
+	stream->bit_buf = 0;
+	stream->bit_count = 0;
+	stream->out_len = 0;
+
+	unsigned symbol;
+	for (symbol = 0; symbol < 288; ++symbol) {	// The fixed code of RFC 1951 3.2.6.
+		unsigned code, bits;
+		if (symbol < 144) {
+			code = 0x30 + symbol, bits = 8;
+		} else if (symbol < 256) {
+			code = 0x190 + symbol - 144, bits = 9;
+		} else if (symbol < 280) {
+			code = symbol - 256, bits = 7;
+		} else {
+			code = 0xC0 + symbol - 280, bits = 8;
+		}
+		stream->lit_code[symbol] = (uint16_t)reverse_bits(code, bits);
+		stream->lit_bits[symbol] = (uint8_t)bits;
+	}
+	unsigned length, code = 0;
+	for (length = MIN_MATCH; length <= MAX_MATCH; ++length) {
+		while (code < 28 && LENGTH_BASE[code + 1] <= length) {
+			++code;
+		}
+		stream->length_code[length] = (uint8_t)code;
+	}
+	return stream;
+}
+
+deflate_stream_t *deflate_open(deflate_sink_fn_t sink, void *ctx)
+{
+	deflate_stream_t *stream = deflate_new(sink, ctx);
+	if (stream == NULL) {
+		return NULL;
+	}
+	put_bits(stream, 0x78, 8);		// zlib header: deflate, 32KB window, no dictionary.
+	put_bits(stream, 0x01, 8);
+	put_bits(stream, 0, 1);			// A fixed Huffman block that runs until deflate_close().
+	put_bits(stream, 1, 2);
+	return stream;
+}
+
+deflate_stream_t *deflate_open_raw(deflate_sink_fn_t sink, void *ctx, const uint8_t *dict, size_t dict_len)
+{
+	deflate_stream_t *stream = deflate_new(sink, ctx);
+	if (stream == NULL) {
+		return NULL;
+	}
+	if (dict_len > WINDOW_SIZE) {		// Only the last 32KB can be reached.
+		dict += dict_len - WINDOW_SIZE;
+		dict_len = WINDOW_SIZE;
+	}
+	memcpy(stream->window, dict, dict_len);
+	size_t pos;
+	for (pos = 0; pos + MIN_MATCH <= dict_len; ++pos) {
+		insert_hash(stream, pos);
+	}
+	stream->strstart = dict_len;		// History to match against, never coded itself.
+	put_bits(stream, 0, 1);
+	put_bits(stream, 1, 2);
+	return stream;
+}
+
+int deflate_write(deflate_stream_t *stream, const uint8_t *data, size_t len)
+{
+	stream->adler = adler32_update(stream->adler, data, len);
+	while (len > 0 && !stream->failed) {
+		if (stream->strstart + stream->lookahead == 2 * WINDOW_SIZE) {
+			slide_window(stream);
+		}
+		size_t room = 2 * WINDOW_SIZE - (stream->strstart + stream->lookahead);
+		size_t chunk = (len < room) ? len : room;
+		memcpy(stream->window + stream->strstart + stream->lookahead, data, chunk);
+		stream->lookahead += chunk;
+		data += chunk;
+		len -= chunk;
+		compress_window(stream, 0);
+	}
+	return stream->failed ? -1 : 0;
+}
+
+static void finish_block(deflate_stream_t *stream, int last)	// Ends the open block and pads to a byte boundary.
+{
+	compress_window(stream, 1);
+	put_symbol(stream, END_OF_BLOCK);
+	if (last) {
+		put_bits(stream, 1, 1);		// An empty final block.
+		put_bits(stream, 1, 2);
+		put_symbol(stream, END_OF_BLOCK);
+	} else {
+		put_bits(stream, 0, 3);		// Sync flush: an empty stored block, whose length fields start on a byte.
+	}
+	if (stream->bit_count > 0) {
+		put_bits(stream, 0, 8 - stream->bit_count);
+	}
+	if (!last) {
+		put_bits(stream, 0x0000, 16);
+		put_bits(stream, 0xFFFF, 16);
+	}
+}
+
+int deflate_close_raw(deflate_stream_t *stream, int last)
+{
+	finish_block(stream, last);
+	flush_out(stream);
+
+	int result = stream->failed ? -1 : 0;
+	free(stream);
+	return result;
+}
+
+int deflate_close(deflate_stream_t *stream)
+{
+	finish_block(stream, 1);
+	int shift;
+	for (shift = 24; shift >= 0; shift -= 8) {	// Adler-32 of the uncompressed data, big endian.
+		put_bits(stream, (stream->adler >> shift) & 0xFF, 8);
+	}
+	flush_out(stream);
+
+	int result = stream->failed ? -1 : 0;
+	free(stream);
+	return result;
+}
+
+/*
+Inflate. Compressed bytes are pulled from the source only when the bit buffer runs low, and the
+decoder state (current block, pending match) lives in the stream, so a call can stop anywhere and
+the next one carries on.
+*/
+
+typedef struct {
+	uint16_t fast[1 << FAST_BITS];		// Length << 9 | symbol for short codes, 0 for longer ones.
+	uint16_t first_code[16];
+	int32_t max_code[17];			// One past the last code of each length, shifted to 16 bits.
+	uint16_t first_symbol[16];
+	uint8_t sizes[288];
+	uint16_t values[288];
+} huffman_t;
+
+enum { BLOCK_NONE, BLOCK_STORED, BLOCK_HUFFMAN };
+
+struct inflate_stream {
+	inflate_source_fn_t source;
+	void *ctx;
+	const uint8_t *in;
+	size_t in_len;
+	size_t pad_bytes;			// Zero bytes fed in after the source ran out.
+	int failed;
+
+	uint64_t bit_buf;
+	unsigned bit_count;
+
+	int block_type;
+	int final_block;
+	size_t stored_left;
+	size_t copy_left;			// Pending match.
+	size_t copy_distance;
+	int fixed_built;
+	huffman_t fixed_lit, fixed_dist;
+	huffman_t dynamic_lit, dynamic_dist;
+	const huffman_t *lit;
+	const huffman_t *dist;
+
+	uint8_t window[WINDOW_SIZE];
+	uint64_t total_out;
+};
+
+static int build_huffman(huffman_t *table, const uint8_t *lengths, unsigned num)
+{
+	int counts[17] = { 0 };
+	int next_code[16];
+	memset(table->fast, 0, sizeof(table->fast));
+
+	unsigned symbol;
+	for (symbol = 0; symbol < num; ++symbol) {
+		counts[lengths[symbol]]++;
+	}
+	counts[0] = 0;
+
+	int code = 0, index = 0, len;
+	for (len = 1; len < 16; ++len) {
+		next_code[len] = code;
+		table->first_code[len] = (uint16_t)code;
+		table->first_symbol[len] = (uint16_t)index;
+		code += counts[len];
+		if (counts[len] && code > (1 << len)) {	// Over-subscribed.
+			return -1;
+		}
+		table->max_code[len] = code << (16 - len);
+		code <<= 1;
+		index += counts[len];
+	}
+	table->max_code[16] = 0x10000;
+
+	for (symbol = 0; symbol < num; ++symbol) {
+		len = lengths[symbol];
+		if (len == 0) {
+			continue;
+		}
+		int slot = next_code[len] - table->first_code[len] + table->first_symbol[len];
+		table->sizes[slot] = (uint8_t)len;
+		table->values[slot] = (uint16_t)symbol;
+		if (len <= FAST_BITS) {
+			unsigned entry = reverse_bits((unsigned)next_code[len], (unsigned)len);
+			while (entry < (1u << FAST_BITS)) {
+				table->fast[entry] = (uint16_t)((len << 9) | (int)symbol);
+				entry += 1u << len;
+			}
+		}
+		next_code[len]++;
+	}
+	return 0;
+}
+
+static void fill_bits(inflate_stream_t *stream)
+{
+	while (stream->bit_count <= 56) {
+		if (stream->in_len == 0 && !stream->failed && stream->pad_bytes == 0) {
+			if (stream->source(stream->ctx, &stream->in, &stream->in_len) == -1) {
+				stream->failed = 1;
+			}
+		}
+		uint8_t byte = 0;
+		if (stream->in_len > 0) {
+			byte = *stream->in++;
+			stream->in_len--;
+		} else {
+			stream->pad_bytes++;		// Checked once the caller's bytes are out, a valid stream never reads them.
+		}
+		stream->bit_buf |= (uint64_t)byte << stream->bit_count;
+		stream->bit_count += 8;
+	}
+}
+
+static unsigned get_bits(inflate_stream_t *stream, unsigned num_bits)
+{
+	if (stream->bit_count < num_bits) {
+		fill_bits(stream);
+	}
+	unsigned value = (unsigned)(stream->bit_buf & ((1u << num_bits) - 1));
+	stream->bit_buf >>= num_bits;
+	stream->bit_count -= num_bits;
+	return value;
+}
+
+static int decode_symbol(inflate_stream_t *stream, const huffman_t *table)
+{
+	if (stream->bit_count < 16) {
+		fill_bits(stream);
+	}
+	unsigned entry = table->fast[stream->bit_buf & ((1u << FAST_BITS) - 1)];
+	if (entry) {
+		unsigned len = entry >> 9;
+		stream->bit_buf >>= len;
+		stream->bit_count -= len;
+		return (int)(entry & 0x1FF);
+	}
+
+	int reversed = (int)reverse_bits((unsigned)(stream->bit_buf & 0xFFFF), 16);
+	int len;
+	for (len = FAST_BITS + 1; reversed >= table->max_code[len]; ++len) {
+	}
+	if (len >= 16) {
+		return -1;
+	}
+	int slot = (reversed >> (16 - len)) - table->first_code[len] + table->first_symbol[len];
+	if (slot < 0 || slot >= 288 || table->sizes[slot] != len) {
+		return -1;
+	}
+	stream->bit_buf >>= len;
+	stream->bit_count -= (unsigned)len;
+	return table->values[slot];
+}
+
+static int read_dynamic_tables(inflate_stream_t *stream)
+{
+	unsigned num_lit = get_bits(stream, 5) + 257;
+	unsigned num_dist = get_bits(stream, 5) + 1;
+	unsigned num_code_lengths = get_bits(stream, 4) + 4;
+	if (num_lit > 286 || num_dist > 30) {	// HLIT and HDIST can encode 288 and 32, which no valid stream uses.
+		return -1;
+	}
+
+	uint8_t code_lengths[19] = { 0 };
+	unsigned idx;
+	for (idx = 0; idx < num_code_lengths; ++idx) {
+		code_lengths[CODE_LENGTH_ORDER[idx]] = (uint8_t)get_bits(stream, 3);
+	}
+	huffman_t code_length_table;
+	if (build_huffman(&code_length_table, code_lengths, 19) == -1) {
+		return -1;
+	}
+
+	uint8_t lengths[288 + 32];		// Room for what the header can encode, even though more than 286 + 30 is rejected above.
+	unsigned total = num_lit + num_dist, count = 0;
+	while (count < total) {
+		int symbol = decode_symbol(stream, &code_length_table);
+		unsigned repeat;
+		uint8_t value = 0;
+		if (symbol < 0) {
+			return -1;
+		} else if (symbol < 16) {
+			lengths[count++] = (uint8_t)symbol;
+			continue;
+		} else if (symbol == 16) {		// Repeat the previous length.
+			if (count == 0) {
+				return -1;
+			}
+			value = lengths[count - 1];
+			repeat = 3 + get_bits(stream, 2);
+		} else if (symbol == 17) {
+			repeat = 3 + get_bits(stream, 3);
+		} else {
+			repeat = 11 + get_bits(stream, 7);
+		}
+		if (count + repeat > total) {
+			return -1;
+		}
+		memset(lengths + count, value, repeat);
+		count += repeat;
+	}
+	if (build_huffman(&stream->dynamic_lit, lengths, num_lit) == -1 || build_huffman(&stream->dynamic_dist, lengths + num_lit, num_dist) == -1) {
+		return -1;
+	}
+	stream->lit = &stream->dynamic_lit;
+	stream->dist = &stream->dynamic_dist;
+	return 0;
+}
+
+static int read_block_header(inflate_stream_t *stream)
+{
+	stream->final_block = (int)get_bits(stream, 1);
+	unsigned type = get_bits(stream, 2);
+
+	if (type == 0) {
+		get_bits(stream, stream->bit_count % 8);	// Stored blocks start on a byte boundary.
+		unsigned len = get_bits(stream, 16);
+		unsigned len_complement = get_bits(stream, 16);
+		if ((len ^ 0xFFFF) != len_complement) {
+			return -1;
+		}
+		stream->stored_left = len;
+		stream->block_type = BLOCK_STORED;
+		return 0;
+	} else if (type == 1) {
+		if (!stream->fixed_built) {
+			uint8_t lengths[288];
+			memset(lengths, 8, 144);
+			memset(lengths + 144, 9, 112);
+			memset(lengths + 256, 7, 24);
+			memset(lengths + 280, 8, 8);
+			build_huffman(&stream->fixed_lit, lengths, 288);
+			memset(lengths, 5, 30);
+			build_huffman(&stream->fixed_dist, lengths, 30);
+			stream->fixed_built = 1;
+		}
+		stream->lit = &stream->fixed_lit;
+		stream->dist = &stream->fixed_dist;
+		stream->block_type = BLOCK_HUFFMAN;
+		return 0;
+	} else if (type == 2) {
+		stream->block_type = BLOCK_HUFFMAN;
+		return read_dynamic_tables(stream);
+	}
+	return -1;
+}
+
+inflate_stream_t *inflate_open(inflate_source_fn_t source, void *ctx)
+{
+	inflate_stream_t *stream = calloc(1, sizeof(*stream));
+	if (stream == NULL) {
+		fprintf(stderr, "Error(%s): Unable to allocate the inflate stream.\n", __func__);
+		return NULL;
+	}
+	stream->source = source;
+	stream->ctx = ctx;
+	stream->block_type = BLOCK_NONE;
+
+	unsigned cmf = get_bits(stream, 8);
+	unsigned flg = get_bits(stream, 8);
+	if ((cmf & 0x0F) != 8 || (cmf * 256 + flg) % 31 != 0 || (flg & 0x20) || stream->failed) {	// Deflate, checksummed, no preset dictionary.
+		fprintf(stderr, "Error(%s): Invalid zlib header.\n", __func__);
+		free(stream);
+		return NULL;
+	}
+	return stream;
+}
+
+int inflate_read(inflate_stream_t *stream, uint8_t *out, size_t len)
+{
+	size_t produced = 0;
+	while (produced < len) {
+		if (stream->failed) {
+			break;
+		}
+		if (stream->copy_left > 0) {
+			size_t count = (stream->copy_left < len - produced) ? stream->copy_left : len - produced;
+			stream->copy_left -= count;
+			while (count-- > 0) {
+				uint8_t byte = stream->window[(stream->total_out - stream->copy_distance) & WINDOW_MASK];
+				stream->window[stream->total_out++ & WINDOW_MASK] = byte;
+				out[produced++] = byte;
+			}
+		} else if (stream->block_type == BLOCK_STORED && stream->stored_left > 0) {
+			uint8_t byte = (uint8_t)get_bits(stream, 8);
+			stream->stored_left--;
+			stream->window[stream->total_out++ & WINDOW_MASK] = byte;
+			out[produced++] = byte;
+		} else if (stream->block_type == BLOCK_HUFFMAN) {
+			int symbol = decode_symbol(stream, stream->lit);
+			if (symbol < 0 || symbol > 285) {
+				stream->failed = 1;
+			} else if (symbol < 256) {
+				stream->window[stream->total_out++ & WINDOW_MASK] = (uint8_t)symbol;
+				out[produced++] = (uint8_t)symbol;
+			} else if (symbol == END_OF_BLOCK) {
+				stream->block_type = BLOCK_NONE;
+			} else {
+				unsigned code = (unsigned)symbol - 257;
+				stream->copy_left = LENGTH_BASE[code] + get_bits(stream, LENGTH_EXTRA[code]);
+				int dist_code = decode_symbol(stream, stream->dist);
+				if (dist_code < 0 || dist_code > 29) {
+					stream->failed = 1;
+				} else {
+					stream->copy_distance = DIST_BASE[dist_code] + get_bits(stream, DIST_EXTRA[dist_code]);
+					if (stream->copy_distance > stream->total_out) {
+						stream->failed = 1;
+					}
+				}
+			}
+		} else if (stream->final_block) {
+			fprintf(stderr, "Error(%s): The compressed data ended %zu bytes early.\n", __func__, len - produced);
+			return -1;
+		} else {
+			stream->block_type = BLOCK_NONE;
+			if (read_block_header(stream) == -1) {
+				stream->failed = 1;
+			}
+		}
+	}
+
+	if (stream->failed || stream->pad_bytes * 8 > stream->bit_count) {	// Decoding ran into bytes the source never had.
+		fprintf(stderr, "Error(%s): The compressed data is corrupt or truncated.\n", __func__);
+		stream->failed = 1;
+		return -1;
+	}
+	return 0;
+}
+
+void inflate_close(inflate_stream_t *stream)
+{
+	free(stream);
+}
@@ -0,0 +1,39 @@
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+Incremental zlib (RFC 1950/1951) streams for the row-band PNG reader and writer. Only a few rows are
+in memory at a time: deflate_write() takes any amount of input and passes compressed bytes to the
+sink as its buffer fills, and inflate_read() pulls compressed bytes from the source only as they
+are needed to produce the requested output. Both keep the 32KB window between calls.
+
+deflate_open_raw() starts bare deflate data with no zlib header or checksum, for pieces of one
+stream compressed on separate threads. The dictionary is the data just before the piece, so matches
+can reach back across the seam. Every piece but the last ends with a sync flush, which leaves it
+byte aligned so the pieces can simply be concatenated.
+*/
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len);	// Start with 0.
+uint32_t adler32_update(uint32_t adler, const uint8_t *data, size_t len);	// Start with 1.
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2);	// Adler-32 of two pieces joined, len2 the length of the second.
+
+typedef int (*deflate_sink_fn_t)(void *ctx, const uint8_t *data, size_t len);		// Returns -1 to abort.
+typedef int (*inflate_source_fn_t)(void *ctx, const uint8_t **data, size_t *len);	// *len 0 at the end, -1 on errors.
+
+typedef struct deflate_stream deflate_stream_t;
+typedef struct inflate_stream inflate_stream_t;
+
+deflate_stream_t *deflate_open(deflate_sink_fn_t sink, void *ctx);
+int deflate_write(deflate_stream_t *stream, const uint8_t *data, size_t len);
+int deflate_close(deflate_stream_t *stream);	// Finishes the stream and frees it, also after errors.
+deflate_stream_t *deflate_open_raw(deflate_sink_fn_t sink, void *ctx, const uint8_t *dict, size_t dict_len);
+int deflate_close_raw(deflate_stream_t *stream, int last);	// Like deflate_close(), last ends the whole stream.
+
+inflate_stream_t *inflate_open(inflate_source_fn_t source, void *ctx);
+int inflate_read(inflate_stream_t *stream, uint8_t *out, size_t len);	// Exactly len bytes or -1.
+void inflate_close(inflate_stream_t *stream);
+
+#endif
@@ -1,129 +1,469 @@
-#include "image_io.h"
 #include "pix_diff.h"
+#include "diff_job.h"
+#include "diff_batch.h"
+#include "diff_tree.h"
+#include "diff_stream.h"
+#include "numa.h"
+#include "diff_serve.h"
+#include "image_cache.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <string.h>
+#include <inttypes.h>
 
 /*
 The purpose of this program is to subtract one image layer's RGB values from
 another and output it's result in .rgba format. 
 */
 
-int main(int argc, char *argv[])
+typedef struct {
+	const char *image1;
+	const char *image2;
+	const char *output;		// NULL with --no-output.
+	diff_mode_t mode;
+	diff_kernel_t kernel;
+	int stats;			// Print the changed pixel count and per-channel max/sum of the difference.
+	int no_output;			// Only the numbers are wanted, skip encoding and writing the output image.
+	int check;			// Only report whether the images are identical, through the exit status.
+	int threshold;			// Write a changed/unchanged mask using the per-channel tolerance below.
+	uint8_t tolerance[3];		// R G B
+	int crop;			// Write only the bounding box of the changed pixels.
+	int threads;			// Threads to split the work across, 0 for one per online processor.
+	int stream;			// Decode, difference and encode row bands in a pipeline instead of whole images.
+	const char *batch;		// Manifest of pairs to run in one process, instead of the positional images.
+	int pool_stats;			// Print the work-stealing counters of every thread at the end.
+	numa_placement_t numa;		// Where the threads run and the image buffers are placed.
+	const char *serve;		// Unix socket to take requests on, instead of running once.
+	size_t cache_mb;		// Budget for the daemon's decoded images.
+	size_t arena_mb;		// Cap on the freed image buffers kept for the next pairs.
+	image_map_t map;		// Raw RGBA inputs are mapped instead of read.
+} diff_options_t;
+
+#define DEFAULT_CACHE_MB	1024
+#define DEFAULT_ARENA_MB	256
+
+static void print_usage(const char *prog)
 {
-	if (argc < 4 || argc > 6) {
-		fprintf(stderr, "Usage: %s <image1> <image2> <output.{png,rgba}> [absolute|abs|saturated|sat|modular|mod] [disable_neon]\n", argv[0]);
-		return EXIT_FAILURE;
-	}
-
-	diff_mode_t mode = ABS;		// Set default mode to absolute.
-	int disable_neon = 0;
-	if (argc >= 5) {
-		if ((strcmp(argv[4], "saturated") == 0)||(strcmp(argv[4], "sat") == 0)) {
-			mode = SAT;
-		} else if ((strcmp(argv[4], "modular") == 0)||(strcmp(argv[4], "mod") == 0)) {
-			mode = MOD;
-		} else if ((strcmp(argv[4], "absolute") == 0)||(strcmp(argv[4], "abs") == 0)) {
-			mode = ABS;
-		} else if (strcmp(argv[4], "disable_neon") == 0) {
-			disable_neon = 1;
-			if (argc == 6) {	// If argv[4] is 'disable_neon', nothing should be in argv[5].
-				fprintf(stderr, "Error(%s): Invalid argument '%s' after '%s'.\n", __func__, argv[5], argv[4]);
-				fprintf(stderr, "Usage: %s <image1> <image2> <output.{png,rgba}> [absolute|abs|saturated|sat|modular|mod] [disable_neon]\n", argv[0]);
-				return EXIT_FAILURE;
-			}
+	fprintf(stderr, "Usage: %s [options] <image1> <image2> <output.{png,rgba}> [mode] [kernel]\n", prog);
+	fprintf(stderr, "       %s [options] <dir1> <dir2> <output_dir> [mode] [kernel]\n", prog);
+	fprintf(stderr, "       %s [options] --batch=<manifest> [mode] [kernel]\n", prog);
+	fprintf(stderr, "       %s [-j N|auto] [--numa=...] [--cache-mb=N] --serve=<socket>\n", prog);
+	fprintf(stderr, "	mode:	absolute|abs (default), saturated|sat, modular|mod\n");
+	fprintf(stderr, "	kernel:	auto (default), scalar, swar, sse2, avx2, avx512, neon, neon_x4, sve, disable_neon\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "	-j N|auto	Split the work into row bands across N threads, or one per online processor. Default 1.\n");
+	fprintf(stderr, "	--stats		Print the changed pixel count and per-channel max and sum of the difference.\n");
+	fprintf(stderr, "	--no-output	Do not write an output image, <output> is left out.\n");
+	fprintf(stderr, "	--check		Stop at the first differing pixel and write nothing. <output> and mode are left out.\n");
+	fprintf(stderr, "			Exits with 0 if the images are identical (ignoring alpha), 1 if they differ and 2 on errors.\n");
+	fprintf(stderr, "			Images of different dimensions differ: 'Check: differ in dimensions' and exit 1.\n");
+	fprintf(stderr, "	--threshold=N|R,G,B\n");
+	fprintf(stderr, "			Write an 8-bit mask of pixels whose absolute difference exceeds the tolerance in any\n");
+	fprintf(stderr, "			channel, instead of the difference. Mode is ignored. Exits like --check, and for images\n");
+	fprintf(stderr, "			of different dimensions prints 'Threshold: differ in dimensions', writes no mask and exits 1.\n");
+	fprintf(stderr, "	--stream	Pipeline row bands from the decoders through the kernel into the encoder, so memory\n");
+	fprintf(stderr, "			follows the image width instead of its area. Combines with --stats and --no-output.\n");
+	fprintf(stderr, "	--crop		Write only the smallest rectangle holding every changed pixel and print its offset.\n");
+	fprintf(stderr, "			Needs image dimensions, so at least one input must be a PNG.\n");
+	fprintf(stderr, "	--mmap[=sequential|populate]\n");
+	fprintf(stderr, "			Map raw RGBA inputs instead of reading them into memory, and write the difference to a\n");
+	fprintf(stderr, "			buffer of its own. 'populate' faults every page in up front. Off by default.\n");
+	fprintf(stderr, "	--batch=FILE	Run every pair listed in FILE ('-' for stdin), one '<image1> <image2> <output> [mode]'\n");
+	fprintf(stderr, "			per line, across the -j threads. Prints a 'Pair:' line with each pair's exit status\n");
+	fprintf(stderr, "			and exits with the highest. The mode given here is the default for the lines.\n");
+	fprintf(stderr, "	Given two directories, every image under the first is compared with the one at the same relative\n");
+	fprintf(stderr, "	path under the second across the -j threads, the outputs mirror the tree under <output_dir> and\n");
+	fprintf(stderr, "	images in only one tree are reported as 'Missing:' or 'Extra:'.\n");
+	fprintf(stderr, "	--pool-stats	Print the indices run, ranges stolen and idle time of every thread at the end.\n");
+	fprintf(stderr, "	--numa=auto|off|local|interleave\n");
+	fprintf(stderr, "			Pin the threads node by node and place image pages on the node of the thread that\n");
+	fprintf(stderr, "			differences them (local) or round-robin over all nodes (interleave). 'auto' is local\n");
+	fprintf(stderr, "			on machines with several NUMA nodes and off otherwise.\n");
+	fprintf(stderr, "	--serve=SOCKET	Run as a daemon on a Unix domain socket. Each line sent is one request with the\n");
+	fprintf(stderr, "			arguments of a single run, answered with its result lines and a 'Status:' line.\n");
+	fprintf(stderr, "	--cache-mb=N	Keep up to N MB of decoded images between daemon requests. Default %d.\n", DEFAULT_CACHE_MB);
+	fprintf(stderr, "	--arena-mb=N	Keep up to N MB of freed image buffers, faulted in already, for the next batch, tree\n");
+	fprintf(stderr, "			or daemon pairs of the same size. 0 frees them at once. Default %d.\n", DEFAULT_ARENA_MB);
+}
+
+static int parse_tolerance(const char *spec, uint8_t tolerance[3])	// "N" for every channel or "R,G,B".
+{
+	unsigned long values[3];
+	int num_values = 0;
+	const char *cursor = spec;
+	char *end = NULL;
+
+	for (;;) {
+		values[num_values] = strtoul(cursor, &end, 10);
+		if (end == cursor || values[num_values] > 255) {
+			return -1;
 		}
-		else {
-			disable_neon = 1;
-			fprintf(stderr, "Error(%s): Invalid fifth argument '%s'.\n", __func__, argv[4]);
-			fprintf(stderr, "Usage: %s <image1> <image2> <output.{png,rgba}> [absolute|abs|saturated|sat|modular|mod] [disable_neon]\n", argv[0]);
-			return EXIT_FAILURE;
+		num_values++;
+		if (*end != ',' || num_values == 3) {
+			break;
 		}
-		if (argc == 6 && !disable_neon) {	// If argv[4] was disable_neon, argv[5] would not be checked for disable_neon here.
-			if (strcmp(argv[5], "disable_neon") == 0) {
-				disable_neon = 1;
-			} else {
-				fprintf(stderr, "Error(%s): Invalid sixth argument '%s'.\n)", __func__, argv[5]);
-				fprintf(stderr, "Usage: %s <image1> <image2> <output.{png,rgba}> [absolute|abs|saturated|sat|modular|mod] [disable_neon]\n", argv[0]);
-				return EXIT_FAILURE;
+		cursor = end + 1;
+	}
+	if (*end != '\0' || num_values == 2) {		// Only one or three values, and nothing trailing.
+		return -1;
+	}
+
+	int channel;
+	for (channel = 0; channel < 3; ++channel) {
+		tolerance[channel] = (uint8_t)values[num_values == 1 ? 0 : channel];
+	}
+	return 0;
+}
+
+static int parse_threads(const char *spec, int *threads)	// "auto" or a positive count.
+{
+	if (strcmp(spec, "auto") == 0) {
+		*threads = 0;
+		return 0;
+	}
+	char *end = NULL;
+	long count = strtol(spec, &end, 10);
+	if (end == spec || *end != '\0' || count < 1 || count > 1024) {
+		return -1;
+	}
+	*threads = (int)count;
+	return 0;
+}
+
+static int parse_args(int argc, char *argv[], diff_options_t *opts, FILE *err)	// The daemon points err at the connection.
+{
+	const char *positional[5];		// <image1> <image2> [<output>] [mode] [kernel]
+	int num_positional = 0;
+
+	int arg_idx;
+	for (arg_idx = 1; arg_idx < argc; ++arg_idx) {	// Options may appear anywhere, everything else is positional.
+		if (strcmp(argv[arg_idx], "--stats") == 0) {
+			opts->stats = 1;
+		} else if (strcmp(argv[arg_idx], "--no-output") == 0) {
+			opts->no_output = 1;
+		} else if (strcmp(argv[arg_idx], "--check") == 0) {
+			opts->check = 1;
+			opts->no_output = 1;
+		} else if (strcmp(argv[arg_idx], "--stream") == 0) {
+			opts->stream = 1;
+		} else if (strcmp(argv[arg_idx], "--crop") == 0) {
+			opts->crop = 1;
+		} else if (strcmp(argv[arg_idx], "--mmap") == 0 || strcmp(argv[arg_idx], "--mmap=sequential") == 0) {
+			opts->map = IMAGE_MAP_SEQUENTIAL;
+		} else if (strcmp(argv[arg_idx], "--mmap=populate") == 0) {
+			opts->map = IMAGE_MAP_POPULATE;
+		} else if (strncmp(argv[arg_idx], "-j", 2) == 0) {	// -j N or -jN
+			const char *spec = argv[arg_idx][2] ? argv[arg_idx] + 2 : (arg_idx + 1 < argc ? argv[++arg_idx] : "");
+			if (parse_threads(spec, &opts->threads) == -1) {
+				fprintf(err, "Error(%s): Invalid thread count '%s', expected 1 to 1024 or 'auto'.\n", __func__, spec);
+				return -1;
 			}
+		} else if (strncmp(argv[arg_idx], "--threshold=", 12) == 0) {
+			opts->threshold = 1;
+			if (parse_tolerance(argv[arg_idx] + 12, opts->tolerance) == -1) {
+				fprintf(err, "Error(%s): Invalid tolerance '%s', expected N or R,G,B from 0 to 255.\n", __func__, argv[arg_idx] + 12);
+				return -1;
+			}
+		} else if (strcmp(argv[arg_idx], "--pool-stats") == 0) {
+			opts->pool_stats = 1;
+		} else if (strncmp(argv[arg_idx], "--numa=", 7) == 0) {
+			if (numa_placement_parse(argv[arg_idx] + 7, &opts->numa) == -1) {
+				fprintf(err, "Error(%s): Invalid NUMA placement '%s', expected auto, off, local or interleave.\n", __func__, argv[arg_idx] + 7);
+				return -1;
+			}
+		} else if (strncmp(argv[arg_idx], "--serve=", 8) == 0) {
+			opts->serve = argv[arg_idx] + 8;
+		} else if (strncmp(argv[arg_idx], "--cache-mb=", 11) == 0) {
+			char *end = NULL;
+			unsigned long long megabytes = strtoull(argv[arg_idx] + 11, &end, 10);
+			if (end == argv[arg_idx] + 11 || *end != '\0' || megabytes > (SIZE_MAX >> 20)) {
+				fprintf(err, "Error(%s): Invalid cache size '%s', expected a number of megabytes.\n", __func__, argv[arg_idx] + 11);
+				return -1;
+			}
+			opts->cache_mb = (size_t)megabytes;
+		} else if (strncmp(argv[arg_idx], "--arena-mb=", 11) == 0) {
+			char *end = NULL;
+			unsigned long long megabytes = strtoull(argv[arg_idx] + 11, &end, 10);
+			if (end == argv[arg_idx] + 11 || *end != '\0' || megabytes > (SIZE_MAX >> 20)) {
+				fprintf(err, "Error(%s): Invalid arena size '%s', expected a number of megabytes.\n", __func__, argv[arg_idx] + 11);
+				return -1;
+			}
+			opts->arena_mb = (size_t)megabytes;
+		} else if (strncmp(argv[arg_idx], "--batch=", 8) == 0) {
+			opts->batch = argv[arg_idx] + 8;
+		} else if (strncmp(argv[arg_idx], "--", 2) == 0) {
+			fprintf(err, "Error(%s): Unknown option '%s'.\n", __func__, argv[arg_idx]);
+			return -1;
+		} else if (num_positional < (int)(sizeof(positional) / sizeof(positional[0]))) {
+			positional[num_positional++] = argv[arg_idx];
+		} else {
+			fprintf(err, "Error(%s): Too many arguments, unexpected '%s'.\n", __func__, argv[arg_idx]);
+			return -1;
 		}
 	}
 
-	uint32_t *img1 = NULL;
-	uint32_t *img2 = NULL;
-	size_t size1, size2;
-	int width1 = 0, height1 = 0;
-	int width2 = 0, height2 = 0;
+	if (opts->check + opts->stats + opts->threshold > 1) {
+		fprintf(err, "Error(%s): '--check', '--stats' and '--threshold' can not be combined.\n", __func__);
+		return -1;
+	}
 
-	if (read_image(argv[1], &img1, &size1, &width1, &height1) == -1) {
-		fprintf(stderr, "Error(%s): Could not read '%s'.\n", __func__, argv[1]);
-		goto err;
+	if (opts->crop && (opts->check || opts->stats || opts->threshold || opts->no_output)) {
+		fprintf(err, "Error(%s): '--crop' writes the difference image, it can not be combined with other modes or '--no-output'.\n", __func__);
+		return -1;
 	}
-	if (read_image(argv[2], &img2, &size2, &width2, &height2) == -1) {
-		fprintf(stderr, "Error(%s): Could not read '%s'.\n", __func__, argv[2]);
-		goto err;
+
+	if (opts->stream && (opts->check || opts->threshold || opts->crop || opts->map)) {
+		fprintf(err, "Error(%s): '--stream' only combines with '--stats' and '--no-output'.\n", __func__);
+		return -1;
 	}
 
-	if (size1 != size2) {
-		fprintf(stderr, "Error(%s): Images must be the same dimensions.\n", __func__);
-		goto err;
+	if (opts->batch && opts->stream) {
+		fprintf(err, "Error(%s): '--batch' and '--stream' can not be combined.\n", __func__);
+		return -1;
 	}
-	if (size1 == 0) {	// Sizes must be the same so only check size1.
-		fprintf(stderr, "Error(%s): Input images have a size of 0, cannot subtract images.\n", __func__);
-		goto err;
+
+	if (opts->serve && (opts->batch || opts->stream || opts->check || opts->stats || opts->threshold || opts->crop || opts->no_output || opts->map || num_positional > 0)) {
+		fprintf(err, "Error(%s): '--serve' only combines with '-j', '--numa', '--cache-mb', '--arena-mb' and '--pool-stats', the requests bring everything else.\n", __func__);
+		return -1;
 	}
-	if ((img1 == NULL) || (img2 == NULL)) {
-		fprintf(stderr, "Error(%s): Image buffer is NULL, despite a non-zero size after reading.\n", __func__);
-		goto err;
+	if (opts->serve) {
+		return 0;
 	}
 
-	if (((width1 != 0) && (height1 != 0) && (width2 != 0) && (height2 != 0)) &&	// Check for matching PNG input dimensions. This should only execute if two PNGs are provided. 
-	     (width1 != width2 || height1 != height2)) {
-		fprintf(stderr, "Error(%s): Image dimensions must be the same/non zero. '%s is %dx%d, and '%s' is %dx%d.\n",
-			__func__, argv[1], width1, height1, argv[2], width2, height2);
-		goto err;
+	int num_required = opts->batch ? 0 : (opts->no_output ? 2 : 3);	// The manifest names the images.
+	if (num_positional < num_required || num_positional > num_required + 2) {
+		fprintf(err, "Error(%s): Expected %d to %d positional arguments, got %d.\n", __func__, num_required, num_required + 2, num_positional);
+		return -1;
+	}
+	if (!opts->batch) {
+		opts->image1 = positional[0];
+		opts->image2 = positional[1];
+		opts->output = opts->no_output ? NULL : positional[2];
 	}
 
-#ifdef __ARM_NEON
-	if (disable_neon) {
-		fprintf(stdout, "Info(%s): Using scalar differencing. NEON differencing disabled.\n", __func__);
-		diff_scalar(img1, img2, size1, mode);
-	} else {
-		fprintf(stdout, "Info(%s): Using NEON differencing.\n", __func__);
-		diff_neon(img1, img2, size1, mode);
+	int mode_set = 0, kernel_set = 0;
+	for (arg_idx = num_required; arg_idx < num_positional; ++arg_idx) {	// Mode and kernel may come in either order, but each only once.
+		if (!mode_set && diff_mode_parse(positional[arg_idx], &opts->mode) == 0) {
+			mode_set = 1;
+		} else if (!kernel_set && diff_kernel_parse(positional[arg_idx], &opts->kernel) == 0) {
+			kernel_set = 1;
+		} else {
+			fprintf(err, "Error(%s): Invalid or repeated argument '%s'.\n", __func__, positional[arg_idx]);
+			return -1;
+		}
 	}
-#else
-	fprintf(stdout, "Info(%s): Using scalar differencing. (NEON differencing is not compiled.)\n", __func__);
-	diff_scalar(img1, img2, size1, mode);
-#endif
+	return 0;
+}
+
+static void print_pool_stats(const diff_options_t *opts, const thread_pool_t *pool)	// For tuning --batch and -j, thread 0 is the main thread.
+{
+	if (!opts->pool_stats || pool == NULL) {
+		return;
+	}
+	int thread;
+	for (thread = 0; thread < thread_pool_size(pool); ++thread) {
+		thread_pool_stats_t stats;
+		thread_pool_stats(pool, thread, &stats);
+		fprintf(stdout, "Pool: thread=%d tasks=%" PRIu64 " steals=%" PRIu64 " idle_ms=%.1f\n", thread, stats.tasks, stats.steals, (double)stats.idle_ns / 1e6);
+	}
+}
+
+static void print_arena_stats(void)	// For sizing --arena-mb.
+{
+	image_arena_stats_t stats;
+	image_arena_stats(&stats);
+	fprintf(stdout, "Info(%s): Arena hits=%" PRIu64 " misses=%" PRIu64 " buffers=%zu bytes=%zu.\n", __func__, stats.hits, stats.misses, stats.buffers, stats.retained_bytes);
+}
+
+static diff_job_t job_from_options(const diff_options_t *opts, diff_kernel_t kernel, FILE *out, FILE *err)	// Without pools, the caller picks those.
+{
+	diff_job_t job = { .image1 = opts->image1, .image2 = opts->image2, .output = opts->output, .mode = opts->mode, .kernel = kernel,
+			   .stats = opts->stats, .check = opts->check, .threshold = opts->threshold, .crop = opts->crop, .map = opts->map, .out = out, .err = err };
+	memcpy(job.tolerance, opts->tolerance, sizeof(job.tolerance));
+	return job;
+}
 
-	int width_for_png = 0, height_for_png = 0;
+typedef struct {
+	thread_pool_t *pool;
+	thread_pool_t *decode_pool;
+	image_cache_t *cache;
+	diff_job_buffers_t buffers;	// Output and mask, reused by every request.
+} serve_context_t;
 
-	if ((width1 != 0) && (height1 != 0)) {
-		width_for_png = width1;
-		height_for_png = height1;
-	} else if ((width2 != 0) && (height2 != 0)) {
-		width_for_png = width2;
-		height_for_png = height2;
+static int serve_request(int argc, char *argv[], FILE *out, void *arg)	// One daemon request, run like main() runs once but on cached inputs.
+{
+	serve_context_t *serve = arg;
+	diff_options_t opts = { .mode = ABS, .kernel = KERNEL_AUTO, .threads = 1 };
+	if (parse_args(argc, argv, &opts, out) == -1) {
+		return (opts.check || opts.threshold) ? CHECK_TROUBLE : EXIT_FAILURE;
+	}
+	int exit_status = (opts.check || opts.threshold) ? CHECK_TROUBLE : EXIT_FAILURE;	// Returned on errors.
+	if (opts.serve || opts.batch || opts.stream) {
+		fprintf(out, "Error(%s): '--serve', '--batch' and '--stream' are not available in requests.\n", __func__);
+		return exit_status;
+	}
+	diff_kernel_t kernel = opts.kernel;
+	if (diff_kernel_out_fn(kernel) == NULL) {
+		fprintf(out, "Error(%s): The '%s' kernel is not supported by this build or processor.\n", __func__, diff_kernel_name(kernel));
+		return exit_status;
 	}
+	if (kernel == KERNEL_AUTO) {
+		kernel = diff_best_kernel();
+	}
+
+	diff_job_t job = job_from_options(&opts, kernel, out, out);	// -j, --numa and --pool-stats are the daemon's, and ignored here.
+	job.pool = opts.check ? NULL : serve->pool;
+	job.decode_pool = serve->decode_pool;
+	job.cache = serve->cache;
+	return diff_job_run(&job, &serve->buffers);
+}
 
-	if (write_image(argv[3], img1, size1, width_for_png, height_for_png) == -1) {
-		fprintf(stderr, "Error(%s): Failed to write to output image '%s'.", __func__, argv[3]);
-		goto err;
+static int serve(const diff_options_t *opts, thread_pool_t *pool)
+{
+	serve_context_t context = { .pool = pool, .decode_pool = pool ? pool : thread_pool_create(2), .cache = image_cache_create(opts->cache_mb << 20) };
+	int result = -1;
+	image_arena_set_cap(opts->arena_mb << 20);
+	if (context.cache != NULL) {
+		fprintf(stdout, "Info(%s): Keeping up to %zu MB of decoded images.\n", __func__, opts->cache_mb);
+		result = diff_serve_run(opts->serve, serve_request, &context);
+		image_cache_stats_t stats;
+		image_cache_stats(context.cache, &stats);
+		fprintf(stdout, "Info(%s): Cache entries=%zu bytes=%zu hits=%" PRIu64 " misses=%" PRIu64 " evictions=%" PRIu64 ".\n",
+			__func__, stats.entries, stats.bytes, stats.hits, stats.misses, stats.evictions);
+		print_arena_stats();
+	}
+	diff_job_buffers_free(&context.buffers);
+	image_cache_destroy(context.cache);
+	image_arena_set_cap(0);
+	if (context.decode_pool != pool) {
+		thread_pool_destroy(context.decode_pool);
 	}
+	return result;
+}
 
-	free(img1);	// Dump image memory on success path.
-	free(img2);
+static numa_placement_t start_placement(numa_placement_t placement)	// Before any thread is created, they all inherit the memory policy.
+{
+	if (placement == NUMA_AUTO) {
+		placement = (numa_num_nodes() > 1) ? NUMA_LOCAL : NUMA_OFF;
+	}
+	if (placement == NUMA_INTERLEAVE && numa_interleave_memory() == -1) {	// Warns, the pages are then placed locally.
+		placement = NUMA_LOCAL;
+	}
+	return placement;
+}
 
-	return EXIT_SUCCESS;
+static void place_threads(numa_placement_t placement, thread_pool_t *pool)	// Before the images are allocated, so their pages follow the placement.
+{
+	if (placement == NUMA_OFF || pool == NULL) {
+		return;
+	}
 
-err:	// Dumps memory if image reading or writing error. 
-	if (img1) free(img1);
-	if (img2) free(img2);
-	fprintf(stderr, "Error(%s): Exiting due to failure.\n", __func__);	// There will be specific descriptive to the error messages above this from throughout the program.
-	return EXIT_FAILURE;
+	int *cpus = malloc((size_t)thread_pool_size(pool) * sizeof(int));
+	if (cpus != NULL && numa_thread_cpus(thread_pool_size(pool), cpus) == 0 && thread_pool_pin(pool, cpus) == 0) {
+		fprintf(stdout, "Info(%s): Pinned %d threads over %d NUMA nodes, %s placement.\n", __func__, thread_pool_size(pool), numa_num_nodes(), numa_placement_name(placement));
+	}
+	free(cpus);
 }
 
+int main(int argc, char *argv[])
+{
+	diff_options_t opts = { .mode = ABS, .kernel = KERNEL_AUTO, .threads = 1, .numa = NUMA_AUTO, .cache_mb = DEFAULT_CACHE_MB, .arena_mb = DEFAULT_ARENA_MB };	// Set default mode to absolute.
+	if (parse_args(argc, argv, &opts, stderr) == -1) {
+		print_usage(argv[0]);
+		return (opts.check || opts.threshold) ? CHECK_TROUBLE : EXIT_FAILURE;
+	}
+	int exit_status = (opts.check || opts.threshold) ? CHECK_TROUBLE : EXIT_FAILURE;	// Returned on errors.
+	diff_mode_t mode = opts.mode;
+	diff_kernel_t kernel = opts.kernel;
+
+	diff_out_fn_t diff_fn = diff_kernel_out_fn(kernel);	// Resolves 'auto' to the widest kernel this processor supports.
+	if (diff_fn == NULL) {
+		fprintf(stderr, "Error(%s): The '%s' kernel is not supported by this build or processor.\n", __func__, diff_kernel_name(kernel));
+		return exit_status;
+	}
+	if (kernel == KERNEL_AUTO) {
+		kernel = diff_best_kernel();
+	}
+
+	int tree = !opts.serve && !opts.batch && diff_tree_is_directory(opts.image1);	// Two directories compare every image they hold.
+	if (tree && opts.stream) {
+		fprintf(stderr, "Error(%s): '--stream' can not compare directory trees.\n", __func__);
+		return exit_status;
+	}
+
+	numa_placement_t placement = start_placement(opts.numa);
+	thread_pool_t *pool = NULL;		// Stays NULL for a single thread, the drivers then run in place.
+	int threads = opts.threads ? opts.threads : thread_pool_online_cpus();
+	if (threads > 1 && (!opts.check || opts.batch || tree)) {	// --check stops at the first difference and stays on one thread, unless there are many pairs.
+		pool = thread_pool_create(threads);
+		if (pool == NULL) {
+			return exit_status;
+		}
+		fprintf(stdout, "Info(%s): Splitting the work across %d threads.\n", __func__, thread_pool_size(pool));
+	}
+	place_threads(placement, pool);
+	if (placement == NUMA_LOCAL && pool != NULL && opts.arena_mb > 0) {	// A recycled buffer keeps the pages of the node that first touched it, not the one differencing it now.
+		fprintf(stdout, "Info(%s): Not recycling image buffers under local NUMA placement.\n", __func__);
+		opts.arena_mb = 0;
+	}
+
+	if (opts.serve) {
+		if (serve(&opts, pool) == -1) {
+			fprintf(stderr, "Error(%s): Exiting due to failure.\n", __func__);
+			exit_status = EXIT_FAILURE;
+		} else {
+			exit_status = EXIT_SUCCESS;
+		}
+		print_pool_stats(&opts, pool);
+		thread_pool_destroy(pool);
+		return exit_status;
+	}
+
+	if (opts.stream) {
+		fprintf(stdout, "Info(%s): Using %s differencing.\n", __func__, diff_kernel_name(kernel));
+		diff_stream_t stream = { .image1 = opts.image1, .image2 = opts.image2, .output = opts.output, .diff_fn = diff_fn,
+					 .stats_fn = opts.stats ? diff_kernel_stats_fn(kernel) : NULL, .mode = mode, .pool = pool };
+		if (diff_stream_run(&stream) == -1) {
+			fprintf(stderr, "Error(%s): Exiting due to failure.\n", __func__);
+			thread_pool_destroy(pool);
+			return exit_status;
+		}
+		if (opts.stats) {
+			diff_stats_print(stdout, &stream.stats, stream.num_pixels);
+		}
+		print_pool_stats(&opts, pool);
+		thread_pool_destroy(pool);
+		return EXIT_SUCCESS;
+	}
+
+	fprintf(stdout, "Info(%s): Using %s %s.\n", __func__, diff_kernel_name(kernel), opts.check ? "comparison" : opts.threshold ? "thresholding" : "differencing");
+	diff_job_t job = job_from_options(&opts, kernel, stdout, stderr);
+
+	job.pool = pool;
+	if (opts.batch || tree) {	// Pairs are tasks on the pool, and so are the bands of every pair.
+		job.decode_pool = pool;
+		image_arena_set_cap(opts.arena_mb << 20);
+		exit_status = opts.batch ? diff_batch_run(opts.batch, &job, !opts.no_output, pool) : diff_tree_run(opts.image1, opts.image2, opts.output, &job, pool);
+		print_arena_stats();
+		image_arena_set_cap(0);
+		print_pool_stats(&opts, pool);
+		thread_pool_destroy(pool);
+		return exit_status;
+	}
+
+	job.decode_pool = pool ? pool : thread_pool_create(2);	// Both inputs are decoded at once, even with -j 1.
+	diff_job_buffers_t buffers = { { NULL, NULL }, { 0, 0 }, NULL, 0 };
+	exit_status = diff_job_run(&job, &buffers);
+	diff_job_buffers_free(&buffers);
+	if (job.decode_pool != pool) {
+		thread_pool_destroy(job.decode_pool);
+	}
+	print_pool_stats(&opts, pool);
+	thread_pool_destroy(pool);
+	if (exit_status == ((opts.check || opts.threshold) ? CHECK_TROUBLE : EXIT_FAILURE)) {
+		fprintf(stderr, "Error(%s): Exiting due to failure.\n", __func__);
+	}
+	return exit_status;
+}
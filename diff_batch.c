@@ -0,0 +1,290 @@
+#define _POSIX_C_SOURCE 200809L		// getline(), open_memstream() and strtok_r().
+#include "diff_batch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define READ_AHEAD_BYTES	(256u << 20)	// Files read and not yet decoded.
+
+typedef struct {
+	diff_batch_pair_t spec;
+	char *text;			// The manifest line, which the names in spec point into.
+	int valid;
+
+	int status;
+	char *report;			// Result lines written by the job.
+	size_t report_len;
+	int done;
+} batch_pair_t;
+
+typedef struct {
+	const diff_job_t *defaults;
+	batch_pair_t *pairs;
+	size_t num_pairs;
+	int error_status;		// For pairs that could not run at all.
+	file_prefetch_t *prefetch;	// Reads both inputs of every pair ahead of the threads running them.
+
+	pthread_mutex_t lock;		// Guards everything below.
+	size_t next_report;		// First pair not printed yet.
+	int highest_status;
+	diff_job_buffers_t *buffers;	// One set per thread that can run at once.
+	size_t *free_buffers;		// Stack of unused indexes into buffers.
+	size_t num_free;
+} batch_t;
+
+static int parse_line(batch_pair_t *pair, const diff_job_t *defaults, int with_output, const char *manifest)
+{
+	const char *fields[5];
+	int num_fields = 0;
+	char *save = NULL;
+	char *token;
+	for (token = strtok_r(pair->text, " \t\r\n", &save); token != NULL; token = strtok_r(NULL, " \t\r\n", &save)) {
+		if (num_fields == 5) {
+			break;
+		}
+		fields[num_fields++] = token;
+	}
+
+	int num_required = with_output ? 3 : 2;
+	if (num_fields < num_required || num_fields > num_required + 1) {
+		fprintf(stderr, "Error(%s): Line %d of '%s' has %d fields, expected %d or %d.\n", __func__, pair->spec.line, manifest, num_fields, num_required, num_required + 1);
+		return -1;
+	}
+	pair->spec.image1 = fields[0];
+	pair->spec.image2 = fields[1];
+	pair->spec.output = with_output ? fields[2] : NULL;
+	pair->spec.mode = defaults->mode;
+	if (num_fields > num_required && diff_mode_parse(fields[num_required], &pair->spec.mode) == -1) {
+		fprintf(stderr, "Error(%s): Line %d of '%s' has an invalid mode '%s'.\n", __func__, pair->spec.line, manifest, fields[num_required]);
+		return -1;
+	}
+	return 0;
+}
+
+static int read_manifest(const char *manifest, const diff_job_t *defaults, int with_output, batch_t *batch)
+{
+	FILE *file = (strcmp(manifest, "-") == 0) ? stdin : fopen(manifest, "r");
+	if (file == NULL) {
+		fprintf(stderr, "Error(%s): Unable to open the manifest '%s'.\n", __func__, manifest);
+		return -1;
+	}
+
+	size_t capacity = 0;
+	char *line = NULL;
+	size_t line_capacity = 0;
+	int line_number = 0;
+	int result = 0;
+	while (getline(&line, &line_capacity, file) != -1) {
+		++line_number;
+		size_t skip = strspn(line, " \t\r\n");
+		if (line[skip] == '\0' || line[skip] == '#') {
+			continue;
+		}
+		if (batch->num_pairs == capacity) {
+			capacity = capacity ? 2 * capacity : 256;
+			batch_pair_t *grown = realloc(batch->pairs, capacity * sizeof(batch_pair_t));
+			if (grown == NULL) {
+				fprintf(stderr, "Error(%s): Unable to allocate %zu pairs.\n", __func__, capacity);
+				result = -1;
+				break;
+			}
+			batch->pairs = grown;
+		}
+		batch_pair_t *pair = &batch->pairs[batch->num_pairs];
+		memset(pair, 0, sizeof(*pair));
+		pair->spec.line = line_number;
+		pair->text = strdup(line);
+		if (pair->text == NULL) {
+			fprintf(stderr, "Error(%s): Unable to copy line %d.\n", __func__, line_number);
+			result = -1;
+			break;
+		}
+		batch->num_pairs++;
+		pair->valid = (parse_line(pair, defaults, with_output, manifest) == 0);
+	}
+	if (result == 0 && ferror(file)) {
+		fprintf(stderr, "Error(%s): Unable to read the manifest '%s'.\n", __func__, manifest);
+		result = -1;
+	}
+	free(line);
+	if (file != stdin) {
+		fclose(file);
+	}
+	return result;
+}
+
+static void print_ready(batch_t *batch)	// Called with the lock held, prints finished pairs in manifest order.
+{
+	while (batch->next_report < batch->num_pairs && batch->pairs[batch->next_report].done) {
+		batch_pair_t *pair = &batch->pairs[batch->next_report++];
+		if (pair->report_len > 0) {
+			fwrite(pair->report, 1, pair->report_len, stdout);
+		}
+		if (pair->spec.path) {
+			fprintf(stdout, "Pair: path=%s status=%d\n", pair->spec.path, pair->status);
+		} else {
+			fprintf(stdout, "Pair: line=%d status=%d\n", pair->spec.line, pair->status);
+		}
+		free(pair->report);
+		pair->report = NULL;
+	}
+}
+
+static void run_pair(void *arg, size_t index)
+{
+	batch_t *batch = arg;
+	batch_pair_t *pair = &batch->pairs[index];
+	int status = batch->error_status;
+	char *report = NULL;
+	size_t report_len = 0;
+
+	if (pair->valid) {
+		pthread_mutex_lock(&batch->lock);
+		size_t slot = batch->free_buffers[--batch->num_free];	// Never empty: a set per thread, and a thread waiting inside a pair never starts another.
+		pthread_mutex_unlock(&batch->lock);
+
+		diff_job_t job = *batch->defaults;
+		job.image1 = pair->spec.image1;
+		job.image2 = pair->spec.image2;
+		job.output = pair->spec.output;
+		job.mode = pair->spec.mode;
+		job.prefetch = batch->prefetch;
+		job.prefetch_index = 2 * index;
+		job.out = open_memstream(&report, &report_len);
+		if (job.out == NULL) {
+			fprintf(stderr, "Error(%s): Unable to buffer the report for %s.\n", __func__, pair->spec.image1);
+		} else {
+			status = diff_job_run(&job, &batch->buffers[slot]);
+			fclose(job.out);
+		}
+
+		pthread_mutex_lock(&batch->lock);
+		batch->free_buffers[batch->num_free++] = slot;
+		pthread_mutex_unlock(&batch->lock);
+	}
+
+	pthread_mutex_lock(&batch->lock);
+	pair->status = status;
+	pair->report = report;
+	pair->report_len = report_len;
+	pair->done = 1;
+	if (status > batch->highest_status) {
+		batch->highest_status = status;
+	}
+	print_ready(batch);
+	pthread_mutex_unlock(&batch->lock);
+}
+
+static file_prefetch_t *start_read_ahead(const batch_t *batch)	// In manifest order, which is roughly the order the pairs run in.
+{
+	const char **filenames = calloc(2 * batch->num_pairs, sizeof(char *));
+	if (filenames == NULL) {
+		return NULL;
+	}
+	size_t idx;
+	for (idx = 0; idx < batch->num_pairs; ++idx) {
+		if (batch->pairs[idx].valid) {
+			filenames[2 * idx] = batch->pairs[idx].spec.image1;
+			filenames[2 * idx + 1] = batch->pairs[idx].spec.image2;
+		}
+	}
+	file_prefetch_t *prefetch = file_prefetch_start(filenames, 2 * batch->num_pairs, READ_AHEAD_BYTES);
+	free(filenames);
+	if (prefetch) {
+		fprintf(stdout, "Info(%s): Reading inputs ahead with %s.\n", __func__, file_prefetch_uses_uring(prefetch) ? "io_uring" : "pread()");
+	}
+	return prefetch;
+}
+
+static int run_batch(batch_t *batch, thread_pool_t *pool)	// Returns the highest status of any pair, or -1 when nothing ran.
+{
+	int result = -1;
+	size_t num_buffers = (size_t)thread_pool_size(pool);
+	batch->buffers = calloc(num_buffers, sizeof(diff_job_buffers_t));
+	batch->free_buffers = malloc(num_buffers * sizeof(size_t));
+	if (batch->buffers == NULL || batch->free_buffers == NULL) {
+		fprintf(stderr, "Error(%s): Unable to allocate the buffers for %zu threads.\n", __func__, num_buffers);
+	} else {
+		for (batch->num_free = 0; batch->num_free < num_buffers; ++batch->num_free) {
+			batch->free_buffers[batch->num_free] = batch->num_free;
+		}
+		batch->prefetch = (batch->defaults->map == IMAGE_MAP_OFF) ? start_read_ahead(batch) : NULL;	// Mapped inputs are paged in by the kernels instead.
+		thread_pool_parallel_for(pool, batch->num_pairs, run_pair, batch);
+		file_prefetch_stop(batch->prefetch);
+		result = batch->highest_status;
+	}
+
+	if (batch->buffers) {
+		size_t idx;
+		for (idx = 0; idx < num_buffers; ++idx) {
+			diff_job_buffers_free(&batch->buffers[idx]);
+		}
+	}
+	free(batch->buffers);
+	free(batch->free_buffers);
+	return result;
+}
+
+static void init_batch(batch_t *batch, const diff_job_t *defaults)
+{
+	memset(batch, 0, sizeof(*batch));
+	batch->defaults = defaults;
+	batch->error_status = (defaults->check || defaults->threshold) ? CHECK_TROUBLE : EXIT_FAILURE;
+	pthread_mutex_init(&batch->lock, NULL);
+}
+
+int diff_batch_run(const char *manifest, const diff_job_t *defaults, int with_output, thread_pool_t *pool)
+{
+	batch_t batch;
+	init_batch(&batch, defaults);
+
+	int exit_status = batch.error_status;
+	size_t pair_idx;
+	if (read_manifest(manifest, defaults, with_output, &batch) == -1) {
+		goto done;
+	}
+	if (batch.num_pairs == 0) {
+		fprintf(stderr, "Error(%s): The manifest '%s' names no pairs.\n", __func__, manifest);
+		goto done;
+	}
+
+	int highest_status = run_batch(&batch, pool);
+	if (highest_status != -1) {
+		fprintf(stdout, "Batch: pairs=%zu status=%d\n", batch.num_pairs, highest_status);
+		exit_status = highest_status;
+	}
+
+done:
+	for (pair_idx = 0; pair_idx < batch.num_pairs; ++pair_idx) {
+		free(batch.pairs[pair_idx].text);
+	}
+	free(batch.pairs);
+	pthread_mutex_destroy(&batch.lock);
+	return exit_status;
+}
+
+int diff_batch_run_pairs(const diff_batch_pair_t *pairs, size_t num_pairs, const diff_job_t *defaults, thread_pool_t *pool)
+{
+	batch_t batch;
+	init_batch(&batch, defaults);
+
+	int exit_status = batch.error_status;
+	batch.pairs = calloc(num_pairs ? num_pairs : 1, sizeof(batch_pair_t));
+	if (batch.pairs == NULL) {
+		fprintf(stderr, "Error(%s): Unable to allocate %zu pairs.\n", __func__, num_pairs);
+	} else {
+		size_t pair_idx;
+		for (pair_idx = 0; pair_idx < num_pairs; ++pair_idx) {
+			batch.pairs[pair_idx].spec = pairs[pair_idx];
+			batch.pairs[pair_idx].valid = 1;
+		}
+		batch.num_pairs = num_pairs;
+		int highest_status = run_batch(&batch, pool);
+		if (highest_status != -1) {
+			exit_status = highest_status;
+		}
+	}
+	free(batch.pairs);
+	pthread_mutex_destroy(&batch.lock);
+	return exit_status;
+}
@@ -0,0 +1,28 @@
+#ifndef DIFF_BATCH_H
+#define DIFF_BATCH_H
+
+#include "diff_job.h"
+
+/*
+Batch mode. Each line of the manifest names one pair the way the command line does,
+"<image1> <image2> <output> [mode]" with <output> left out under --no-output or --check, and blank
+lines and lines starting with '#' are skipped. Every pair is a task on the pool, and the bands of
+its own decoding, differencing and encoding are tasks nested under it, so idle threads steal bands
+of a large pair once no small pairs are left. Each thread running a pair has its own job buffers,
+and each pair's result lines and a "Pair:" status line are printed in manifest order as soon as the
+pairs before it have finished. Directory trees are run the same way from a list of pairs.
+*/
+
+typedef struct {
+	const char *image1;
+	const char *image2;
+	const char *output;		// NULL to write nothing.
+	diff_mode_t mode;
+	int line;			// In the manifest, from 1.
+	const char *path;		// Relative path within the trees, printed instead of the line when set.
+} diff_batch_pair_t;
+
+int diff_batch_run(const char *manifest, const diff_job_t *defaults, int with_output, thread_pool_t *pool);	// "-" reads stdin, returns the highest status of any pair.
+int diff_batch_run_pairs(const diff_batch_pair_t *pairs, size_t num_pairs, const diff_job_t *defaults, thread_pool_t *pool);	// Prints like diff_batch_run() without the "Batch:" line.
+
+#endif
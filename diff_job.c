@@ -0,0 +1,247 @@
+#include "diff_job.h"
+#include "image_io.h"
+#include <stdlib.h>
+#include <inttypes.h>
+
+typedef struct {		// One input, decoded on its own thread.
+	const char *filename;
+	uint32_t **buf;
+	size_t *capacity;
+	size_t size;
+	int width;
+	int height;
+	int status;		// read_image_into() result.
+	thread_pool_t *pool;	// Fills the buffer in the bands the differencing will use.
+	image_cache_t *cache;	// Takes the pixels from here instead of *buf when set.
+	image_cache_ref_t ref;
+	file_prefetch_t *prefetch;	// May hold the file's bytes, read ahead.
+	size_t prefetch_index;
+	image_map_t map;
+	uint32_t *mapping;		// A raw RGBA file's pages, read in place and never written.
+	const uint32_t *pixels;
+} decode_job_t;
+
+static void decode_input(void *arg, size_t index)
+{
+	decode_job_t *job = (decode_job_t *)arg + index;
+	int mapped = (job->map != IMAGE_MAP_OFF && job->cache == NULL) ? map_rgba(job->filename, job->map, &job->mapping, &job->size) : 1;
+	if (mapped != 1) {
+		job->status = mapped;
+		job->pixels = job->mapping;
+	} else if (job->cache) {
+		job->status = image_cache_acquire(job->cache, job->filename, job->pool, &job->ref);
+		job->pixels = job->ref.pixels;
+		job->size = job->ref.size;
+		job->width = job->ref.width;
+		job->height = job->ref.height;
+	} else {
+		uint8_t *data = NULL;
+		size_t data_size = 0;
+		if (file_prefetch_take(job->prefetch, job->prefetch_index, &data, &data_size) == 0) {
+			job->status = decode_image_into(job->filename, &data, data_size, job->buf, job->capacity, &job->size, &job->width, &job->height, job->pool);
+		} else {
+			job->status = read_image_into(job->filename, job->buf, job->capacity, &job->size, &job->width, &job->height, job->pool);
+		}
+		job->pixels = *job->buf;
+	}
+}
+
+static int read_only(const diff_job_t *job, const decode_job_t *decode_job)
+{
+	return job->cache != NULL || decode_job->mapping != NULL;
+}
+
+static uint32_t *output_buffer(const diff_job_t *job, diff_job_buffers_t *buffers, const decode_job_t decode_jobs[2], size_t size)	// In place over img1 in a buffer of ours, else a scratch buffer.
+{
+	if (!read_only(job, &decode_jobs[0])) {
+		return buffers->image[0];
+	}
+	if (buffers->image[0] == NULL || buffers->capacity[0] < size) {
+		image_free(buffers->image[0]);
+		buffers->image[0] = image_alloc(size);
+		buffers->capacity[0] = buffers->image[0] ? size : 0;
+		if (buffers->image[0] == NULL) {
+			fprintf(job->err, "Error(%s): Unable to allocate the output buffer.\n", __func__);
+		}
+	}
+	return buffers->image[0];
+}
+
+void diff_stats_print(FILE *out, const diff_stats_t *stats, size_t num_pixels)
+{
+	fprintf(out, "Stats: changed_pixels=%" PRIu64 " total_pixels=%zu max_r=%u max_g=%u max_b=%u sum_r=%" PRIu64 " sum_g=%" PRIu64 " sum_b=%" PRIu64 "\n",
+		stats->changed_pixels, num_pixels, stats->channel_max[0], stats->channel_max[1], stats->channel_max[2],
+		stats->channel_sum[0], stats->channel_sum[1], stats->channel_sum[2]);
+}
+
+static int dimensions_differ(const diff_job_t *job)	// A result, not an error: like cmp(1) on files of different lengths.
+{
+	if (job->check) {
+		fprintf(job->out, "Check: differ in dimensions\n");
+	} else {
+		fprintf(job->out, "Threshold: differ in dimensions\n");	// No mask is written.
+	}
+	return CHECK_DIFFERENT;
+}
+
+static int compare_decoded(const diff_job_t *job, diff_job_buffers_t *buffers, const decode_job_t decode_jobs[2])
+{
+	int exit_status = (job->check || job->threshold) ? CHECK_TROUBLE : EXIT_FAILURE;	// Returned on errors.
+	diff_kernel_t kernel = job->kernel;
+	const uint32_t *img1 = decode_jobs[0].pixels;
+	const uint32_t *img2 = decode_jobs[1].pixels;
+	size_t size1 = decode_jobs[0].size;
+	size_t size2 = decode_jobs[1].size;
+	int width1 = decode_jobs[0].width;
+	int height1 = decode_jobs[0].height;
+	int width2 = decode_jobs[1].width;
+	int height2 = decode_jobs[1].height;
+
+	if (decode_jobs[0].status == -1 || decode_jobs[1].status == -1) {
+		if (decode_jobs[0].status == -1) fprintf(job->err, "Error(%s): Could not read '%s'.\n", __func__, job->image1);
+		if (decode_jobs[1].status == -1) fprintf(job->err, "Error(%s): Could not read '%s'.\n", __func__, job->image2);
+		return exit_status;
+	}
+
+	if (size1 != size2) {
+		if (job->check || job->threshold) {	// Different sizes can never be identical, nor within any tolerance.
+			return dimensions_differ(job);
+		}
+		fprintf(job->err, "Error(%s): Images must be the same dimensions.\n", __func__);
+		return exit_status;
+	}
+	if (size1 == 0) {	// Sizes must be the same so only check size1.
+		fprintf(job->err, "Error(%s): Input images have a size of 0, cannot subtract images.\n", __func__);
+		return exit_status;
+	}
+	if ((img1 == NULL) || (img2 == NULL)) {
+		fprintf(job->err, "Error(%s): Image buffer is NULL, despite a non-zero size after reading.\n", __func__);
+		return exit_status;
+	}
+
+	if (((width1 != 0) && (height1 != 0) && (width2 != 0) && (height2 != 0)) &&	// Check for matching PNG input dimensions. This should only execute if two PNGs are provided.
+	     (width1 != width2 || height1 != height2)) {
+		if (job->check || job->threshold) {
+			return dimensions_differ(job);
+		}
+		fprintf(job->err, "Error(%s): Image dimensions must be the same/non zero. '%s is %dx%d, and '%s' is %dx%d.\n",
+			__func__, job->image1, width1, height1, job->image2, width2, height2);
+		return exit_status;
+	}
+
+	int width_for_png = 0, height_for_png = 0;
+
+	if ((width1 != 0) && (height1 != 0)) {
+		width_for_png = width1;
+		height_for_png = height1;
+	} else if ((width2 != 0) && (height2 != 0)) {
+		width_for_png = width2;
+		height_for_png = height2;
+	}
+
+	if (job->check) {
+		size_t num_pixels = size1 / sizeof(uint32_t);
+		size_t first_diff = diff_kernel_compare_fn(kernel)(img1, img2, size1);	// Bails out at the first differing pixel.
+		if (first_diff == num_pixels) {
+			fprintf(job->out, "Check: identical\n");
+			return CHECK_SAME;
+		} else if (width1 > 0) {
+			fprintf(job->out, "Check: differ at pixel (%zu, %zu)\n", first_diff % (size_t)width1, first_diff / (size_t)width1);
+		} else {		// Raw RGBA inputs carry no width.
+			fprintf(job->out, "Check: differ at pixel index %zu\n", first_diff);
+		}
+		return CHECK_DIFFERENT;
+	}
+
+	if (job->threshold) {
+		size_t num_pixels = size1 / sizeof(uint32_t);
+		if (buffers->mask == NULL || buffers->mask_capacity < num_pixels) {
+			free(buffers->mask);
+			buffers->mask = malloc(num_pixels);
+			buffers->mask_capacity = buffers->mask ? num_pixels : 0;
+			if (buffers->mask == NULL) {
+				fprintf(job->err, "Error(%s): Unable to allocate the threshold mask.\n", __func__);
+				return exit_status;
+			}
+		}
+		size_t over = 0;
+		if (diff_threshold_parallel(job->pool, diff_kernel_threshold_fn(kernel), buffers->mask, img1, img2, size1, job->tolerance, &over) == -1) {	// Mask and count in one pass.
+			return exit_status;
+		}
+		fprintf(job->out, "Threshold: over_threshold=%zu total_pixels=%zu\n", over, num_pixels);
+		if (job->output && write_mask(job->output, buffers->mask, num_pixels, width_for_png, height_for_png, job->pool) == -1) {
+			fprintf(job->err, "Error(%s): Failed to write to output mask '%s'.\n", __func__, job->output);
+			return exit_status;
+		}
+		return over ? CHECK_DIFFERENT : CHECK_SAME;
+	}
+
+	uint32_t *dst = output_buffer(job, buffers, decode_jobs, size1);
+	if (dst == NULL) {
+		return exit_status;
+	}
+	if (job->stats) {
+		diff_stats_t stats = { 0 };
+		if (diff_stats_parallel_out(job->pool, diff_kernel_stats_fn(kernel), dst, img1, img2, size1, job->mode, &stats) == -1) {	// Statistics gathered in the same pass.
+			return exit_status;
+		}
+		diff_stats_print(job->out, &stats, size1 / sizeof(uint32_t));
+	} else if (job->crop) {
+		if (width_for_png == 0) {
+			fprintf(job->err, "Error(%s): '--crop' needs image dimensions, but neither input is a PNG.\n", __func__);
+			return exit_status;
+		}
+		diff_bbox_t bbox;
+		if (diff_bbox_out(job->pool, diff_kernel_out_fn(kernel), dst, img1, img2, width_for_png, height_for_png, job->mode, &bbox) == -1) {	// Tracking the changed region per row band.
+			return exit_status;
+		}
+		if (bbox.width == 0) {
+			fprintf(job->out, "Crop: no differences, '%s' not written\n", job->output);
+		} else {
+			fprintf(job->out, "Crop: x=%d y=%d width=%d height=%d\n", bbox.x, bbox.y, bbox.width, bbox.height);
+			if (write_image_region(job->output, dst, width_for_png, bbox.x, bbox.y, bbox.width, bbox.height, job->pool) == -1) {
+				fprintf(job->err, "Error(%s): Failed to write to output image '%s'.\n", __func__, job->output);
+				return exit_status;
+			}
+		}
+		return EXIT_SUCCESS;
+	} else {
+		diff_parallel_out(job->pool, diff_kernel_out_fn(kernel), dst, img1, img2, size1, job->mode);
+	}
+
+	if (job->output && write_image(job->output, dst, size1, width_for_png, height_for_png, job->pool) == -1) {
+		fprintf(job->err, "Error(%s): Failed to write to output image '%s'.\n", __func__, job->output);
+		return exit_status;
+	}
+	return EXIT_SUCCESS;
+}
+
+int diff_job_run(const diff_job_t *job, diff_job_buffers_t *buffers)
+{
+	decode_job_t decode_jobs[2] = {
+		{ .filename = job->image1, .buf = &buffers->image[0], .capacity = &buffers->capacity[0], .pool = job->pool, .cache = job->cache,
+		  .prefetch = job->prefetch, .prefetch_index = job->prefetch_index, .map = job->map },
+		{ .filename = job->image2, .buf = &buffers->image[1], .capacity = &buffers->capacity[1], .pool = job->pool, .cache = job->cache,
+		  .prefetch = job->prefetch, .prefetch_index = job->prefetch_index + 1, .map = job->map },
+	};
+	thread_pool_parallel_for(job->decode_pool, 2, decode_input, decode_jobs);	// One after another without a pool.
+	int exit_status = compare_decoded(job, buffers, decode_jobs);
+	if (job->cache) {
+		image_cache_release(job->cache, &decode_jobs[0].ref);
+		image_cache_release(job->cache, &decode_jobs[1].ref);
+	}
+	unmap_rgba(decode_jobs[0].mapping, decode_jobs[0].size);
+	unmap_rgba(decode_jobs[1].mapping, decode_jobs[1].size);
+	return exit_status;
+}
+
+void diff_job_buffers_free(diff_job_buffers_t *buffers)
+{
+	image_free(buffers->image[0]);
+	image_free(buffers->image[1]);
+	free(buffers->mask);
+	buffers->image[0] = buffers->image[1] = NULL;
+	buffers->capacity[0] = buffers->capacity[1] = 0;
+	buffers->mask = NULL;
+	buffers->mask_capacity = 0;
+}
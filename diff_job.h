@@ -0,0 +1,58 @@
+#ifndef DIFF_JOB_H
+#define DIFF_JOB_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "pix_diff.h"
+#include "thread_pool.h"
+#include "image_io.h"
+#include "image_cache.h"
+#include "file_prefetch.h"
+
+#define CHECK_SAME	0	// --check and --threshold exit statuses, following cmp(1): same, different, trouble.
+#define CHECK_DIFFERENT	1
+#define CHECK_TROUBLE	2
+
+/*
+One comparison of two images, everything a single run of diff does once its arguments are parsed.
+The decoded images and the threshold mask live in a diff_job_buffers_t that the caller keeps, so
+a batch of pairs on one thread reuses the same buffers instead of allocating them for every pair.
+With a cache the inputs are taken from it instead, and raw RGBA inputs may be mapped instead of
+read. Either way they are left untouched, and the difference goes to the first image buffer. The
+kernels only write dst in place over img1, so it is never the second input's buffer.
+*/
+
+typedef struct {
+	const char *image1;
+	const char *image2;
+	const char *output;		// NULL to write nothing.
+	diff_mode_t mode;
+	diff_kernel_t kernel;		// Already resolved, never KERNEL_AUTO.
+	int stats;
+	int check;
+	int threshold;
+	uint8_t tolerance[3];		// R G B
+	int crop;
+	thread_pool_t *pool;		// Splits the differencing and encoding into bands, may be NULL.
+	thread_pool_t *decode_pool;	// Decodes both inputs at once, may be NULL to decode one after the other.
+	image_cache_t *cache;		// Keeps decoded inputs for later jobs, NULL to decode into the buffers.
+	file_prefetch_t *prefetch;	// Holds the inputs read ahead, image1 at prefetch_index and image2 after it. May be NULL.
+	size_t prefetch_index;
+	image_map_t map;		// Maps raw RGBA inputs, and differences them out of place, instead of reading them.
+	FILE *out;			// Receives the Stats:, Check:, Threshold: and Crop: lines.
+	FILE *err;			// Receives the job's Error lines, those of decoding and encoding still go to stderr.
+} diff_job_t;
+
+typedef struct {
+	uint32_t *image[2];
+	size_t capacity[2];		// Bytes allocated for each image.
+	uint8_t *mask;
+	size_t mask_capacity;
+} diff_job_buffers_t;
+
+int diff_job_run(const diff_job_t *job, diff_job_buffers_t *buffers);	// Returns the exit status of a single run of diff.
+void diff_stats_print(FILE *out, const diff_stats_t *stats, size_t num_pixels);
+void diff_job_buffers_free(diff_job_buffers_t *buffers);
+
+#endif
@@ -0,0 +1,257 @@
+#define _POSIX_C_SOURCE 200809L		// getline(), fdopen(), sigaction() and strtok_r().
+#include "diff_serve.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_REQUEST_ARGS	32
+#define LISTEN_BACKLOG		16
+
+typedef struct connection {
+	struct connection *next;
+	pthread_t thread;
+	int fd;
+	int finished;			// Set by the thread before it closes the socket, so it can be joined.
+	struct server *server;
+} connection_t;
+
+typedef struct server {
+	serve_request_fn_t handle;
+	void *arg;
+	pthread_mutex_t request_lock;	// Requests take turns, each using the whole pool.
+	pthread_mutex_t lock;		// Guards the list of connections.
+	connection_t *connections;
+} server_t;
+
+static int wake_pipe[2] = { -1, -1 };	// Written by the signal handler, whichever thread it runs on.
+
+static void request_stop(int signum)
+{
+	int saved_errno = errno;
+	if (write(wake_pipe[1], "", 1) == -1) {
+		// The pipe is full, so a wake up is already pending.
+	}
+	errno = saved_errno;
+}
+
+static int open_socket(const char *socket_path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Error(%s): The socket path '%s' is longer than %zu bytes.\n", __func__, socket_path, sizeof(addr.sun_path) - 1);
+		return -1;
+	}
+	strcpy(addr.sun_path, socket_path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		fprintf(stderr, "Error(%s): Unable to create a Unix domain socket.\n", __func__);
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "Error(%s): Another daemon is already serving on '%s'.\n", __func__, socket_path);
+		close(fd);
+		return -1;
+	}
+	if (errno == ECONNREFUSED) {		// Left behind by a daemon that did not shut down cleanly.
+		unlink(socket_path);
+	}
+	close(fd);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);	// A socket that failed to connect can not be bound portably.
+	if (fd == -1) {
+		fprintf(stderr, "Error(%s): Unable to create a Unix domain socket.\n", __func__);
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, LISTEN_BACKLOG) == -1) {
+		fprintf(stderr, "Error(%s): Unable to listen on '%s'.\n", __func__, socket_path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int split_request(char *line, char *argv[MAX_REQUEST_ARGS + 2])	// argv[0] is the program name, as parse_args() expects.
+{
+	static char program[] = "diff";
+	int argc = 0;
+	argv[argc++] = program;
+	char *save = NULL;
+	char *token;
+	for (token = strtok_r(line, " \t\r\n", &save); token != NULL; token = strtok_r(NULL, " \t\r\n", &save)) {
+		if (argc == MAX_REQUEST_ARGS + 1) {
+			return -1;
+		}
+		argv[argc++] = token;
+	}
+	argv[argc] = NULL;
+	return argc;
+}
+
+static void *serve_connection(void *arg)
+{
+	connection_t *connection = arg;
+	server_t *server = connection->server;
+	int in_fd = dup(connection->fd);
+	FILE *in = (in_fd == -1) ? NULL : fdopen(in_fd, "r");
+	FILE *out = fdopen(connection->fd, "w");
+	if (in == NULL || out == NULL) {
+		fprintf(stderr, "Error(%s): Unable to open streams for a connection.\n", __func__);
+		if (in == NULL && in_fd != -1) {
+			close(in_fd);
+		}
+	}
+
+	char *line = NULL;
+	size_t line_capacity = 0;
+	while (in != NULL && out != NULL && getline(&line, &line_capacity, in) != -1) {
+		char *argv[MAX_REQUEST_ARGS + 2];
+		int argc = split_request(line, argv);
+		if (argc == 1) {		// Blank lines get no reply.
+			continue;
+		}
+		int status = EXIT_FAILURE;
+		if (argc == -1) {
+			fprintf(out, "Error(%s): A request has more than %d arguments.\n", __func__, MAX_REQUEST_ARGS);
+		} else {
+			pthread_mutex_lock(&server->request_lock);
+			status = server->handle(argc, argv, out, server->arg);
+			pthread_mutex_unlock(&server->request_lock);
+		}
+		fprintf(out, "Status: %d\n", status);
+		if (fflush(out) == EOF) {	// The client went away.
+			break;
+		}
+	}
+	free(line);
+	pthread_mutex_lock(&server->lock);
+	connection->finished = 1;
+	pthread_mutex_unlock(&server->lock);
+	if (in != NULL) {
+		fclose(in);
+	}
+	if (out != NULL) {
+		fclose(out);			// Closes connection->fd.
+	} else {
+		close(connection->fd);
+	}
+	return NULL;
+}
+
+static void reap_connections(server_t *server, int all)	// Joins finished connections, or all of them after shutting their sockets down.
+{
+	pthread_mutex_lock(&server->lock);
+	connection_t **link = &server->connections;
+	while (*link != NULL) {
+		connection_t *connection = *link;
+		if (!connection->finished && !all) {
+			link = &connection->next;
+			continue;
+		}
+		if (!connection->finished) {
+			shutdown(connection->fd, SHUT_RDWR);	// Wakes a thread waiting for the next request, the socket is still open.
+		}
+		*link = connection->next;
+		pthread_mutex_unlock(&server->lock);	// The thread takes the lock as it finishes.
+		pthread_join(connection->thread, NULL);
+		free(connection);
+		pthread_mutex_lock(&server->lock);
+	}
+	pthread_mutex_unlock(&server->lock);
+}
+
+int diff_serve_run(const char *socket_path, serve_request_fn_t handle, void *arg)
+{
+	if (pipe(wake_pipe) == -1) {
+		fprintf(stderr, "Error(%s): Unable to create the wake up pipe.\n", __func__);
+		return -1;
+	}
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	sigemptyset(&action.sa_mask);
+	action.sa_handler = request_stop;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	action.sa_handler = SIG_IGN;		// A client leaving mid-reply must not end the daemon.
+	sigaction(SIGPIPE, &action, NULL);
+
+	int listen_fd = open_socket(socket_path);
+	if (listen_fd == -1) {
+		close(wake_pipe[0]);
+		close(wake_pipe[1]);
+		return -1;
+	}
+	fprintf(stdout, "Info(%s): Serving on '%s'.\n", __func__, socket_path);
+	fflush(stdout);
+
+	server_t server;
+	memset(&server, 0, sizeof(server));
+	server.handle = handle;
+	server.arg = arg;
+	pthread_mutex_init(&server.request_lock, NULL);
+	pthread_mutex_init(&server.lock, NULL);
+
+	int result = 0;
+	for (;;) {
+		struct pollfd fds[2] = { { .fd = listen_fd, .events = POLLIN }, { .fd = wake_pipe[0], .events = POLLIN } };
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Error(%s): Unable to wait for connections.\n", __func__);
+			result = -1;
+			break;
+		}
+		if (fds[1].revents) {
+			fprintf(stdout, "Info(%s): Shutting down.\n", __func__);
+			break;
+		}
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			fprintf(stderr, "Error(%s): Unable to accept a connection.\n", __func__);
+			result = -1;
+			break;
+		}
+
+		reap_connections(&server, 0);
+		connection_t *connection = calloc(1, sizeof(*connection));
+		if (connection == NULL) {
+			fprintf(stderr, "Error(%s): Unable to allocate a connection.\n", __func__);
+			close(fd);
+			continue;
+		}
+		connection->fd = fd;
+		connection->server = &server;
+		pthread_mutex_lock(&server.lock);
+		if (pthread_create(&connection->thread, NULL, serve_connection, connection) != 0) {
+			pthread_mutex_unlock(&server.lock);
+			fprintf(stderr, "Error(%s): Unable to start a thread for a connection.\n", __func__);
+			close(fd);
+			free(connection);
+			continue;
+		}
+		connection->next = server.connections;
+		server.connections = connection;
+		pthread_mutex_unlock(&server.lock);
+	}
+
+	close(listen_fd);
+	unlink(socket_path);
+	reap_connections(&server, 1);
+	pthread_mutex_destroy(&server.lock);
+	pthread_mutex_destroy(&server.request_lock);
+	close(wake_pipe[0]);
+	close(wake_pipe[1]);
+	return result;
+}
@@ -0,0 +1,19 @@
+#ifndef DIFF_SERVE_H
+#define DIFF_SERVE_H
+
+#include <stdio.h>
+
+/*
+Daemon mode. Listens on a Unix domain socket and reads requests, one per line, each holding the
+arguments a single run of diff takes split on whitespace. The reply is whatever the request
+printed followed by a "Status: N" line with its exit status, and a connection may send any number
+of requests. Every connection has its own thread so an idle client holds nobody up, but requests
+run one at a time since each uses the whole pool. Serves until SIGINT or SIGTERM, then closes the
+connections and removes the socket file.
+*/
+
+typedef int (*serve_request_fn_t)(int argc, char *argv[], FILE *out, void *arg);	// Returns the exit status a single run would have.
+
+int diff_serve_run(const char *socket_path, serve_request_fn_t handle, void *arg);
+
+#endif
@@ -0,0 +1,379 @@
+#define _POSIX_C_SOURCE 200809L
+#include "diff_stream.h"
+#include "image_io.h"
+#include "png_stream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define STREAM_BAND_BYTES	(256u << 10)	// Output bytes per band, matching the bands of diff_parallel_out().
+#define STREAM_SLOTS		4		// Bands in flight between the decoding and the encoding thread.
+
+enum { SOURCE_PNG, SOURCE_DECODED, SOURCE_RGBA };
+
+typedef struct {
+	const char *filename;
+	int kind;
+	png_reader_t *png;
+	uint32_t *decoded;		// Whole image, for formats the PNG reader does not handle.
+	int fd;				// Raw RGBA, read band by band.
+	size_t num_pixels;
+	size_t next_pixel;
+	int width;			// 0 for raw RGBA.
+	int height;
+	dev_t device;			// Identify the file, so the output can not overwrite it mid-read.
+	ino_t inode;
+} stream_source_t;
+
+typedef struct {
+	uint32_t *input[2];		// Band buffers for each source, unused for decoded sources.
+	const uint32_t *pixels[2];	// Where this band's input pixels are.
+	uint32_t *output;
+	size_t num_pixels;
+} stream_slot_t;
+
+typedef struct {
+	diff_stream_t *stream;
+	stream_source_t sources[2];
+	stream_slot_t slots[STREAM_SLOTS];
+	diff_out_fn_t diff_fn;		// Picked for the whole image, the bands alone are too small to tell.
+	size_t band_pixels;
+	size_t num_bands;
+	int width;
+
+	pthread_mutex_t lock;
+	pthread_cond_t band_ready;
+	pthread_cond_t slot_free;
+	size_t bands_produced;
+	size_t bands_consumed;
+	int failed;			// Set by either side to stop the other.
+} stream_state_t;
+
+static int open_source(stream_source_t *source, const char *filename)	// Streams PNG and RGBA, decodes anything else stb_image knows whole.
+{
+	source->filename = filename;
+	source->fd = -1;
+
+	struct stat st;
+	if (stat(filename, &st) == 0) {
+		source->device = st.st_dev;
+		source->inode = st.st_ino;
+	}
+
+	source->png = png_reader_open(filename, &source->width, &source->height);
+	if (source->png != NULL) {
+		source->kind = SOURCE_PNG;
+		source->num_pixels = (size_t)source->width * (size_t)source->height;
+		return 0;
+	}
+
+	if (image_info(filename, &source->width, &source->height) == 0) {
+		fprintf(stdout, "Info(%s): '%s' can not be streamed and is decoded whole.\n", __func__, filename);
+		size_t size;
+		if (read_image(filename, &source->decoded, &size, &source->width, &source->height) == -1 || source->decoded == NULL) {
+			fprintf(stderr, "Error(%s): Could not read '%s'.\n", __func__, filename);
+			return -1;
+		}
+		source->kind = SOURCE_DECODED;
+		source->num_pixels = size / sizeof(uint32_t);
+		return 0;
+	}
+
+	source->kind = SOURCE_RGBA;			// Anything else is raw RGBA, as in read_image().
+	source->width = source->height = 0;
+	source->fd = open(filename, O_RDONLY);
+	if (source->fd == -1 || fstat(source->fd, &st) == -1) {
+		fprintf(stderr, "Error(%s): Unable to open '%s'.\n", __func__, filename);
+		return -1;
+	}
+	if (st.st_size <= 0 || st.st_size % 4 != 0) {
+		fprintf(stderr, "Error(%s): '%s' has a size that is zero or not a multiple of 4. Cannot be an RGBA.\n", __func__, filename);
+		return -1;
+	}
+	source->num_pixels = (size_t)st.st_size / sizeof(uint32_t);
+	return 0;
+}
+
+static void close_source(stream_source_t *source)
+{
+	png_reader_close(source->png);
+	image_free(source->decoded);
+	if (source->fd != -1) {
+		close(source->fd);
+	}
+}
+
+static int read_band(stream_source_t *source, stream_slot_t *slot, int index, int width)	// The next slot->num_pixels pixels of source.
+{
+	size_t num_pixels = slot->num_pixels;
+	slot->pixels[index] = slot->input[index];
+
+	if (source->kind == SOURCE_PNG) {
+		if (png_reader_read_rows(source->png, slot->input[index], (int)(num_pixels / (size_t)width)) == -1) {
+			fprintf(stderr, "Error(%s): Could not decode '%s'.\n", __func__, source->filename);
+			return -1;
+		}
+	} else if (source->kind == SOURCE_DECODED) {
+		slot->pixels[index] = source->decoded + source->next_pixel;	// Already in memory, no copy.
+	} else {
+		uint8_t *dst = (uint8_t *)slot->input[index];
+		size_t done = 0, bytes = num_pixels * sizeof(uint32_t);
+		off_t offset = (off_t)(source->next_pixel * sizeof(uint32_t));
+		while (done < bytes) {
+			ssize_t bytes_read = pread(source->fd, dst + done, bytes - done, offset + (off_t)done);
+			if (bytes_read <= 0) {
+				fprintf(stderr, "Error(%s): Reading '%s' failed or ended early.\n", __func__, source->filename);
+				return -1;
+			}
+			done += (size_t)bytes_read;
+		}
+	}
+	source->next_pixel += num_pixels;
+	return 0;
+}
+
+typedef struct {
+	stream_state_t *state;
+	stream_slot_t *slot;
+	int status[2];
+} band_read_t;
+
+static void read_band_task(void *arg, size_t index)	// Both sources of a band are read at once when there is a pool.
+{
+	band_read_t *read = arg;
+	read->status[index] = read_band(&read->state->sources[index], read->slot, (int)index, read->state->width);
+}
+
+static void *produce_bands(void *arg)	// Decodes and differences the bands in order into free slots.
+{
+	stream_state_t *state = arg;
+	diff_stream_t *stream = state->stream;
+
+	size_t band;
+	for (band = 0; band < state->num_bands; ++band) {
+		pthread_mutex_lock(&state->lock);
+		while (!state->failed && band - state->bands_consumed >= STREAM_SLOTS) {
+			pthread_cond_wait(&state->slot_free, &state->lock);
+		}
+		int failed = state->failed;
+		pthread_mutex_unlock(&state->lock);
+		if (failed) {
+			break;
+		}
+
+		stream_slot_t *slot = &state->slots[band % STREAM_SLOTS];
+		size_t first_pixel = band * state->band_pixels;
+		slot->num_pixels = (stream->num_pixels - first_pixel < state->band_pixels) ? stream->num_pixels - first_pixel : state->band_pixels;
+
+		band_read_t read = { .state = state, .slot = slot };
+		thread_pool_parallel_for(stream->pool, 2, read_band_task, &read);
+		failed = (read.status[0] == -1 || read.status[1] == -1);
+
+		size_t size = slot->num_pixels * sizeof(uint32_t);
+		if (!failed && stream->stats_fn) {
+			failed = (diff_stats_parallel_out(stream->pool, stream->stats_fn, slot->output, slot->pixels[0], slot->pixels[1], size, stream->mode, &stream->stats) == -1);
+		} else if (!failed) {
+			diff_parallel_out(stream->pool, state->diff_fn, slot->output, slot->pixels[0], slot->pixels[1], size, stream->mode);
+		}
+
+		pthread_mutex_lock(&state->lock);
+		if (failed) {
+			state->failed = 1;
+		} else {
+			state->bands_produced++;
+		}
+		pthread_cond_signal(&state->band_ready);
+		pthread_mutex_unlock(&state->lock);
+		if (failed) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+static int write_rgba_band(int fd, const uint32_t *pixels, size_t num_pixels)
+{
+	const uint8_t *bytes = (const uint8_t *)pixels;
+	size_t done = 0, len = num_pixels * sizeof(uint32_t);
+	while (done < len) {
+		ssize_t bytes_written = write(fd, bytes + done, len - done);
+		if (bytes_written <= 0) {
+			fprintf(stderr, "Error(%s): Writing RGBA data failed.\n", __func__);
+			return -1;
+		}
+		done += (size_t)bytes_written;
+	}
+	return 0;
+}
+
+static int consume_bands(stream_state_t *state, png_writer_t *png, int fd)	// Encodes the bands in order on the calling thread.
+{
+	size_t band;
+	for (band = 0; band < state->num_bands; ++band) {
+		pthread_mutex_lock(&state->lock);
+		while (!state->failed && state->bands_produced <= band) {
+			pthread_cond_wait(&state->band_ready, &state->lock);
+		}
+		int failed = state->failed;
+		pthread_mutex_unlock(&state->lock);
+		if (failed) {
+			return -1;
+		}
+
+		const stream_slot_t *slot = &state->slots[band % STREAM_SLOTS];
+		int result = 0;
+		if (png) {
+			result = png_writer_write_rows(png, slot->output, (int)(slot->num_pixels / (size_t)state->width));
+		} else if (fd != -1) {
+			result = write_rgba_band(fd, slot->output, slot->num_pixels);
+		}
+
+		pthread_mutex_lock(&state->lock);
+		if (result == -1) {
+			state->failed = 1;
+		} else {
+			state->bands_consumed++;
+		}
+		pthread_cond_signal(&state->slot_free);
+		pthread_mutex_unlock(&state->lock);
+		if (result == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int check_dimensions(stream_state_t *state)
+{
+	const stream_source_t *first = &state->sources[0], *second = &state->sources[1];
+	if (first->num_pixels != second->num_pixels) {
+		fprintf(stderr, "Error(%s): Images must be the same dimensions.\n", __func__);
+		return -1;
+	}
+	if (first->width && second->width && (first->width != second->width || first->height != second->height)) {
+		fprintf(stderr, "Error(%s): Image dimensions must be the same/non zero. '%s is %dx%d, and '%s' is %dx%d.\n",
+			__func__, first->filename, first->width, first->height, second->filename, second->width, second->height);
+		return -1;
+	}
+	state->width = first->width ? first->width : second->width;
+	state->stream->num_pixels = first->num_pixels;
+	state->diff_fn = diff_image_out_fn(state->stream->diff_fn, first->num_pixels * sizeof(uint32_t));
+	return 0;
+}
+
+static int overwrites_source(const stream_state_t *state, const char *output)	// Streamed inputs are still being read while the output is written.
+{
+	struct stat st;
+	if (stat(output, &st) == -1) {
+		return 0;
+	}
+	int source_idx;
+	for (source_idx = 0; source_idx < 2; ++source_idx) {
+		const stream_source_t *source = &state->sources[source_idx];
+		if (source->kind != SOURCE_DECODED && source->device == st.st_dev && source->inode == st.st_ino) {
+			fprintf(stderr, "Error(%s): The output '%s' is also the input '%s', which is read while the output is written.\n", __func__, output, source->filename);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int diff_stream_run(diff_stream_t *stream)
+{
+	stream_state_t state = { .stream = stream };
+	png_writer_t *png = NULL;
+	int fd = -1, result = -1;
+	size_t slot_idx;
+	state.sources[0].fd = state.sources[1].fd = -1;
+
+	if (open_source(&state.sources[0], stream->image1) == -1 || open_source(&state.sources[1], stream->image2) == -1 || check_dimensions(&state) == -1) {
+		goto out;
+	}
+
+	if (state.width > 0) {			// Whole rows per band, as the PNG reader and writer work in rows.
+		size_t band_rows = STREAM_BAND_BYTES / ((size_t)state.width * sizeof(uint32_t));
+		state.band_pixels = (band_rows ? band_rows : 1) * (size_t)state.width;
+	} else {
+		state.band_pixels = STREAM_BAND_BYTES / sizeof(uint32_t);
+	}
+	state.num_bands = (stream->num_pixels + state.band_pixels - 1) / state.band_pixels;
+
+	for (slot_idx = 0; slot_idx < STREAM_SLOTS; ++slot_idx) {
+		stream_slot_t *slot = &state.slots[slot_idx];
+		int needs_input[2] = { state.sources[0].kind != SOURCE_DECODED, state.sources[1].kind != SOURCE_DECODED };
+		slot->output = malloc(state.band_pixels * sizeof(uint32_t));
+		slot->input[0] = needs_input[0] ? malloc(state.band_pixels * sizeof(uint32_t)) : NULL;
+		slot->input[1] = needs_input[1] ? malloc(state.band_pixels * sizeof(uint32_t)) : NULL;
+		if (slot->output == NULL || (needs_input[0] && slot->input[0] == NULL) || (needs_input[1] && slot->input[1] == NULL)) {
+			fprintf(stderr, "Error(%s): Unable to allocate the band buffers.\n", __func__);
+			goto out;
+		}
+	}
+
+	if (stream->output && overwrites_source(&state, stream->output)) {
+		goto out;
+	}
+	if (stream->output) {
+		size_t len = strlen(stream->output);
+		if (len >= 4 && strcmp(stream->output + len - 4, ".png") == 0) {
+			if (state.width == 0) {
+				fprintf(stderr, "Error(%s): Writing '%s' needs image dimensions, but neither input is a PNG.\n", __func__, stream->output);
+				goto out;
+			}
+			png = png_writer_open(stream->output, state.width, (int)(stream->num_pixels / (size_t)state.width));
+			if (png == NULL) {
+				goto out;
+			}
+		} else if (len >= 4 && strcmp(stream->output + len - 4, "rgba") == 0) {
+			fd = open(stream->output, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+			if (fd == -1) {
+				fprintf(stderr, "Error(%s): Unable to open or create '%s' for writing RGBA data.\n", __func__, stream->output);
+				goto out;
+			}
+		} else {
+			fprintf(stderr, "Error: Unsupported output file type for '%s'.\n", stream->output);
+			fprintf(stderr, "	Output filename must end with '.png' (with valid dimensions) or 'rgba'\n");
+			goto out;
+		}
+	}
+
+	fprintf(stdout, "Info(%s): Streaming %zu bands of %zu pixels.\n", __func__, state.num_bands, state.band_pixels);
+	pthread_mutex_init(&state.lock, NULL);
+	pthread_cond_init(&state.band_ready, NULL);
+	pthread_cond_init(&state.slot_free, NULL);
+
+	pthread_t producer;
+	if (pthread_create(&producer, NULL, produce_bands, &state) != 0) {
+		fprintf(stderr, "Error(%s): Unable to start the decoding thread.\n", __func__);
+	} else {
+		result = consume_bands(&state, png, fd);
+		pthread_join(producer, NULL);
+		if (state.failed) {
+			result = -1;
+		}
+	}
+
+	pthread_cond_destroy(&state.slot_free);
+	pthread_cond_destroy(&state.band_ready);
+	pthread_mutex_destroy(&state.lock);
+
+out:
+	if (png && png_writer_close(png) == -1) {
+		result = -1;
+	}
+	if (fd != -1 && close(fd) == -1) {
+		fprintf(stderr, "Warning(%s): There was an error with closing '%s' after writing RGBA data.\n", __func__, stream->output);
+	}
+	for (slot_idx = 0; slot_idx < STREAM_SLOTS; ++slot_idx) {
+		free(state.slots[slot_idx].output);
+		free(state.slots[slot_idx].input[0]);
+		free(state.slots[slot_idx].input[1]);
+	}
+	close_source(&state.sources[0]);
+	close_source(&state.sources[1]);
+	return result;
+}
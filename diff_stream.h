@@ -0,0 +1,29 @@
+#ifndef DIFF_STREAM_H
+#define DIFF_STREAM_H
+
+#include "pix_diff.h"
+#include "thread_pool.h"
+
+/*
+Streaming difference. Row bands flow from the two decoders through the kernel into an incremental
+PNG or RGBA writer, with decoding and differencing on one thread and encoding on the calling thread,
+handing over bands through a small ring. Memory stays proportional to the image width rather than
+its area, except for inputs that have to be decoded whole (anything but 8-bit non-interlaced PNG
+and raw RGBA).
+*/
+
+typedef struct {
+	const char *image1;
+	const char *image2;
+	const char *output;		// NULL to write nothing.
+	diff_out_fn_t diff_fn;
+	diff_stats_fn_t stats_fn;	// Used instead of diff_fn when set, accumulating into stats.
+	diff_mode_t mode;
+	thread_pool_t *pool;		// May be NULL, see diff_parallel_out().
+	diff_stats_t stats;
+	size_t num_pixels;		// Set once the inputs are open.
+} diff_stream_t;
+
+int diff_stream_run(diff_stream_t *stream);
+
+#endif
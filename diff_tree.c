@@ -0,0 +1,298 @@
+#define _POSIX_C_SOURCE 200809L		// strdup(), lstat() and mkdir().
+#include "diff_tree.h"
+#include "diff_batch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+typedef struct {
+	char **paths;			// Relative to the root of the tree.
+	size_t count;
+	size_t capacity;
+} file_list_t;
+
+typedef struct {
+	dev_t device;			// The output tree, left out when it lies inside an input tree.
+	ino_t inode;
+	int set;
+} skip_dir_t;
+
+static int has_suffix(const char *name, const char *suffix)	// Ignoring case.
+{
+	size_t name_len = strlen(name);
+	size_t suffix_len = strlen(suffix);
+	if (name_len <= suffix_len) {
+		return 0;
+	}
+	const char *tail = name + name_len - suffix_len;
+	size_t idx;
+	for (idx = 0; idx < suffix_len; ++idx) {
+		if (tolower((unsigned char)tail[idx]) != suffix[idx]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int is_image_name(const char *name)
+{
+	return has_suffix(name, ".png") || has_suffix(name, ".jpg") || has_suffix(name, ".jpeg") || has_suffix(name, ".rgba");
+}
+
+static char *join_path(const char *dir, const char *name, const char *suffix)
+{
+	size_t dir_len = strlen(dir);
+	int slash = dir_len > 0 && dir[dir_len - 1] != '/';
+	size_t len = dir_len + (size_t)slash + strlen(name) + strlen(suffix) + 1;
+	char *path = malloc(len);
+	if (path == NULL) {
+		fprintf(stderr, "Error(%s): Unable to allocate a path under '%s'.\n", __func__, dir);
+		return NULL;
+	}
+	snprintf(path, len, "%s%s%s%s", dir, slash ? "/" : "", name, suffix);
+	return path;
+}
+
+static int add_file(file_list_t *list, char *path)	// Takes path over, even on errors.
+{
+	if (list->count == list->capacity) {
+		size_t capacity = list->capacity ? 2 * list->capacity : 256;
+		char **grown = realloc(list->paths, capacity * sizeof(char *));
+		if (grown == NULL) {
+			fprintf(stderr, "Error(%s): Unable to allocate %zu paths.\n", __func__, capacity);
+			free(path);
+			return -1;
+		}
+		list->paths = grown;
+		list->capacity = capacity;
+	}
+	list->paths[list->count++] = path;
+	return 0;
+}
+
+static void free_list(file_list_t *list)
+{
+	size_t idx;
+	for (idx = 0; idx < list->count; ++idx) {
+		free(list->paths[idx]);
+	}
+	free(list->paths);
+}
+
+static int walk(const char *root, const char *relative, const skip_dir_t *skip, file_list_t *list)	// Collects the images under root/relative.
+{
+	char *dir_path = relative[0] ? join_path(root, relative, "") : strdup(root);
+	if (dir_path == NULL) {
+		return -1;
+	}
+	DIR *dir = opendir(dir_path);
+	if (dir == NULL) {
+		fprintf(stderr, "Error(%s): Unable to open the directory '%s'.\n", __func__, dir_path);
+		free(dir_path);
+		return -1;
+	}
+
+	int result = 0;
+	struct dirent *entry;
+	while (result == 0 && (entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.') {		// ".", ".." and hidden files.
+			continue;
+		}
+		char *child = relative[0] ? join_path(relative, entry->d_name, "") : strdup(entry->d_name);
+		char *child_path = join_path(dir_path, entry->d_name, "");
+		struct stat st;
+		if (child == NULL || child_path == NULL) {
+			result = -1;
+		} else if (lstat(child_path, &st) == -1) {
+			fprintf(stderr, "Warning(%s): Unable to collect %s stats, skipping it.\n", __func__, child_path);
+		} else if (S_ISDIR(st.st_mode)) {		// Links to directories are not followed, so there are no cycles.
+			if (!skip->set || st.st_dev != skip->device || st.st_ino != skip->inode) {
+				result = walk(root, child, skip, list);
+			}
+		} else if (is_image_name(entry->d_name) && (S_ISREG(st.st_mode) || (S_ISLNK(st.st_mode) && stat(child_path, &st) == 0 && S_ISREG(st.st_mode)))) {
+			result = add_file(list, child);
+			child = NULL;
+		}
+		free(child);
+		free(child_path);
+	}
+	closedir(dir);
+	free(dir_path);
+	return result;
+}
+
+static int compare_paths(const char *path1, const char *path2)	// Directory first and then name, so the files of a directory stay together.
+{
+	const char *slash1 = strrchr(path1, '/');
+	const char *slash2 = strrchr(path2, '/');
+	size_t dir_len1 = slash1 ? (size_t)(slash1 - path1) : 0;
+	size_t dir_len2 = slash2 ? (size_t)(slash2 - path2) : 0;
+	int order = memcmp(path1, path2, dir_len1 < dir_len2 ? dir_len1 : dir_len2);
+	if (order == 0 && dir_len1 != dir_len2) {
+		return dir_len1 < dir_len2 ? -1 : 1;
+	}
+	if (order == 0) {
+		order = strcmp(slash1 ? slash1 + 1 : path1, slash2 ? slash2 + 1 : path2);
+	}
+	return order;
+}
+
+static int same_dir(const char *path1, const char *path2)
+{
+	const char *slash1 = strrchr(path1, '/');
+	const char *slash2 = strrchr(path2, '/');
+	size_t dir_len1 = slash1 ? (size_t)(slash1 - path1) : 0;
+	size_t dir_len2 = slash2 ? (size_t)(slash2 - path2) : 0;
+	return dir_len1 == dir_len2 && memcmp(path1, path2, dir_len1) == 0;
+}
+
+static int compare_entries(const void *entry1, const void *entry2)
+{
+	return compare_paths(*(char *const *)entry1, *(char *const *)entry2);
+}
+
+static int collect(const char *root, const skip_dir_t *skip, file_list_t *list)
+{
+	memset(list, 0, sizeof(*list));
+	if (walk(root, "", skip, list) == -1) {
+		return -1;
+	}
+	if (list->count > 0) {
+		qsort(list->paths, list->count, sizeof(char *), compare_entries);
+	}
+	return 0;
+}
+
+static int make_dirs(const char *path)	// Creates every directory leading up to the file at path.
+{
+	char *copy = strdup(path);
+	if (copy == NULL) {
+		fprintf(stderr, "Error(%s): Unable to copy the path '%s'.\n", __func__, path);
+		return -1;
+	}
+	int result = 0;
+	char *slash;
+	for (slash = strchr(copy[0] ? copy + 1 : copy, '/'); slash != NULL && result == 0; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if (mkdir(copy, 0777) == -1 && errno != EEXIST) {
+			fprintf(stderr, "Error(%s): Unable to create the directory '%s'.\n", __func__, copy);
+			result = -1;
+		}
+		*slash = '/';
+	}
+	free(copy);
+	return result;
+}
+
+static char *output_path(const char *output_tree, const char *relative)	// JPGs are written as PNGs, under a name that no PNG can also have.
+{
+	int keep = has_suffix(relative, ".png") || has_suffix(relative, ".rgba");
+	return join_path(output_tree, relative, keep ? "" : ".png");
+}
+
+int diff_tree_is_directory(const char *path)
+{
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+int diff_tree_run(const char *tree1, const char *tree2, const char *output_tree, const diff_job_t *defaults, thread_pool_t *pool)
+{
+	int error_status = (defaults->check || defaults->threshold) ? CHECK_TROUBLE : EXIT_FAILURE;
+	if (!diff_tree_is_directory(tree2)) {
+		fprintf(stderr, "Error(%s): '%s' is a directory but '%s' is not.\n", __func__, tree1, tree2);
+		return error_status;
+	}
+
+	skip_dir_t skip;
+	memset(&skip, 0, sizeof(skip));
+	if (output_tree) {
+		char *inside = join_path(output_tree, "", "");	// make_dirs() creates the directories before the last slash.
+		struct stat st;
+		int made = (inside != NULL && make_dirs(inside) == 0 && stat(output_tree, &st) == 0 && S_ISDIR(st.st_mode));
+		free(inside);
+		if (!made) {
+			fprintf(stderr, "Error(%s): Unable to create the output directory '%s'.\n", __func__, output_tree);
+			return error_status;
+		}
+		skip.device = st.st_dev;
+		skip.inode = st.st_ino;
+		skip.set = 1;
+	}
+
+	file_list_t files1, files2;
+	if (collect(tree1, &skip, &files1) == -1) {
+		free_list(&files1);
+		return error_status;
+	}
+	int exit_status = error_status;
+	size_t num_pairs = 0, missing = 0, extra = 0;
+	diff_batch_pair_t *pairs = calloc(files1.count ? files1.count : 1, sizeof(diff_batch_pair_t));
+	char **names = calloc(3 * files1.count + 1, sizeof(char *));	// The paths of every pair, owned here.
+	if (collect(tree2, &skip, &files2) == -1) {
+		goto done;
+	}
+	if (pairs == NULL || names == NULL) {
+		fprintf(stderr, "Error(%s): Unable to allocate %zu pairs.\n", __func__, files1.count);
+		goto done;
+	}
+
+	size_t idx1 = 0, idx2 = 0;
+	const char *previous = NULL;		// Its output directories exist already.
+	while (idx1 < files1.count || idx2 < files2.count) {	// Both lists are in the same order, so matching paths meet.
+		int order = (idx1 == files1.count) ? 1 : (idx2 == files2.count) ? -1 : compare_paths(files1.paths[idx1], files2.paths[idx2]);
+		if (order < 0) {
+			fprintf(stdout, "Missing: path=%s\n", files1.paths[idx1++]);
+			missing++;
+			continue;
+		}
+		if (order > 0) {
+			fprintf(stdout, "Extra: path=%s\n", files2.paths[idx2++]);
+			extra++;
+			continue;
+		}
+
+		const char *relative = files1.paths[idx1];
+		char **name = &names[3 * num_pairs];
+		name[0] = join_path(tree1, relative, "");
+		name[1] = join_path(tree2, relative, "");
+		name[2] = output_tree ? output_path(output_tree, relative) : NULL;
+		if (name[0] == NULL || name[1] == NULL || (output_tree && name[2] == NULL)) {
+			goto done;
+		}
+		if (output_tree && (previous == NULL || !same_dir(previous, relative)) && make_dirs(name[2]) == -1) {
+			goto done;
+		}
+		diff_batch_pair_t *pair = &pairs[num_pairs++];
+		pair->image1 = name[0];
+		pair->image2 = name[1];
+		pair->output = name[2];
+		pair->mode = defaults->mode;
+		pair->path = relative;
+		previous = relative;
+		idx1++;
+		idx2++;
+	}
+
+	exit_status = diff_batch_run_pairs(pairs, num_pairs, defaults, pool);
+	if ((missing > 0 || extra > 0) && exit_status == EXIT_SUCCESS) {
+		exit_status = CHECK_DIFFERENT;		// Also EXIT_FAILURE, for runs that write differences.
+	}
+	fprintf(stdout, "Tree: pairs=%zu missing=%zu extra=%zu status=%d\n", num_pairs, missing, extra, exit_status);
+
+done:
+	if (names) {
+		size_t idx;
+		for (idx = 0; idx < 3 * files1.count; ++idx) {
+			free(names[idx]);
+		}
+	}
+	free(names);
+	free(pairs);
+	free_list(&files1);
+	free_list(&files2);
+	return exit_status;
+}
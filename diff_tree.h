@@ -0,0 +1,18 @@
+#ifndef DIFF_TREE_H
+#define DIFF_TREE_H
+
+#include "diff_job.h"
+
+/*
+Directory tree mode. Every PNG, JPG and RGBA file under the first tree is paired with the file at
+the same relative path under the second, and the pairs run on the pool like a batch, each written
+to the same relative path under the output tree, whose directories are created as needed. JPGs get
+".png" appended to their output name. The pairs are ordered directory by directory, so the files
+read close together in time sit in the same directories. Files only in the first tree are reported
+as "Missing:", files only in the second as "Extra:", and either counts as a difference.
+*/
+
+int diff_tree_is_directory(const char *path);
+int diff_tree_run(const char *tree1, const char *tree2, const char *output_tree, const diff_job_t *defaults, thread_pool_t *pool);	// output_tree may be NULL, returns the highest status of any pair.
+
+#endif
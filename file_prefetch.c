@@ -0,0 +1,431 @@
+#define _GNU_SOURCE			// syscall() and pread().
+#include "file_prefetch.h"
+#include "image_io.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define RING_ENTRIES	64		// Chunks in flight at once.
+#define CHUNK_BYTES	(1u << 20)
+
+typedef enum {
+	FILE_WAITING,			// Not started.
+	FILE_CLAIMED,			// Asked for before it was started, the caller reads it.
+	FILE_LOADING,
+	FILE_READY,
+	FILE_FAILED,
+	FILE_TAKEN
+} file_state_t;
+
+typedef struct {
+	const char *filename;
+	file_state_t state;
+	int fd;
+	uint8_t *data;
+	size_t size;
+	size_t queued;			// Bytes whose reads have been queued.
+	unsigned pending;		// Chunks in flight.
+	int failed;
+} prefetch_file_t;
+
+typedef struct {
+	size_t file;
+	size_t offset;
+	size_t length;
+} chunk_t;
+
+typedef struct {
+	int fd;				// -1 when io_uring is unavailable, files are then read with pread().
+	_Atomic unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	_Atomic unsigned *cq_head;
+	_Atomic unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;			// The same mapping as sq_map on kernels that share it.
+	size_t cq_map_size;
+	size_t sqes_size;
+	unsigned to_submit;		// Queued and not yet handed to the kernel.
+	chunk_t chunks[RING_ENTRIES];
+	unsigned free_chunks[RING_ENTRIES];
+	unsigned num_free;
+} ring_t;
+
+struct file_prefetch {
+	prefetch_file_t *files;
+	size_t num_files;
+	size_t budget;
+	ring_t ring;			// Only used by the loading thread.
+	pthread_t thread;
+
+	pthread_mutex_t lock;		// Guards the file states and everything below.
+	pthread_cond_t changed;		// A file was finished, taken or claimed, or stop was asked for.
+	size_t next;			// First file not started yet.
+	size_t held;			// Bytes of files started and not taken yet.
+	int stop;
+};
+
+static int ring_setup(ring_t *ring)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	long fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	if (fd < 0) {
+		return -1;
+	}
+	ring->fd = (int)fd;
+	ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	int single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_map && ring->cq_map_size > ring->sq_map_size) {
+		ring->sq_map_size = ring->cq_map_size;
+	}
+
+	ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_map = single_map ? ring->sq_map : mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQES);
+	if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		if (ring->sqes != MAP_FAILED) {
+			munmap(ring->sqes, ring->sqes_size);
+		}
+		if (!single_map && ring->cq_map != MAP_FAILED) {
+			munmap(ring->cq_map, ring->cq_map_size);
+		}
+		if (ring->sq_map != MAP_FAILED) {
+			munmap(ring->sq_map, ring->sq_map_size);
+		}
+		close(ring->fd);
+		ring->fd = -1;
+		return -1;
+	}
+
+	uint8_t *sq = ring->sq_map;
+	uint8_t *cq = ring->cq_map;
+	ring->sq_tail = (void *)(sq + params.sq_off.tail);
+	ring->sq_mask = (void *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (void *)(sq + params.sq_off.array);
+	ring->cq_head = (void *)(cq + params.cq_off.head);
+	ring->cq_tail = (void *)(cq + params.cq_off.tail);
+	ring->cq_mask = (void *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (void *)(cq + params.cq_off.cqes);
+	return 0;
+}
+
+static void ring_teardown(ring_t *ring)
+{
+	if (ring->fd == -1) {
+		return;
+	}
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_map != ring->sq_map) {
+		munmap(ring->cq_map, ring->cq_map_size);
+	}
+	munmap(ring->sq_map, ring->sq_map_size);
+	close(ring->fd);
+}
+
+static void ring_queue_read(ring_t *ring, int fd, uint8_t *dest, size_t length, size_t offset, unsigned chunk)
+{
+	unsigned tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);	// Only this thread moves the tail.
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)dest;
+	sqe->len = (uint32_t)length;
+	sqe->off = offset;
+	sqe->user_data = chunk;
+	ring->sq_array[index] = index;
+	atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+	ring->to_submit++;
+}
+
+static int ring_enter(ring_t *ring, unsigned min_complete)	// Hands the queued reads to the kernel and waits for min_complete of them.
+{
+	for (;;) {
+		long submitted = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (submitted >= 0) {
+			ring->to_submit -= (unsigned)submitted;
+			if (ring->to_submit == 0) {
+				return 0;
+			}
+			continue;
+		}
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			fprintf(stderr, "Error(%s): Unable to submit reads to io_uring.\n", __func__);
+			return -1;
+		}
+	}
+}
+
+static int read_fully(int fd, uint8_t *dest, size_t length, size_t offset)
+{
+	while (length > 0) {
+		ssize_t bytes_read = pread(fd, dest, length, (off_t)offset);
+		if (bytes_read == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytes_read <= 0) {		// Errors, or the file shrank since it was measured.
+			return -1;
+		}
+		dest += bytes_read;
+		offset += (size_t)bytes_read;
+		length -= (size_t)bytes_read;
+	}
+	return 0;
+}
+
+static void finish_file(file_prefetch_t *prefetch, prefetch_file_t *file)	// Called by the loading thread once the last read of a file is back.
+{
+	close(file->fd);
+	file->fd = -1;
+	pthread_mutex_lock(&prefetch->lock);
+	if (file->failed) {
+		image_free(file->data);
+		file->data = NULL;
+		prefetch->held -= file->size;
+	}
+	file->state = file->failed ? FILE_FAILED : FILE_READY;
+	pthread_cond_broadcast(&prefetch->changed);
+	pthread_mutex_unlock(&prefetch->lock);
+}
+
+static int open_file(file_prefetch_t *prefetch, prefetch_file_t *file)	// Failures are left for the caller to find and report, as it reads the file itself.
+{
+	struct stat st;
+	file->fd = open(file->filename, O_RDONLY);
+	if (file->fd != -1 && fstat(file->fd, &st) == 0 && st.st_size > 0) {
+		file->size = (size_t)st.st_size;
+		file->data = image_alloc(file->size);
+	}
+	pthread_mutex_lock(&prefetch->lock);
+	if (file->data == NULL) {
+		file->state = FILE_FAILED;
+		pthread_cond_broadcast(&prefetch->changed);
+	} else {
+		prefetch->held += file->size;
+	}
+	pthread_mutex_unlock(&prefetch->lock);
+	if (file->data == NULL && file->fd != -1) {
+		close(file->fd);
+		file->fd = -1;
+	}
+	return (file->data == NULL) ? -1 : 0;
+}
+
+static void reap_reads(file_prefetch_t *prefetch)
+{
+	ring_t *ring = &prefetch->ring;
+	unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+	for (; head != tail; ++head) {
+		const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		unsigned chunk_idx = (unsigned)cqe->user_data;
+		const chunk_t *chunk = &ring->chunks[chunk_idx];
+		prefetch_file_t *file = &prefetch->files[chunk->file];
+		size_t done = (cqe->res > 0) ? (size_t)cqe->res : 0;
+		if (done < chunk->length && read_fully(file->fd, file->data + chunk->offset + done, chunk->length - done, chunk->offset + done) == -1) {	// Short reads, and reads the kernel refused, are finished here.
+			file->failed = 1;
+		}
+		ring->free_chunks[ring->num_free++] = chunk_idx;
+		if (--file->pending == 0 && file->queued == file->size) {
+			finish_file(prefetch, file);
+		}
+	}
+	atomic_store_explicit(ring->cq_head, head, memory_order_release);
+}
+
+static void abandon_reads(file_prefetch_t *prefetch)	// io_uring stopped taking reads, the files under way fail and are read by their callers.
+{
+	pthread_mutex_lock(&prefetch->lock);
+	prefetch->stop = 1;
+	size_t idx;
+	for (idx = 0; idx < prefetch->num_files; ++idx) {
+		if (prefetch->files[idx].state == FILE_LOADING) {
+			prefetch->files[idx].state = FILE_FAILED;	// The data is freed by file_prefetch_stop(), after the ring is gone.
+		}
+	}
+	pthread_cond_broadcast(&prefetch->changed);
+	pthread_mutex_unlock(&prefetch->lock);
+}
+
+static void *load_files(void *arg)
+{
+	file_prefetch_t *prefetch = arg;
+	ring_t *ring = &prefetch->ring;
+	prefetch_file_t *current = NULL;	// Opened, with reads left to queue.
+	for (;;) {
+		int can_start = 0;
+		if (current == NULL) {
+			pthread_mutex_lock(&prefetch->lock);
+			while (prefetch->next < prefetch->num_files && prefetch->files[prefetch->next].state != FILE_WAITING) {
+				prefetch->next++;
+			}
+			can_start = !prefetch->stop && prefetch->next < prefetch->num_files && prefetch->held < prefetch->budget;
+			if (can_start) {
+				current = &prefetch->files[prefetch->next++];
+				current->state = FILE_LOADING;
+			} else if (ring->num_free == RING_ENTRIES) {	// Nothing in flight.
+				if (prefetch->stop || prefetch->next == prefetch->num_files) {
+					pthread_mutex_unlock(&prefetch->lock);
+					break;
+				}
+				pthread_cond_wait(&prefetch->changed, &prefetch->lock);
+				pthread_mutex_unlock(&prefetch->lock);
+				continue;
+			}
+			pthread_mutex_unlock(&prefetch->lock);
+			if (current && open_file(prefetch, current) == -1) {
+				current = NULL;
+				continue;
+			}
+		}
+
+		if (current && ring->fd == -1) {
+			current->failed = (read_fully(current->fd, current->data, current->size, 0) == -1);
+			current->queued = current->size;
+			finish_file(prefetch, current);
+			current = NULL;
+			continue;
+		}
+		while (current && current->queued < current->size && ring->num_free > 0) {
+			unsigned chunk_idx = ring->free_chunks[--ring->num_free];
+			chunk_t *chunk = &ring->chunks[chunk_idx];
+			chunk->file = (size_t)(current - prefetch->files);
+			chunk->offset = current->queued;
+			chunk->length = (current->size - current->queued < CHUNK_BYTES) ? current->size - current->queued : CHUNK_BYTES;
+			ring_queue_read(ring, current->fd, current->data + chunk->offset, chunk->length, chunk->offset, chunk_idx);
+			current->queued += chunk->length;
+			current->pending++;
+		}
+		int stalled = (current != NULL || !can_start);	// Nothing more to queue until reads come back.
+		if (current && current->queued == current->size) {
+			current = NULL;
+		}
+		if (ring_enter(ring, stalled ? 1 : 0) == -1) {
+			abandon_reads(prefetch);
+			break;
+		}
+		reap_reads(prefetch);
+	}
+	return NULL;
+}
+
+file_prefetch_t *file_prefetch_start(const char *const *filenames, size_t num_files, size_t budget_bytes)
+{
+	file_prefetch_t *prefetch = calloc(1, sizeof(*prefetch));
+	prefetch_file_t *files = calloc(num_files ? num_files : 1, sizeof(prefetch_file_t));
+	if (prefetch == NULL || files == NULL) {
+		fprintf(stderr, "Error(%s): Unable to allocate the read ahead of %zu files.\n", __func__, num_files);
+		free(prefetch);
+		free(files);
+		return NULL;
+	}
+	size_t idx;
+	for (idx = 0; idx < num_files; ++idx) {
+		files[idx].filename = filenames[idx];
+		files[idx].state = filenames[idx] ? FILE_WAITING : FILE_TAKEN;
+		files[idx].fd = -1;
+	}
+	prefetch->files = files;
+	prefetch->num_files = num_files;
+	prefetch->budget = budget_bytes;
+	if (ring_setup(&prefetch->ring) == -1) {
+		prefetch->ring.fd = -1;
+	}
+	for (prefetch->ring.num_free = 0; prefetch->ring.num_free < RING_ENTRIES; ++prefetch->ring.num_free) {
+		prefetch->ring.free_chunks[prefetch->ring.num_free] = prefetch->ring.num_free;
+	}
+	pthread_mutex_init(&prefetch->lock, NULL);
+	pthread_cond_init(&prefetch->changed, NULL);
+
+	if (pthread_create(&prefetch->thread, NULL, load_files, prefetch) != 0) {
+		fprintf(stderr, "Error(%s): Unable to start the read ahead thread.\n", __func__);
+		ring_teardown(&prefetch->ring);
+		pthread_mutex_destroy(&prefetch->lock);
+		pthread_cond_destroy(&prefetch->changed);
+		free(files);
+		free(prefetch);
+		return NULL;
+	}
+	return prefetch;
+}
+
+int file_prefetch_take(file_prefetch_t *prefetch, size_t index, uint8_t **data, size_t *size)
+{
+	*data = NULL;
+	*size = 0;
+	if (prefetch == NULL || index >= prefetch->num_files) {
+		return -1;
+	}
+	pthread_mutex_lock(&prefetch->lock);
+	prefetch_file_t *file = &prefetch->files[index];
+	if (file->state == FILE_WAITING) {	// Reading it here beats waiting for the files queued before it.
+		file->state = FILE_CLAIMED;
+		pthread_cond_broadcast(&prefetch->changed);
+		pthread_mutex_unlock(&prefetch->lock);
+		return -1;
+	}
+	while (file->state == FILE_LOADING) {
+		pthread_cond_wait(&prefetch->changed, &prefetch->lock);
+	}
+	int result = -1;
+	if (file->state == FILE_READY) {
+		*data = file->data;
+		*size = file->size;
+		file->data = NULL;
+		prefetch->held -= file->size;
+		pthread_cond_broadcast(&prefetch->changed);
+		result = 0;
+	}
+	if (file->state != FILE_CLAIMED) {
+		file->state = FILE_TAKEN;
+	}
+	pthread_mutex_unlock(&prefetch->lock);
+	return result;
+}
+
+void file_prefetch_stop(file_prefetch_t *prefetch)
+{
+	if (prefetch == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&prefetch->lock);
+	prefetch->stop = 1;
+	pthread_cond_broadcast(&prefetch->changed);
+	pthread_mutex_unlock(&prefetch->lock);
+	pthread_join(prefetch->thread, NULL);
+
+	ring_teardown(&prefetch->ring);
+	size_t idx;
+	for (idx = 0; idx < prefetch->num_files; ++idx) {
+		if (prefetch->files[idx].fd != -1) {
+			close(prefetch->files[idx].fd);
+		}
+		image_free(prefetch->files[idx].data);
+	}
+	pthread_mutex_destroy(&prefetch->lock);
+	pthread_cond_destroy(&prefetch->changed);
+	free(prefetch->files);
+	free(prefetch);
+}
+
+int file_prefetch_uses_uring(const file_prefetch_t *prefetch)
+{
+	return prefetch != NULL && prefetch->ring.fd != -1;
+}
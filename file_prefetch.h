@@ -0,0 +1,23 @@
+#ifndef FILE_PREFETCH_H
+#define FILE_PREFETCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+Reads a list of files, in order, on a thread of its own ahead of the threads that decode them, so
+batch runs find their inputs in memory instead of each waiting on its own reads. Reads are queued
+on io_uring in chunks, so the device sees many at once, and fall back to pread() where io_uring is
+unavailable. The files read but not yet taken are bounded by a budget in bytes. A file is only
+waited for once its reads are under way; one that is not is left to the caller, so a thread never
+waits on a file that depends on another thread making progress first.
+*/
+
+typedef struct file_prefetch file_prefetch_t;
+
+file_prefetch_t *file_prefetch_start(const char *const *filenames, size_t num_files, size_t budget_bytes);	// NULL names are skipped.
+int file_prefetch_take(file_prefetch_t *prefetch, size_t index, uint8_t **data, size_t *size);	// Returns -1 when the caller should read the file itself, *data is then NULL.
+void file_prefetch_stop(file_prefetch_t *prefetch);	// Waits for reads in flight and frees the files never taken.
+int file_prefetch_uses_uring(const file_prefetch_t *prefetch);
+
+#endif
@@ -0,0 +1,204 @@
+#define _POSIX_C_SOURCE 200809L		// st_mtim.
+#include "image_cache.h"
+#include "image_io.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+typedef struct cache_entry {
+	struct cache_entry *prev;	// Most recently used first.
+	struct cache_entry *next;
+	dev_t device;
+	ino_t inode;
+	off_t file_size;		// Size and modification time when decoded, to notice changed files.
+	struct timespec mtime;
+	uint32_t *pixels;
+	size_t capacity;		// Bytes allocated, what the budget counts.
+	size_t size;
+	int width;
+	int height;
+	int users;			// Acquired and not yet released.
+	int listed;			// In the list. Entries dropped while in use are freed by the last release.
+} cache_entry_t;
+
+struct image_cache {
+	pthread_mutex_t lock;		// Guards everything below.
+	cache_entry_t *newest;
+	cache_entry_t *oldest;
+	size_t budget;
+	image_cache_stats_t stats;
+};
+
+static void free_entry(cache_entry_t *entry)
+{
+	image_free(entry->pixels);
+	free(entry);
+}
+
+static void detach_entry(image_cache_t *cache, cache_entry_t *entry)	// Called with the lock held.
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->newest = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->oldest = entry->prev;
+	}
+	entry->prev = entry->next = NULL;
+	entry->listed = 0;
+	cache->stats.entries--;
+	cache->stats.bytes -= entry->capacity;
+}
+
+static void drop_entry(image_cache_t *cache, cache_entry_t *entry)	// Called with the lock held, freed now unless in use.
+{
+	detach_entry(cache, entry);
+	if (entry->users == 0) {
+		free_entry(entry);
+	}
+}
+
+static void push_newest(image_cache_t *cache, cache_entry_t *entry)	// Called with the lock held.
+{
+	entry->prev = NULL;
+	entry->next = cache->newest;
+	if (cache->newest) {
+		cache->newest->prev = entry;
+	} else {
+		cache->oldest = entry;
+	}
+	cache->newest = entry;
+	entry->listed = 1;
+	cache->stats.entries++;
+	cache->stats.bytes += entry->capacity;
+}
+
+static int same_version(const cache_entry_t *entry, const struct stat *st)
+{
+	return entry->file_size == st->st_size && entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void fill_ref(image_cache_ref_t *ref, cache_entry_t *entry)
+{
+	ref->pixels = entry->pixels;
+	ref->size = entry->size;
+	ref->width = entry->width;
+	ref->height = entry->height;
+	ref->entry = entry;
+}
+
+image_cache_t *image_cache_create(size_t budget_bytes)
+{
+	image_cache_t *cache = calloc(1, sizeof(*cache));
+	if (cache == NULL) {
+		fprintf(stderr, "Error(%s): Unable to allocate the image cache.\n", __func__);
+		return NULL;
+	}
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->budget = budget_bytes;
+	return cache;
+}
+
+void image_cache_destroy(image_cache_t *cache)
+{
+	if (cache == NULL) {
+		return;
+	}
+	while (cache->newest) {
+		drop_entry(cache, cache->newest);
+	}
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+int image_cache_acquire(image_cache_t *cache, const char *filename, thread_pool_t *pool, image_cache_ref_t *ref)
+{
+	memset(ref, 0, sizeof(*ref));
+	struct stat st;
+	if (stat(filename, &st) == -1) {
+		fprintf(stderr, "Error(%s): Unable to collect %s stats.\n", __func__, filename);
+		return -1;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	cache_entry_t *entry;
+	for (entry = cache->newest; entry != NULL; entry = entry->next) {
+		if (entry->device == st.st_dev && entry->inode == st.st_ino && same_version(entry, &st)) {
+			break;
+		}
+	}
+	if (entry != NULL) {
+		cache->stats.hits++;
+		entry->users++;
+		detach_entry(cache, entry);	// Moved to the front.
+		push_newest(cache, entry);
+		fill_ref(ref, entry);
+		pthread_mutex_unlock(&cache->lock);
+		return 0;
+	}
+	cache->stats.misses++;
+	pthread_mutex_unlock(&cache->lock);
+
+	entry = calloc(1, sizeof(*entry));		// Decoded without the lock, the other input may be decoding too.
+	if (entry == NULL) {
+		fprintf(stderr, "Error(%s): Unable to allocate a cache entry for '%s'.\n", __func__, filename);
+		return -1;
+	}
+	if (read_image_copied_into(filename, &entry->pixels, &entry->capacity, &entry->size, &entry->width, &entry->height, pool) == -1) {
+		free_entry(entry);
+		return -1;
+	}
+	entry->device = st.st_dev;
+	entry->inode = st.st_ino;
+	entry->file_size = st.st_size;
+	entry->mtime = st.st_mtim;
+	entry->users = 1;
+
+	pthread_mutex_lock(&cache->lock);
+	cache_entry_t *old, *next;
+	for (old = cache->newest; old != NULL; old = next) {	// Older versions, or a copy decoded at the same time, make way.
+		next = old->next;
+		if (old->device == entry->device && old->inode == entry->inode) {
+			drop_entry(cache, old);
+		}
+	}
+	if (entry->capacity <= cache->budget) {
+		push_newest(cache, entry);
+		for (old = cache->oldest; old != NULL && cache->stats.bytes > cache->budget; old = next) {
+			next = old->prev;
+			if (old->users == 0) {
+				cache->stats.evictions++;
+				drop_entry(cache, old);
+			}
+		}
+	}
+	fill_ref(ref, entry);
+	pthread_mutex_unlock(&cache->lock);
+	return 0;
+}
+
+void image_cache_release(image_cache_t *cache, image_cache_ref_t *ref)
+{
+	cache_entry_t *entry = ref->entry;
+	if (entry == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&cache->lock);
+	if (--entry->users == 0 && !entry->listed) {
+		free_entry(entry);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	memset(ref, 0, sizeof(*ref));
+}
+
+void image_cache_stats(image_cache_t *cache, image_cache_stats_t *stats)
+{
+	pthread_mutex_lock(&cache->lock);
+	*stats = cache->stats;
+	pthread_mutex_unlock(&cache->lock);
+}
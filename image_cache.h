@@ -0,0 +1,41 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "thread_pool.h"
+
+/*
+Decoded images kept between jobs, for the daemon. Entries are found by device and inode, so two
+paths to the same file share one, and are decoded again once the file's size or modification time
+changes. The least recently used entries are dropped whenever the pixels held exceed the budget,
+except those still acquired, and an image larger than the whole budget is only kept until it is
+released. Files are read into memory rather than mapped, so one truncated while it is decoded fails
+that request instead of ending the daemon with SIGBUS. Safe to use from several threads at once.
+*/
+
+typedef struct image_cache image_cache_t;
+
+typedef struct {
+	const uint32_t *pixels;		// Shared, never written while acquired.
+	size_t size;			// Bytes, as from read_image().
+	int width;			// 0 for raw RGBA.
+	int height;
+	void *entry;			// Held until image_cache_release().
+} image_cache_ref_t;
+
+typedef struct {
+	size_t entries;
+	size_t bytes;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+} image_cache_stats_t;
+
+image_cache_t *image_cache_create(size_t budget_bytes);
+void image_cache_destroy(image_cache_t *cache);				// Every entry must have been released.
+int image_cache_acquire(image_cache_t *cache, const char *filename, thread_pool_t *pool, image_cache_ref_t *ref);	// Decodes on a miss, in bands on the pool.
+void image_cache_release(image_cache_t *cache, image_cache_ref_t *ref);	// Does nothing for a ref that was never acquired.
+void image_cache_stats(image_cache_t *cache, image_cache_stats_t *stats);
+
+#endif
@@ -1,16 +1,342 @@
+#define _DEFAULT_SOURCE			// pread(), posix_memalign(), madvise() and MAP_POPULATE.
 #include "image_io.h"
+#include "png_stream.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <string.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <pthread.h>
+static void *image_realloc(void *buf, size_t old_size, size_t size);
 #define	 STB_IMAGE_IMPLEMENTATION
+#define	 STBI_MALLOC(size)			image_alloc(size)	// So decoded pixels can be handed to callers as they are.
+#define	 STBI_REALLOC_SIZED(buf, old_size, size)	image_realloc(buf, old_size, size)
+#define	 STBI_FREE(buf)				image_free(buf)
 #include "stb_image.h"
-#define	 STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
 
-int read_rgba(const char *filename, uint32_t **buf, size_t *size)
+#define IMAGE_ALIGN		64		// A cache line, and one AVX-512 vector, so kernel loads never split one.
+#define IMAGE_HUGE_BYTES	(2u << 20)	// Buffers this large are aligned to, and backed by, 2 MB pages.
+
+/*
+Large buffers are recycled instead of going back to the C library, which would unmap them and fault
+the pages in again for the next image of the same size. While the arena has a cap, large sizes are
+rounded up to a multiple of the smallest power of two from 2 MB up that is at least an eighth of the
+size, so the slack stays under a quarter of the size, and freed buffers wait on a list per rounded
+size until an allocation of the same size takes them. The bytes held are capped, past the cap
+buffers are released as before. Small buffers keep their size just before their aligned start, in
+the 64 bytes of padding. Large buffers are 2 MB aligned, so their records are kept in a table on the
+side rather than in 2 MB of padding.
+*/
+#define ARENA_CLASSES	32
+#define LARGE_BUCKETS	64
+
+typedef struct {		// Before each small buffer, in its padding.
+	size_t capacity;
+} image_header_t;
+
+typedef struct large_buffer {
+	void *buf;			// What posix_memalign() returned, 2 MB aligned.
+	size_t capacity;		// Usable bytes, the rounded size while the arena is on.
+	struct large_buffer *next;	// In its bucket of the table.
+	struct large_buffer *next_free;	// On its class's free list.
+} large_buffer_t;
+
+typedef struct {
+	size_t capacity;		// 0 for an unused class.
+	large_buffer_t *free_list;
+} arena_class_t;
+
+static struct {
+	pthread_mutex_t lock;
+	size_t cap;
+	size_t retained;
+	size_t buffers;
+	uint64_t hits;
+	uint64_t misses;
+	arena_class_t classes[ARENA_CLASSES];
+	large_buffer_t *large[LARGE_BUCKETS];	// Every large buffer, handed out or waiting.
+} arena = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static size_t size_class(size_t size)	// Rounds up to the smallest power of two from 2 MB up that is at least an eighth of size.
+{
+	if (size > SIZE_MAX / 2) {
+		return size;
+	}
+	size_t step = IMAGE_HUGE_BYTES;
+	while (step < size / 8) {
+		step *= 2;
+	}
+	return (size + step - 1) / step * step;
+}
+
+static large_buffer_t **large_link(void *buf)	// Called with the arena locked. Where buf's record is linked, or the NULL ending its bucket.
+{
+	large_buffer_t **link = &arena.large[((uintptr_t)buf / IMAGE_HUGE_BYTES) % LARGE_BUCKETS];
+	while (*link != NULL && (*link)->buf != buf) {
+		link = &(*link)->next;
+	}
+	return link;
+}
+
+static large_buffer_t *large_find(void *buf)	// NULL for small buffers, only large ones can be 2 MB aligned and in the table.
+{
+	if ((uintptr_t)buf % IMAGE_HUGE_BYTES != 0) {
+		return NULL;
+	}
+	pthread_mutex_lock(&arena.lock);
+	large_buffer_t *large = *large_link(buf);
+	pthread_mutex_unlock(&arena.lock);
+	return large;
+}
+
+static void large_release(large_buffer_t *large)	// Called with the arena unlocked, once large is out of the table.
+{
+	free(large->buf);
+	free(large);
+}
+
+static large_buffer_t *arena_take(size_t capacity)	// Called with the arena locked.
+{
+	int class_idx;
+	for (class_idx = 0; class_idx < ARENA_CLASSES; ++class_idx) {
+		arena_class_t *class = &arena.classes[class_idx];
+		if (class->capacity == capacity && class->free_list != NULL) {
+			large_buffer_t *large = class->free_list;
+			class->free_list = large->next_free;
+			arena.retained -= capacity;
+			arena.buffers--;
+			return large;
+		}
+	}
+	return NULL;
+}
+
+static int arena_keep(large_buffer_t *large)	// Called with the arena locked. Returns -1 when the buffer has to be released.
+{
+	if (arena.retained + large->capacity > arena.cap) {
+		return -1;
+	}
+	arena_class_t *unused = NULL;
+	int class_idx;
+	for (class_idx = 0; class_idx < ARENA_CLASSES; ++class_idx) {
+		arena_class_t *class = &arena.classes[class_idx];
+		if (class->capacity == large->capacity) {
+			unused = class;
+			break;
+		}
+		if (unused == NULL && class->free_list == NULL) {	// Classes with nothing waiting may change size.
+			unused = class;
+		}
+	}
+	if (unused == NULL) {
+		return -1;
+	}
+	unused->capacity = large->capacity;
+	large->next_free = unused->free_list;
+	unused->free_list = large;
+	arena.retained += large->capacity;
+	arena.buffers++;
+	return 0;
+}
+
+static void *large_alloc(size_t size)
+{
+	pthread_mutex_lock(&arena.lock);
+	size_t capacity = arena.cap ? size_class(size) : size;	// Only rounded when the buffer may be kept for reuse.
+	large_buffer_t *large = arena_take(capacity);
+	if (large != NULL) {
+		arena.hits++;
+	} else {
+		arena.misses++;
+	}
+	pthread_mutex_unlock(&arena.lock);
+	if (large != NULL) {		// Already faulted in, and on huge pages.
+		return large->buf;
+	}
+
+	large = malloc(sizeof(*large));
+	if (large == NULL || posix_memalign(&large->buf, IMAGE_HUGE_BYTES, capacity) != 0) {
+		free(large);
+		return NULL;
+	}
+#ifdef MADV_HUGEPAGE
+	madvise(large->buf, capacity - capacity % IMAGE_HUGE_BYTES, MADV_HUGEPAGE);	// Transparent huge pages, one TLB entry per 2 MB instead of per 4 KB.
+#endif
+	large->capacity = capacity;
+	pthread_mutex_lock(&arena.lock);
+	large_buffer_t **link = &arena.large[((uintptr_t)large->buf / IMAGE_HUGE_BYTES) % LARGE_BUCKETS];
+	large->next = *link;
+	*link = large;
+	pthread_mutex_unlock(&arena.lock);
+	return large->buf;
+}
+
+void *image_alloc(size_t size)
+{
+	if (size >= IMAGE_HUGE_BYTES) {
+		return large_alloc(size);
+	}
+	void *block;
+	if (posix_memalign(&block, IMAGE_ALIGN, IMAGE_ALIGN + size) != 0) {	// The header goes in the padding before the aligned start.
+		return NULL;
+	}
+	uint8_t *buf = (uint8_t *)block + IMAGE_ALIGN;
+	((image_header_t *)buf - 1)->capacity = size;
+	return buf;
+}
+
+static void *image_realloc(void *buf, size_t old_size, size_t size)	// Grows in place while the capacity has room.
+{
+	if (buf != NULL) {
+		large_buffer_t *large = large_find(buf);
+		size_t capacity = large ? large->capacity : ((image_header_t *)buf - 1)->capacity;
+		if (capacity >= size) {
+			return buf;
+		}
+	}
+	void *grown = image_alloc(size);
+	if (grown != NULL && buf != NULL) {
+		memcpy(grown, buf, (old_size < size) ? old_size : size);
+		image_free(buf);
+	}
+	return grown;
+}
+
+void image_free(void *buf)
+{
+	if (buf == NULL) {
+		return;
+	}
+	if ((uintptr_t)buf % IMAGE_HUGE_BYTES == 0) {	// Only large buffers are in the table, a small one may be 2 MB aligned by chance.
+		pthread_mutex_lock(&arena.lock);
+		large_buffer_t **link = large_link(buf);
+		large_buffer_t *large = *link;
+		int release = (large != NULL && arena_keep(large) == -1);
+		if (release) {
+			*link = large->next;
+		}
+		pthread_mutex_unlock(&arena.lock);
+		if (release) {
+			large_release(large);
+		}
+		if (large != NULL) {
+			return;
+		}
+	}
+	free((uint8_t *)buf - IMAGE_ALIGN);
+}
+
+void image_arena_set_cap(size_t cap_bytes)
+{
+	pthread_mutex_lock(&arena.lock);
+	arena.cap = cap_bytes;
+	large_buffer_t *released = NULL;
+	int class_idx;
+	for (class_idx = 0; class_idx < ARENA_CLASSES && arena.retained > arena.cap; ++class_idx) {
+		arena_class_t *class = &arena.classes[class_idx];
+		while (class->free_list != NULL && arena.retained > arena.cap) {
+			large_buffer_t *large = class->free_list;
+			class->free_list = large->next_free;
+			arena.retained -= large->capacity;
+			arena.buffers--;
+			large_buffer_t **link = large_link(large->buf);
+			*link = large->next;
+			large->next_free = released;
+			released = large;
+		}
+	}
+	pthread_mutex_unlock(&arena.lock);
+	while (released != NULL) {		// Unmapped outside the lock.
+		large_buffer_t *next = released->next_free;
+		large_release(released);
+		released = next;
+	}
+}
+
+void image_arena_stats(image_arena_stats_t *stats)
+{
+	pthread_mutex_lock(&arena.lock);
+	stats->hits = arena.hits;
+	stats->misses = arena.misses;
+	stats->buffers = arena.buffers;
+	stats->retained_bytes = arena.retained;
+	pthread_mutex_unlock(&arena.lock);
+}
+
+/*
+read_image() may run on several threads at once. stb_image keeps its failure reason and load flags
+in thread-local storage when the compiler has it, and each decode sets this thread's flags so a
+global stbi_set_*() elsewhere can not change the result. Without thread-local storage they are
+plain globals, so decodes take turns under a lock instead.
+*/
+#ifdef STBI_THREAD_LOCAL
+#define STBI_LOCK()
+#define STBI_UNLOCK()
+#else
+static pthread_mutex_t stbi_lock = PTHREAD_MUTEX_INITIALIZER;
+#define STBI_LOCK()	pthread_mutex_lock(&stbi_lock)
+#define STBI_UNLOCK()	pthread_mutex_unlock(&stbi_lock)
+#endif
+
+/*
+Decoded pixels are copied, and raw RGBA files read, into the caller's buffer in bands on the pool.
+The bands match those of diff_parallel_out(), so with pinned threads every page is first touched,
+and placed on the NUMA node of, the thread that later differences it.
+*/
+#define FILL_BAND_BYTES	(256u << 10)
+
+typedef struct {
+	uint8_t *dest;
+	const uint8_t *source;		// NULL to read the file instead.
+	int fd;
+	size_t size;
+	atomic_int failed;
+} fill_job_t;
+
+static void fill_band(void *arg, size_t band)
+{
+	fill_job_t *job = arg;
+	size_t offset = band * FILL_BAND_BYTES;
+	size_t length = (job->size - offset < FILL_BAND_BYTES) ? job->size - offset : FILL_BAND_BYTES;
+	if (job->source) {
+		memcpy(job->dest + offset, job->source + offset, length);
+		return;
+	}
+	while (length > 0) {
+		ssize_t bytes_read = pread(job->fd, job->dest + offset, length, (off_t)offset);
+		if (bytes_read <= 0) {		// Errors, or the file shrank since it was measured.
+			atomic_store(&job->failed, 1);
+			return;
+		}
+		offset += (size_t)bytes_read;
+		length -= (size_t)bytes_read;
+	}
+}
+
+static int fill_bands(thread_pool_t *pool, void *dest, const void *source, int fd, size_t size)
+{
+	fill_job_t job = { .dest = dest, .source = source, .fd = fd, .size = size };
+	atomic_init(&job.failed, 0);
+	thread_pool_parallel_for(pool, (size + FILL_BAND_BYTES - 1) / FILL_BAND_BYTES, fill_band, &job);
+	return atomic_load(&job.failed) ? -1 : 0;
+}
+
+static int reserve(uint32_t **buf, size_t *capacity, size_t size)	// Keeps *buf when it is large enough, replaces it otherwise.
+{
+	if (*buf != NULL && *capacity >= size) {
+		return 0;
+	}
+	image_free(*buf);
+	*buf = image_alloc(size);
+	*capacity = (*buf != NULL) ? size : 0;
+	return (*buf != NULL) ? 0 : -1;
+}
+
+static int read_rgba_into(const char *filename, uint32_t **buf, size_t *capacity, size_t *size, thread_pool_t *pool)
 {
 	struct stat st;
 	if (stat(filename, &st) == -1) {
@@ -20,97 +346,323 @@ int read_rgba(const char *filename, uint32_t **buf, size_t *size)
 	
 	if (st.st_size < 0) {
 		fprintf(stderr, "Error(%s): '%s' has an negative size.\n", __func__, filename);
-		if (buf) *buf = NULL;
 		return -1;
 	}
 	*size = (size_t)st.st_size;
 
 	if (*size == 0) {
 		fprintf(stderr, "Error(%s): Input file '%s' has a size of zero.\n", __func__, filename);
-		if (buf) *buf = NULL;
 		return -1;
 	}
         if (*size % 4 != 0) {   // Check for RGBA format, sizes must be multiple of 4.
-                if (buf) *buf = NULL;
                 fprintf(stderr, "Error(%s): '%s' has a size that is not a multiple of 4. Cannot be an RGBA.\n", __func__, filename);
                 return -1;
         }
-	*buf = malloc(*size); //Allocate buffer to be large enough for size
-	if (*buf == NULL) {
+	if (reserve(buf, capacity, *size) == -1) {	// Buffer must be large enough for size
 		fprintf(stderr, "Error(%s): Unable to allocate enough space for the image buffer.\n", __func__);
 		return -1;
 	}
 	int fd = open(filename, O_RDONLY);
-	if (fd == -1) {	// If file descriptor error then free buffer
-		free(*buf);
-		*buf = NULL;
+	if (fd == -1) {
 		fprintf(stderr, "Error(%s): Unable to parse image file descriptor.\n", __func__);
 		return -1;
 	}
-	ssize_t	bytes_read = read(fd, *buf, *size); // Assign bytes_read errchk
+	int result = fill_bands(pool, *buf, NULL, fd, *size);
 	if (close(fd) == -1) {
 		fprintf(stderr, "Warning(%s): Error closing file '%s' after reading.\n", __func__, filename);
 	}
-	if (bytes_read < 0) {	// Error if bytes_read are negative. Will be unable to cast bytes_read to unsigned for comparison.
-		free(*buf);
-		*buf = NULL;
-		fprintf(stderr, "Error(%s): bytes_read should not be negative.\n", __func__);
+	if (result == -1) {
+		fprintf(stderr, "Error(%s): Unable to read all %zu bytes of '%s'.\n", __func__, *size, filename);
 		return -1;
 	}
-	if ((size_t)bytes_read != *size) { 
-		free(*buf);
-		*buf = NULL;
-		fprintf(stderr, "Error(%s): bytes_read does not match image size.\n", __func__);
+	return 0;
+}
+
+int map_rgba(const char *filename, image_map_t how, uint32_t **pixels, size_t *size)
+{
+	*pixels = NULL;
+	*size = 0;
+	int width, height;
+	if (image_info(filename, &width, &height) == 0) {	// stb_image decodes it, there is nothing to map.
+		return 1;
+	}
+
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "Error(%s): Unable to open '%s'.\n", __func__, filename);
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		fprintf(stderr, "Error(%s): Unable to collect %s stats.\n", __func__, filename);
+		close(fd);
+		return -1;
+	}
+	if (st.st_size <= 0) {
+		fprintf(stderr, "Error(%s): Input file '%s' has a size of zero.\n", __func__, filename);
+		close(fd);
 		return -1;
 	}
+	if (st.st_size % 4 != 0) {
+		fprintf(stderr, "Error(%s): '%s' has a size that is not a multiple of 4. Cannot be an RGBA.\n", __func__, filename);
+		close(fd);
+		return -1;
+	}
+
+	void *mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE | (how == IMAGE_MAP_POPULATE ? MAP_POPULATE : 0), fd, 0);
+	close(fd);			// The mapping keeps the file.
+	if (mapping == MAP_FAILED) {
+		fprintf(stderr, "Error(%s): Unable to map '%s'.\n", __func__, filename);
+		return -1;
+	}
+	madvise(mapping, (size_t)st.st_size, MADV_SEQUENTIAL);	// Read ahead further, and drop pages once the bands are past them.
+	*pixels = mapping;
+	*size = (size_t)st.st_size;
 	return 0;
 }
 
-int read_image(const char *filename, uint32_t **buf, size_t *size, int *width, int *height)
+void unmap_rgba(uint32_t *pixels, size_t size)
 {
-	int lwidth, lheight, lchannels;		// Local variables
+	if (pixels != NULL) {
+		munmap(pixels, size);
+	}
+}
 
-	if (width) *width = 0;
-	if (height) *height = 0;
+int read_rgba(const char *filename, uint32_t **buf, size_t *size)
+{
+	size_t capacity = 0;
+	*buf = NULL;
+	if (read_rgba_into(filename, buf, &capacity, size, NULL) == -1) {	// If reading failed then free buffer
+		image_free(*buf);
+		*buf = NULL;
+		return -1;
+	}
+	return 0;
+}
 
-	unsigned char *stb_data = stbi_load(filename, &lwidth, &lheight, &lchannels, 4);
+int image_info(const char *filename, int *width, int *height)	// 0 when stb_image can decode the file, found without decoding it.
+{
+	int channels;
+	STBI_LOCK();
+	int known = stbi_info(filename, width, height, &channels);
+	STBI_UNLOCK();
+	return known ? 0 : -1;
+}
 
-	if (stb_data != NULL) {		// Check for successful image data loading.
-		*size = (size_t)lwidth * (size_t)lheight * 4;
-		if (*size == 0) {
-			fprintf(stderr, "Warning(%s): Image '%s' loaded with a size of zero.\n", __func__, filename);
-			*buf = NULL;
-			stbi_image_free(stb_data);
-			if (width) {
-				*width = lwidth;
-			}
-			if (height) {
-				*height = lheight;
-			}
-			return 0;	// Successful image read but with no data buffer.
+static void reset_stbi_flags(void)	// Called under STBI_LOCK().
+{
+#ifdef STBI_THREAD_LOCAL
+	stbi_set_flip_vertically_on_load_thread(0);
+	stbi_set_unpremultiply_on_load_thread(0);
+	stbi_convert_iphone_png_to_rgb_thread(0);
+#endif
+}
+
+static int keep_decoded(const char *filename, unsigned char *stb_data, int lwidth, int lheight, uint32_t **buf, size_t *capacity, size_t *size, int *width, int *height, thread_pool_t *pool)	// Takes stb_image's pixels over as *buf, or copies them in bands on a pinned pool.
+{
+	size_t data_size = (size_t)lwidth * (size_t)lheight * 4;
+	if (data_size == 0) {
+		fprintf(stderr, "Warning(%s): Image '%s' loaded with a size of zero.\n", __func__, filename);
+		stbi_image_free(stb_data);
+		if (width) {
+			*width = lwidth;
 		}
+		if (height) {
+			*height = lheight;
+		}
+		return 0;	// Successful image read but with no data.
+	}
 
-		*buf = malloc(*size);
-		if (*buf == NULL) {
+	if (thread_pool_is_pinned(pool)) {	// Copied in the bands the differencing will use, so each lands on its thread's node.
+		if (reserve(buf, capacity, data_size) == -1) {
 			fprintf(stderr, "Error(%s): Failed to allocate image buffer while reading '%s'.\n", __func__, filename);
 			stbi_image_free(stb_data);
 			return -1;
 		}
-
-		memcpy(*buf, stb_data, *size);
+		fill_bands(pool, *buf, stb_data, -1, data_size);
 		stbi_image_free(stb_data);
+	} else {			// Otherwise stb_image's own buffer, from image_alloc(), is handed over as it is.
+		image_free(*buf);
+		*buf = (void *)stb_data;
+		*capacity = data_size;
+	}
+	*size = data_size;
 
-		if (width) {
-			*width = lwidth;
-		}
-		if (height) {
-			*height = lheight;
+	if (width) {
+		*width = lwidth;
+	}
+	if (height) {
+		*height = lheight;
+	}
+	return 0;	// Successfull image read with data.
+}
+
+static int read_image_stdio(const char *filename, uint32_t **buf, size_t *capacity, size_t *size, int *width, int *height, thread_pool_t *pool)	// For what can not be mapped, pipes and empty files.
+{
+	int lwidth, lheight, lchannels;		// Local variables
+
+	STBI_LOCK();
+	reset_stbi_flags();
+	unsigned char *stb_data = stbi_load(filename, &lwidth, &lheight, &lchannels, 4);
+	const char *failure_reason = stbi_failure_reason();	// Points at a string literal, safe to keep after unlocking.
+	STBI_UNLOCK();
+
+	if (stb_data != NULL) {		// Check for successful image data loading.
+		return keep_decoded(filename, stb_data, lwidth, lheight, buf, capacity, size, width, height, pool);
+	} else {
+		fprintf(stderr, "Warning(%s): Could not load '%s' as PNG or JPG with stb_image (%s). Attempting RGBA read.\n", __func__, filename,
+			failure_reason ? failure_reason : "unknown reason");
+		return read_rgba_into(filename, buf, capacity, size, pool);
+	}
+}
+
+int read_image_into(const char *filename, uint32_t **buf, size_t *capacity, size_t *size, int *width, int *height, thread_pool_t *pool)
+{
+	int lwidth, lheight, lchannels;		// Local variables
+
+	if (width) *width = 0;
+	if (height) *height = 0;
+	*size = 0;
+
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "Error(%s): Unable to open '%s'.\n", __func__, filename);
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+		close(fd);
+		return read_image_stdio(filename, buf, capacity, size, width, height, pool);
+	}
+	size_t file_size = (size_t)st.st_size;
+	void *mapping = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mapping == MAP_FAILED) {
+		close(fd);
+		return read_image_stdio(filename, buf, capacity, size, width, height, pool);
+	}
+	madvise(mapping, file_size, MADV_SEQUENTIAL);
+
+	unsigned char *stb_data = NULL;
+	const char *failure_reason = "too large to decode";
+	if (file_size <= INT_MAX) {	// Decoded straight from the page cache, without stdio's buffer in between.
+		STBI_LOCK();
+		reset_stbi_flags();
+		stb_data = stbi_load_from_memory(mapping, (int)file_size, &lwidth, &lheight, &lchannels, 4);
+		failure_reason = stbi_failure_reason();
+		STBI_UNLOCK();
+	}
+
+	int result = -1;
+	if (stb_data != NULL) {
+		result = keep_decoded(filename, stb_data, lwidth, lheight, buf, capacity, size, width, height, pool);
+	} else {
+		fprintf(stderr, "Warning(%s): Could not load '%s' as PNG or JPG with stb_image (%s). Attempting RGBA read.\n", __func__, filename,
+			failure_reason ? failure_reason : "unknown reason");
+		if (file_size % 4 != 0) {	// The RGBA read reuses the descriptor and size, pread() beats faulting the mapping in.
+			fprintf(stderr, "Error(%s): '%s' has a size that is not a multiple of 4. Cannot be an RGBA.\n", __func__, filename);
+		} else if (reserve(buf, capacity, file_size) == -1) {
+			fprintf(stderr, "Error(%s): Unable to allocate enough space for the image buffer.\n", __func__);
+		} else if (fill_bands(pool, *buf, NULL, fd, file_size) == -1) {
+			fprintf(stderr, "Error(%s): Unable to read all %zu bytes of '%s'.\n", __func__, file_size, filename);
+		} else {
+			*size = file_size;
+			result = 0;
 		}
-		return 0;	// Successfull image read with data.
+	}
+	munmap(mapping, file_size);
+	if (close(fd) == -1) {
+		fprintf(stderr, "Warning(%s): Error closing file '%s' after reading.\n", __func__, filename);
+	}
+	return result;
+}
+
+int read_image_copied_into(const char *filename, uint32_t **buf, size_t *capacity, size_t *size, int *width, int *height, thread_pool_t *pool)
+{
+	if (width) *width = 0;
+	if (height) *height = 0;
+	*size = 0;
+
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "Error(%s): Unable to open '%s'.\n", __func__, filename);
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+		close(fd);
+		return read_image_stdio(filename, buf, capacity, size, width, height, pool);
+	}
+	size_t file_size = (size_t)st.st_size;
+	uint8_t *data = image_alloc(file_size);
+	if (data == NULL) {
+		fprintf(stderr, "Error(%s): Unable to allocate %zu bytes for '%s'.\n", __func__, file_size, filename);
+		close(fd);
+		return -1;
+	}
+	int result = fill_bands(pool, data, NULL, fd, file_size);	// A file that shrinks meanwhile comes up short here.
+	if (close(fd) == -1) {
+		fprintf(stderr, "Warning(%s): Error closing file '%s' after reading.\n", __func__, filename);
+	}
+	if (result == -1) {
+		fprintf(stderr, "Error(%s): Unable to read all %zu bytes of '%s'.\n", __func__, file_size, filename);
+		image_free(data);
+		return -1;
+	}
+	return decode_image_into(filename, &data, file_size, buf, capacity, size, width, height, pool);
+}
+
+int decode_image_into(const char *filename, uint8_t **data, size_t data_size, uint32_t **buf, size_t *capacity, size_t *size, int *width, int *height, thread_pool_t *pool)
+{
+	int lwidth, lheight, lchannels;
+
+	if (width) *width = 0;
+	if (height) *height = 0;
+	*size = 0;
+
+	unsigned char *stb_data = NULL;
+	const char *failure_reason = "too large to decode";
+	if (data_size <= INT_MAX) {
+		STBI_LOCK();
+		reset_stbi_flags();
+		stb_data = stbi_load_from_memory(*data, (int)data_size, &lwidth, &lheight, &lchannels, 4);
+		failure_reason = stbi_failure_reason();
+		STBI_UNLOCK();
+	}
+
+	if (stb_data != NULL) {
+		image_free(*data);
+		*data = NULL;
+		return keep_decoded(filename, stb_data, lwidth, lheight, buf, capacity, size, width, height, pool);
+	}
+	fprintf(stderr, "Warning(%s): Could not load '%s' as PNG or JPG with stb_image (%s). Attempting RGBA read.\n", __func__, filename,
+		failure_reason ? failure_reason : "unknown reason");
+	if (data_size == 0) {
+		fprintf(stderr, "Error(%s): Input file '%s' has a size of zero.\n", __func__, filename);
+	} else if (data_size % 4 != 0) {
+		fprintf(stderr, "Error(%s): '%s' has a size that is not a multiple of 4. Cannot be an RGBA.\n", __func__, filename);
 	} else {
-		fprintf(stderr, "Warning(%s): Could not load '%s' as PNG or JPG with stb_image. Attempting RGBA read.\n", __func__, filename);
-		return read_rgba(filename, buf, size);
+		image_free(*buf);		// The file's bytes are the pixels, so they become the buffer instead of being copied.
+		*buf = (void *)*data;
+		*capacity = data_size;
+		*size = data_size;
+		*data = NULL;
+		return 0;
+	}
+	image_free(*data);
+	*data = NULL;
+	return -1;
+}
+
+int read_image(const char *filename, uint32_t **buf, size_t *size, int *width, int *height)
+{
+	size_t capacity = 0;
+	*buf = NULL;
+	int result = read_image_into(filename, buf, &capacity, size, width, height, NULL);
+	if (result == -1) {
+		image_free(*buf);
+		*buf = NULL;
 	}
+	return result;
 }
 
 int write_rgba(const char *filename, uint32_t *buf, size_t size)
@@ -139,22 +691,17 @@ int write_rgba(const char *filename, uint32_t *buf, size_t size)
 	return 0;
 }
 
-int write_png(const char *filename, uint32_t *buf, int width, int height)
+int write_png(const char *filename, uint32_t *buf, int width, int height, thread_pool_t *pool)
 {
 	if ((width < 1) || (height < 1)) {
 		fprintf(stderr, "Error(%s): Dimensions %dx%d for writing PNG '%s' are invalid.\n", __func__, width, height, filename);
 		return -1;
 	}
 
-	int success = stbi_write_png(filename, width, height, 4, buf, width * 4);
-	if (!success) {
-		fprintf(stderr, "Error(%s), Failed to write PNG image to '%s'.\n", __func__, filename);
-		return -1;
-	}
-	return 0;
+	return png_write_image(filename, (const uint8_t *)buf, width, height, 4, (size_t)width * 4, pool);
 }
 
-int write_image(const char *filename, uint32_t *buf, size_t size, int width_output, int height_output) {
+int write_image(const char *filename, uint32_t *buf, size_t size, int width_output, int height_output, thread_pool_t *pool) {
 	if (!filename) {
 		fprintf(stderr, "Error(%s): Image write called with NULL file name.\n", __func__);
 		return -1;
@@ -170,7 +717,7 @@ int write_image(const char *filename, uint32_t *buf, size_t size, int width_outp
 	size_t len = strlen(filename);
 
 	if (len >= 4 && strcmp(filename + len - 4, ".png") == 0) {	// If the argument is greater than 4 characters, and the the four characters starting at address (filename + len - 4) are ".png"
-		return write_png(filename, buf, width_output, height_output);
+		return write_png(filename, buf, width_output, height_output, pool);
 	} else if (len >= 4 && strcmp(filename + len - 4, "rgba") == 0) {
 		return write_rgba(filename, buf, size);
 	} else {
@@ -180,3 +727,81 @@ int write_image(const char *filename, uint32_t *buf, size_t size, int width_outp
 	}
 }
 
+
+int write_mask(const char *filename, const uint8_t *mask, size_t num_pixels, int width, int height, thread_pool_t *pool)
+{
+	if (!filename || !mask) {
+		fprintf(stderr, "Error(%s): Mask write called with a NULL file name or mask buffer.\n", __func__);
+		return -1;
+	}
+
+	size_t len = strlen(filename);
+
+	if (len >= 4 && strcmp(filename + len - 4, ".png") == 0) {	// Written as an 8-bit grayscale PNG, one byte per pixel.
+		if ((width < 1) || (height < 1) || ((size_t)width * (size_t)height != num_pixels)) {
+			fprintf(stderr, "Error(%s): Dimensions %dx%d for writing mask PNG '%s' are invalid.\n", __func__, width, height, filename);
+			return -1;
+		}
+		return png_write_image(filename, mask, width, height, 1, (size_t)width, pool);
+	} else if (len >= 4 && strcmp(filename + len - 4, "rgba") == 0) {	// RGBA has no grayscale form, so expand to opaque white or black pixels.
+		uint32_t *rgba = malloc(num_pixels * sizeof(uint32_t));
+		if (rgba == NULL) {
+			fprintf(stderr, "Error(%s): Unable to allocate the RGBA mask buffer for '%s'.\n", __func__, filename);
+			return -1;
+		}
+		size_t px_idx;
+		for (px_idx = 0; px_idx < num_pixels; ++px_idx) {
+			rgba[px_idx] = mask[px_idx] ? 0xFFFFFFFF : 0xFF000000;
+		}
+		int result = write_rgba(filename, rgba, num_pixels * sizeof(uint32_t));
+		free(rgba);
+		return result;
+	} else {
+		fprintf(stderr, "Error: Unsupported output file type for '%s'.\n", filename);
+		fprintf(stderr, "	Output filename must end with '.png' (with valid dimensions) or 'rgba'\n");
+		return -1;
+	}
+}
+
+int write_image_region(const char *filename, const uint32_t *buf, int stride, int x, int y, int width, int height, thread_pool_t *pool)	// stride is the full image width in pixels.
+{
+	if (!filename || !buf) {
+		fprintf(stderr, "Error(%s): Region write called with a NULL file name or image buffer.\n", __func__);
+		return -1;
+	}
+	if ((width < 1) || (height < 1) || (x < 0) || (y < 0) || (x + width > stride)) {
+		fprintf(stderr, "Error(%s): Region %dx%d at (%d, %d) for writing '%s' is invalid.\n", __func__, width, height, x, y, filename);
+		return -1;
+	}
+
+	const uint32_t *origin = buf + (size_t)y * (size_t)stride + (size_t)x;
+	size_t len = strlen(filename);
+
+	if (len >= 4 && strcmp(filename + len - 4, ".png") == 0) {	// The encoder reads the region in place through the row stride.
+		return png_write_image(filename, (const uint8_t *)origin, width, height, 4, (size_t)stride * 4, pool);
+	} else if (len >= 4 && strcmp(filename + len - 4, "rgba") == 0) {
+		int fd = open(filename, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+		if (fd == -1) {
+			fprintf(stderr, "Error(%s): Unable to open or create '%s' for writing RGBA data.\n", __func__, filename);
+			return -1;
+		}
+		size_t row_bytes = (size_t)width * sizeof(uint32_t);
+		int row;
+		for (row = 0; row < height; ++row) {		// One write per row of the region.
+			ssize_t bytes_written = write(fd, origin + (size_t)row * (size_t)stride, row_bytes);
+			if (bytes_written < 0 || (size_t)bytes_written != row_bytes) {
+				fprintf(stderr, "Error(%s): Writing row %d of the region to '%s' failed.\n", __func__, row, filename);
+				close(fd);
+				return -1;
+			}
+		}
+		if (close(fd) == -1) {
+			fprintf(stderr, "Warning(%s): There was an error with closing '%s' after writing RGBA data.\n", __func__, filename);
+		}
+		return 0;
+	} else {
+		fprintf(stderr, "Error: Unsupported output file type for '%s'.\n", filename);
+		fprintf(stderr, "	Output filename must end with '.png' (with valid dimensions) or 'rgba'\n");
+		return -1;
+	}
+}
@@ -3,12 +3,38 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "thread_pool.h"
 
+typedef enum {
+	IMAGE_MAP_OFF,			// Read raw RGBA files into a buffer.
+	IMAGE_MAP_SEQUENTIAL,		// Map them, paged in as they are read.
+	IMAGE_MAP_POPULATE		// Map them and fault every page in up front.
+} image_map_t;
+
+typedef struct {
+	uint64_t hits;			// Large allocations served from the arena.
+	uint64_t misses;		// Large allocations that had to go to the C library.
+	size_t buffers;			// Held for reuse now.
+	size_t retained_bytes;
+} image_arena_stats_t;
+
+void *image_alloc(size_t size);	// Every image buffer handed out, stb_image's included, comes from here and goes back through image_free(). 64-byte aligned, 2 MB aligned and on huge pages from 2 MB up.
+void image_free(void *buf);	// Buffers from 2 MB up are kept for reuse, up to the arena's cap.
+void image_arena_set_cap(size_t cap_bytes);	// Releases what is held beyond the new cap, 0 (the default) keeps nothing.
+void image_arena_stats(image_arena_stats_t *stats);
 int read_rgba(const char *filename, uint32_t **buf, size_t *size);
-int read_image(const char *filename, uint32_t **buf, size_t *size, int *width, int *height);
-int write_image(const char *filename, uint32_t *buf, size_t size, int width, int height);
+int map_rgba(const char *filename, image_map_t how, uint32_t **pixels, size_t *size);	// Read-only pages of a raw RGBA file. Returns 1 for files stb_image decodes, which are not mapped.
+void unmap_rgba(uint32_t *pixels, size_t size);
+int image_info(const char *filename, int *width, int *height);
+int read_image(const char *filename, uint32_t **buf, size_t *size, int *width, int *height);	// Safe to call from several threads at once.
+int read_image_into(const char *filename, uint32_t **buf, size_t *capacity, size_t *size, int *width, int *height, thread_pool_t *pool);	// Reuses *buf when it holds the image, the buffer stays the caller's even on errors. Filled in bands on the pool, which may be NULL.
+int read_image_copied_into(const char *filename, uint32_t **buf, size_t *capacity, size_t *size, int *width, int *height, thread_pool_t *pool);	// Like read_image_into(), but the file is read into memory instead of mapped, so one truncated meanwhile fails the read instead of raising SIGBUS.
+int decode_image_into(const char *filename, uint8_t **data, size_t data_size, uint32_t **buf, size_t *capacity, size_t *size, int *width, int *height, thread_pool_t *pool);	// Like read_image_into() on the file's bytes, already in *data (from image_alloc()). Always takes *data over, raw RGBA bytes become *buf.
+int write_image(const char *filename, uint32_t *buf, size_t size, int width, int height, thread_pool_t *pool);	// PNGs are compressed in strips on the pool, which may be NULL.
 int write_rgba(const char *filename, uint32_t *buf, size_t size);
-int write_png(const char *filename, uint32_t *buf, int width, int height);
+int write_png(const char *filename, uint32_t *buf, int width, int height, thread_pool_t *pool);
+int write_image_region(const char *filename, const uint32_t *buf, int stride, int x, int y, int width, int height, thread_pool_t *pool);
+int write_mask(const char *filename, const uint8_t *mask, size_t num_pixels, int width, int height, thread_pool_t *pool);
 
 #endif
 
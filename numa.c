@@ -0,0 +1,174 @@
+#define _GNU_SOURCE			// sched_getaffinity() and syscall().
+#include "numa.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifndef NUMA_NODE_DIR
+#define NUMA_NODE_DIR	"/sys/devices/system/node"
+#endif
+#define MAX_NODES	1024
+#define MAX_CPUS	CPU_SETSIZE
+#define MPOL_INTERLEAVE	3		// From <linux/mempolicy.h>.
+
+typedef struct {
+	int num_nodes;			// Nodes with usable processors.
+	int num_cpus;
+	int cpus[MAX_CPUS];		// Usable processors, node by node.
+	int node_end[MAX_NODES];	// One past the last processor of each node in cpus.
+} topology_t;
+
+int numa_placement_parse(const char *name, numa_placement_t *placement)
+{
+	if (strcmp(name, "auto") == 0) {
+		*placement = NUMA_AUTO;
+	} else if (strcmp(name, "off") == 0) {
+		*placement = NUMA_OFF;
+	} else if (strcmp(name, "local") == 0) {
+		*placement = NUMA_LOCAL;
+	} else if (strcmp(name, "interleave") == 0) {
+		*placement = NUMA_INTERLEAVE;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+const char *numa_placement_name(numa_placement_t placement)
+{
+	switch (placement) {
+	case NUMA_AUTO:		return "auto";
+	case NUMA_OFF:		return "off";
+	case NUMA_LOCAL:	return "local";
+	case NUMA_INTERLEAVE:	return "interleave";
+	}
+	return "unknown";
+}
+
+static int read_list(const char *path, unsigned char *member, int limit)	// Parses a sysfs list such as "0-3,8-11".
+{
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		return -1;
+	}
+	char text[4096];
+	char *line = fgets(text, sizeof(text), file);
+	fclose(file);
+	if (line == NULL) {
+		return -1;
+	}
+
+	memset(member, 0, (size_t)limit);
+	const char *cursor = text;
+	while (*cursor != '\0' && *cursor != '\n') {	// Empty for a node without processors.
+		char *end = NULL;
+		long first = strtol(cursor, &end, 10);
+		long last = first;
+		if (end == cursor) {
+			return -1;
+		}
+		if (*end == '-') {
+			cursor = end + 1;
+			last = strtol(cursor, &end, 10);
+			if (end == cursor) {
+				return -1;
+			}
+		}
+		if (first < 0 || last < first || last >= limit) {
+			return -1;
+		}
+		for (; first <= last; ++first) {
+			member[first] = 1;
+		}
+		if (*end != ',') {
+			break;
+		}
+		cursor = end + 1;
+	}
+	return 0;
+}
+
+static int read_topology(topology_t *topo)
+{
+	cpu_set_t allowed;
+	unsigned char online[MAX_NODES];
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 || read_list(NUMA_NODE_DIR "/online", online, MAX_NODES) == -1) {
+		return -1;
+	}
+
+	topo->num_nodes = 0;
+	topo->num_cpus = 0;
+	int node;
+	for (node = 0; node < MAX_NODES; ++node) {
+		char path[128];
+		unsigned char member[MAX_CPUS];
+		snprintf(path, sizeof(path), NUMA_NODE_DIR "/node%d/cpulist", node);
+		if (!online[node] || read_list(path, member, MAX_CPUS) == -1) {
+			continue;
+		}
+		int usable = 0;
+		int cpu;
+		for (cpu = 0; cpu < MAX_CPUS; ++cpu) {
+			if (member[cpu] && CPU_ISSET((size_t)cpu, &allowed)) {
+				topo->cpus[topo->num_cpus + usable++] = cpu;
+			}
+		}
+		if (usable > 0) {		// Memory-only nodes and nodes outside the affinity mask run no threads.
+			topo->num_cpus += usable;
+			topo->node_end[topo->num_nodes++] = topo->num_cpus;
+		}
+	}
+	return (topo->num_cpus > 0) ? 0 : -1;
+}
+
+int numa_num_nodes(void)
+{
+	topology_t topo;
+	return (read_topology(&topo) == 0) ? topo.num_nodes : 1;
+}
+
+int numa_thread_cpus(int num_threads, int *cpus)
+{
+	topology_t topo;
+	if (read_topology(&topo) == -1) {
+		fprintf(stderr, "Warning(%s): No usable NUMA topology under '%s'.\n", __func__, NUMA_NODE_DIR);
+		return -1;
+	}
+
+	int thread;
+	for (thread = 0; thread < num_threads; ++thread) {	// Matches the contiguous shares thread_pool_pin() deals out.
+		int node = (int)((long)thread * topo.num_nodes / num_threads);
+		int first_thread = (int)(((long)node * num_threads + topo.num_nodes - 1) / topo.num_nodes);
+		int node_start = (node == 0) ? 0 : topo.node_end[node - 1];
+		int node_cpus = topo.node_end[node] - node_start;
+		cpus[thread] = topo.cpus[node_start + (thread - first_thread) % node_cpus];
+	}
+	return 0;
+}
+
+int numa_interleave_memory(void)
+{
+	unsigned char has_memory[MAX_NODES];
+	if (read_list(NUMA_NODE_DIR "/has_memory", has_memory, MAX_NODES) == -1 &&
+	    read_list(NUMA_NODE_DIR "/online", has_memory, MAX_NODES) == -1) {
+		fprintf(stderr, "Warning(%s): No NUMA nodes listed under '%s'.\n", __func__, NUMA_NODE_DIR);
+		return -1;
+	}
+
+	unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))];
+	memset(mask, 0, sizeof(mask));
+	size_t node;
+	for (node = 0; node < MAX_NODES; ++node) {
+		if (has_memory[node]) {
+			mask[node / (8 * sizeof(unsigned long))] |= 1ul << (node % (8 * sizeof(unsigned long)));
+		}
+	}
+	if (syscall(SYS_set_mempolicy, MPOL_INTERLEAVE, mask, (unsigned long)MAX_NODES + 1) == -1) {	// The kernel reads one bit less than maxnode.
+		fprintf(stderr, "Warning(%s): Unable to interleave memory over the NUMA nodes.\n", __func__);
+		return -1;
+	}
+	return 0;
+}
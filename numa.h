@@ -0,0 +1,24 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+/*
+NUMA placement without libnuma. The topology comes from sysfs and the memory policy is set through
+the raw system call, so the static build keeps working and machines without NUMA see one node.
+LOCAL pins the threads node by node and leaves pages to be placed by whichever thread touches them
+first, INTERLEAVE pins the same way but spreads pages round-robin over every node with memory.
+*/
+
+typedef enum {
+	NUMA_AUTO,		// LOCAL on machines with several nodes, OFF otherwise.
+	NUMA_OFF,
+	NUMA_LOCAL,
+	NUMA_INTERLEAVE,
+} numa_placement_t;
+
+int numa_placement_parse(const char *name, numa_placement_t *placement);
+const char *numa_placement_name(numa_placement_t placement);
+int numa_num_nodes(void);				// Nodes with processors this process may run on, 1 without NUMA.
+int numa_thread_cpus(int num_threads, int *cpus);	// One processor per thread, threads split evenly over the nodes in order.
+int numa_interleave_memory(void);			// Pages first touched from now on are spread over the nodes.
+
+#endif
@@ -2,10 +2,29 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #ifdef __ARM_NEON
 #include <arm_neon.h>
 #endif
 
+#ifdef PIX_DIFF_NEON_X4
+#include <pthread.h>
+#endif
+
+#ifdef PIX_DIFF_X86
+#include <immintrin.h>
+#endif
+
+#ifdef PIX_DIFF_SVE
+#include <sys/auxv.h>
+#ifndef HWCAP_SVE
+#define HWCAP_SVE	(1 << 22)
+#endif
+#endif
+
 uint32_t calculate_pixel_difference(uint32_t pix1, uint32_t pix2, diff_mode_t mode)
 {
 	static uint32_t alpha_only_mask = 0xFF000000;
@@ -38,23 +57,110 @@ uint32_t calculate_pixel_difference(uint32_t pix1, uint32_t pix2, diff_mode_t mo
 	return pixout | alpha_only_mask;	// Forces 100% opacity. Otherwise, the result will assume img1's opacity levels which could be confusing.
 }
 
-void diff_scalar(uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode)
+void diff_scalar_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode)
 {
         size_t num_pixels = size / sizeof(uint32_t);
 
         size_t px_idx;
         for (px_idx = 0; px_idx < num_pixels; ++px_idx) {
-                img1[px_idx] = calculate_pixel_difference(img1[px_idx], img2[px_idx], mode);
+                dst[px_idx] = calculate_pixel_difference(img1[px_idx], img2[px_idx], mode);
         }
 }
 
+void diff_scalar(uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode)
+{
+	diff_scalar_out(img1, img1, img2, size, mode);	// In place, the difference overwrites img1.
+}
+
+/*
+SIMD within a register: two pixels are held in one uint64_t and all eight channels are subtracted at
+once, with the high bit of every byte handled separately so no borrow crosses into the next channel.
+Portable C, bit-identical to calculate_pixel_difference(), for targets without vector intrinsics.
+*/
+#define SWAR_HIGH_BITS	0x8080808080808080ull	// Bit 7 of every byte.
+#define SWAR_LOW_BITS	0x0101010101010101ull	// Bit 0 of every byte.
+#define SWAR_ALPHA_MASK	0xFF000000FF000000ull	// Alpha channel of both pixels.
+
+static inline uint64_t swar_sub_mod(uint64_t pxs1, uint64_t pxs2)		// (px1_channel - px2_channel) % 256 for every byte.
+{
+	return ((pxs1 | SWAR_HIGH_BITS) - (pxs2 & ~SWAR_HIGH_BITS)) ^ ((pxs1 ^ ~pxs2) & SWAR_HIGH_BITS);
+}
+
+static inline uint64_t swar_borrow_mask(uint64_t pxs1, uint64_t pxs2, uint64_t bytes_diff)	// 0xFF in every byte where px1_channel < px2_channel.
+{
+	uint64_t borrow = ((~pxs1 & pxs2) | (~(pxs1 ^ pxs2) & bytes_diff)) & SWAR_HIGH_BITS;	// Borrow out of bit 7 of each byte.
+	return (borrow - (borrow >> 7)) | borrow;
+}
+
+static inline uint64_t swar_sub_sat(uint64_t pxs1, uint64_t pxs2)		// max(0, px1_channel - px2_channel)
+{
+	uint64_t bytes_diff = swar_sub_mod(pxs1, pxs2);
+	return bytes_diff & ~swar_borrow_mask(pxs1, pxs2, bytes_diff);
+}
+
+static inline uint64_t swar_sub_abs(uint64_t pxs1, uint64_t pxs2)		// |px1_channel - px2_channel|
+{
+	uint64_t bytes_diff = swar_sub_mod(pxs1, pxs2);
+	uint64_t negative = swar_borrow_mask(pxs1, pxs2, bytes_diff);
+	return (bytes_diff ^ negative) + (negative & SWAR_LOW_BITS);		// Two's complement negate of the borrowing bytes, a borrowing byte is never 0 so no carry escapes.
+}
+
+void diff_swar_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode)
+{
+	size_t num_pixels = size / sizeof(uint32_t);
+	uint64_t swar_pxs1, swar_pxs2;					// 2 pixels each, loaded with memcpy so uint32_t alignment is enough.
+
+	size_t px_idx = 0;
+	switch (mode) {							// One loop per mode so the mode is only checked once per image.
+		case SAT:
+			for (; px_idx + 1 < num_pixels; px_idx += 2) {
+				memcpy(&swar_pxs1, img1 + px_idx, sizeof(swar_pxs1));
+				memcpy(&swar_pxs2, img2 + px_idx, sizeof(swar_pxs2));
+				swar_pxs1 = swar_sub_sat(swar_pxs1, swar_pxs2) | SWAR_ALPHA_MASK;
+				memcpy(dst + px_idx, &swar_pxs1, sizeof(swar_pxs1));
+			}
+			if (px_idx < num_pixels) {			// Odd pixel count, the last pixel uses the low half only.
+				dst[px_idx] = (uint32_t)(swar_sub_sat(img1[px_idx], img2[px_idx]) | SWAR_ALPHA_MASK);
+			}
+			break;
+		case MOD:
+			for (; px_idx + 1 < num_pixels; px_idx += 2) {
+				memcpy(&swar_pxs1, img1 + px_idx, sizeof(swar_pxs1));
+				memcpy(&swar_pxs2, img2 + px_idx, sizeof(swar_pxs2));
+				swar_pxs1 = swar_sub_mod(swar_pxs1, swar_pxs2) | SWAR_ALPHA_MASK;
+				memcpy(dst + px_idx, &swar_pxs1, sizeof(swar_pxs1));
+			}
+			if (px_idx < num_pixels) {
+				dst[px_idx] = (uint32_t)(swar_sub_mod(img1[px_idx], img2[px_idx]) | SWAR_ALPHA_MASK);
+			}
+			break;
+		case ABS:
+		default:
+			for (; px_idx + 1 < num_pixels; px_idx += 2) {
+				memcpy(&swar_pxs1, img1 + px_idx, sizeof(swar_pxs1));
+				memcpy(&swar_pxs2, img2 + px_idx, sizeof(swar_pxs2));
+				swar_pxs1 = swar_sub_abs(swar_pxs1, swar_pxs2) | SWAR_ALPHA_MASK;
+				memcpy(dst + px_idx, &swar_pxs1, sizeof(swar_pxs1));
+			}
+			if (px_idx < num_pixels) {
+				dst[px_idx] = (uint32_t)(swar_sub_abs(img1[px_idx], img2[px_idx]) | SWAR_ALPHA_MASK);
+			}
+			break;
+	}
+}
+
+void diff_swar(uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode)
+{
+	diff_swar_out(img1, img1, img2, size, mode);
+}
+
 #ifdef __ARM_NEON
-void diff_neon(uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode)
+void diff_neon_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode)
 {
 	size_t num_pixels = size / sizeof(uint32_t);			// The number of pixels in the image.
 	const uint32x4_t alpha_only_mask = vdupq_n_u32(0xFF000000);	// Mask used to force output image opacity to 100%.
 	
-	uint8_t *img1_bytes = (uint8_t *)img1;				// Cast image pointers for byte iteration with NEON operations. 
+	const uint8_t *img1_bytes = (const uint8_t *)img1;		// Cast image pointers for byte iteration with NEON operations. 
 	const uint8_t *img2_bytes = (const uint8_t *)img2;
 
 	uint8x16_t neon_pxs1, neon_pxs2, neon_bytes_diff;		// Stores the data for 4 pixels each and the difference between them. 
@@ -80,12 +186,700 @@ void diff_neon(uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mo
 		
 		neon_result = vreinterpretq_u32_u8(neon_bytes_diff);
 		neon_result = vorrq_u32(neon_result, alpha_only_mask);
-		vst1q_u32(img1 + px_idx, neon_result);			// Store opacity corrected pixels.
+		vst1q_u32(dst + px_idx, neon_result);			// Store opacity corrected pixels.
 	}
 
 	for (; px_idx < num_pixels; px_idx++) { // Process the last up to 3 pixels
-		img1[px_idx] = calculate_pixel_difference(img1[px_idx], img2[px_idx], mode);
+		dst[px_idx] = calculate_pixel_difference(img1[px_idx], img2[px_idx], mode);
+	}
+}
+
+void diff_neon(uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode)
+{
+	diff_neon_out(img1, img1, img2, size, mode);
+}
+#endif
+
+
+#ifdef PIX_DIFF_NEON_X4
+#define NEON_PREFETCH_BYTES	512		// How far ahead of the loads to prefetch, 8 cache lines on Cortex-A76.
+#define DEFAULT_LLC_BYTES	(2u << 20)	// Used when the cache size can not be read, matches the Pi 5's 2MB L3.
+
+static size_t llc_bytes = 0;
+static pthread_once_t llc_once = PTHREAD_ONCE_INIT;
+
+static void read_llc_bytes(void)	// Largest cache reported by sysfs for cpu0.
+{
+	size_t largest = 0;
+	char path[64];
+	int index;
+	for (index = 0; index < 8; ++index) {
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", index);
+		FILE *fp = fopen(path, "r");
+		if (!fp) {
+			break;
+		}
+		unsigned long cache_size = 0;
+		char unit = 0;
+		if (fscanf(fp, "%lu%c", &cache_size, &unit) >= 1) {
+			if (unit == 'K') {
+				cache_size <<= 10;
+			}
+			if (unit == 'M') {
+				cache_size <<= 20;
+			}
+			if (cache_size > largest) {
+				largest = cache_size;
+			}
+		}
+		fclose(fp);
+	}
+	llc_bytes = largest ? largest : DEFAULT_LLC_BYTES;	// Published whole, never a partial maximum.
+}
+
+static size_t last_level_cache_bytes(void)	// Read once, callers on other threads wait for it.
+{
+	pthread_once(&llc_once, read_llc_bytes);
+	return llc_bytes;
+}
+
+static inline __attribute__((always_inline)) uint8x16_t neon_bytes_diff(uint8x16_t neon_pxs1, uint8x16_t neon_pxs2, diff_mode_t mode)
+{
+	switch (mode) {
+		case ABS:
+			return vabdq_u8(neon_pxs1, neon_pxs2);
+		case SAT:
+			return vqsubq_u8(neon_pxs1, neon_pxs2);
+		case MOD:
+		default:
+			return vsubq_u8(neon_pxs1, neon_pxs2);
+	}
+}
+
+static inline __attribute__((always_inline)) void neon_store_nontemporal(uint32_t *dst, uint32x4x4_t neon_result)
+{
+	__asm__ volatile ("stnp %q[r0], %q[r1], [%[dst]]\n\t"
+			  "stnp %q[r2], %q[r3], [%[dst], #32]"
+			  :
+			  : [dst] "r" (dst), [r0] "w" (neon_result.val[0]), [r1] "w" (neon_result.val[1]),
+			    [r2] "w" (neon_result.val[2]), [r3] "w" (neon_result.val[3])
+			  : "memory");
+}
+
+/*
+The mode and store type are compile time constants at every call site below, so always_inline gives
+one specialized loop per combination and the switch in neon_bytes_diff() is resolved outside the loop.
+*/
+static inline __attribute__((always_inline)) size_t neon_x4_loop(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t num_pixels, diff_mode_t mode, int nontemporal)
+{
+	const uint32x4_t alpha_only_mask = vdupq_n_u32(0xFF000000);
+	const uint8_t *img1_bytes = (const uint8_t *)img1;
+	const uint8_t *img2_bytes = (const uint8_t *)img2;
+
+	uint8x16x4_t neon_pxs1, neon_pxs2;				// 4 registers of 4 pixels each, 64 bytes per image per iteration.
+	uint32x4x4_t neon_result;
+
+	size_t px_idx;
+	for (px_idx = 0; px_idx + 15 < num_pixels; px_idx += 16) {
+		__builtin_prefetch(img1_bytes + px_idx * sizeof(uint32_t) + NEON_PREFETCH_BYTES, 0, 0);	// Streaming read hint, the data is only touched once.
+		__builtin_prefetch(img2_bytes + px_idx * sizeof(uint32_t) + NEON_PREFETCH_BYTES, 0, 0);
+
+		neon_pxs1 = vld1q_u8_x4(img1_bytes + px_idx * sizeof(uint32_t));
+		neon_pxs2 = vld1q_u8_x4(img2_bytes + px_idx * sizeof(uint32_t));
+
+		neon_result.val[0] = vorrq_u32(vreinterpretq_u32_u8(neon_bytes_diff(neon_pxs1.val[0], neon_pxs2.val[0], mode)), alpha_only_mask);
+		neon_result.val[1] = vorrq_u32(vreinterpretq_u32_u8(neon_bytes_diff(neon_pxs1.val[1], neon_pxs2.val[1], mode)), alpha_only_mask);
+		neon_result.val[2] = vorrq_u32(vreinterpretq_u32_u8(neon_bytes_diff(neon_pxs1.val[2], neon_pxs2.val[2], mode)), alpha_only_mask);
+		neon_result.val[3] = vorrq_u32(vreinterpretq_u32_u8(neon_bytes_diff(neon_pxs1.val[3], neon_pxs2.val[3], mode)), alpha_only_mask);
+
+		if (nontemporal) {
+			neon_store_nontemporal(dst + px_idx, neon_result);	// Keeps the output from evicting the inputs still to be read.
+		} else {
+			vst1q_u32_x4(dst + px_idx, neon_result);
+		}
+	}
+
+	for (; px_idx + 3 < num_pixels; px_idx += 4) {			// Single register steps for the last up to 15 pixels.
+		uint8x16_t neon_bytes = neon_bytes_diff(vld1q_u8(img1_bytes + px_idx * sizeof(uint32_t)), vld1q_u8(img2_bytes + px_idx * sizeof(uint32_t)), mode);
+		vst1q_u32(dst + px_idx, vorrq_u32(vreinterpretq_u32_u8(neon_bytes), alpha_only_mask));
+	}
+	return px_idx;
+}
+
+static inline __attribute__((always_inline)) void neon_x4_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode, int nontemporal)
+{
+	size_t num_pixels = size / sizeof(uint32_t);
+	size_t px_idx;
+
+	switch (mode) {
+		case ABS:
+			px_idx = neon_x4_loop(dst, img1, img2, num_pixels, ABS, nontemporal);
+			break;
+		case SAT:
+			px_idx = neon_x4_loop(dst, img1, img2, num_pixels, SAT, nontemporal);
+			break;
+		case MOD:
+		default:
+			px_idx = neon_x4_loop(dst, img1, img2, num_pixels, MOD, nontemporal);
+			break;
+	}
+
+	for (; px_idx < num_pixels; px_idx++) {	// Process the last up to 3 pixels
+		dst[px_idx] = calculate_pixel_difference(img1[px_idx], img2[px_idx], mode);
+	}
+}
+
+void diff_neon_x4_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode)
+{
+	neon_x4_out(dst, img1, img2, size, mode, 0);
+}
+
+void diff_neon_x4_nt_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode)	// Chosen by diff_image_out_fn() for images larger than the cache.
+{
+	neon_x4_out(dst, img1, img2, size, mode, 1);
+}
+
+void diff_neon_x4(uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode)
+{
+	diff_neon_x4_out(img1, img1, img2, size, mode);
+}
+#endif
+
+#ifdef PIX_DIFF_X86
+__attribute__((target("sse2")))
+void diff_sse2_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode)
+{
+	size_t num_pixels = size / sizeof(uint32_t);				// The number of pixels in the image.
+	const __m128i alpha_only_mask = _mm_set1_epi32((int)0xFF000000);	// Mask used to force output image opacity to 100%.
+
+	__m128i sse_pxs1, sse_pxs2, sse_bytes_diff;				// Stores the data for 4 pixels each and the difference between them.
+
+	size_t px_idx;
+	for (px_idx = 0; px_idx + 3 < num_pixels; px_idx += 4) {
+		sse_pxs1 = _mm_loadu_si128((const __m128i *)(img1 + px_idx));	// Load 4 pixels * 32bits/pixel = 128 bits.
+		sse_pxs2 = _mm_loadu_si128((const __m128i *)(img2 + px_idx));
+
+		switch (mode) {
+			case ABS:	// SSE2 has no unsigned byte abs-diff, so OR the two one-sided saturated differences.
+				sse_bytes_diff = _mm_or_si128(_mm_subs_epu8(sse_pxs1, sse_pxs2), _mm_subs_epu8(sse_pxs2, sse_pxs1));
+				break;
+			case SAT:
+				sse_bytes_diff = _mm_subs_epu8(sse_pxs1, sse_pxs2);	// max(0, px1_channel - px2_channel)
+				break;
+			case MOD:
+			default:
+				sse_bytes_diff = _mm_sub_epi8(sse_pxs1, sse_pxs2);	// (px1_channel - px2_channel) % 256
+				break;
+		}
+
+		_mm_storeu_si128((__m128i *)(dst + px_idx), _mm_or_si128(sse_bytes_diff, alpha_only_mask));	// Store opacity corrected pixels.
+	}
+
+	for (; px_idx < num_pixels; px_idx++) {	// Process the last up to 3 pixels
+		dst[px_idx] = calculate_pixel_difference(img1[px_idx], img2[px_idx], mode);
+	}
+}
+
+void diff_sse2(uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode)
+{
+	diff_sse2_out(img1, img1, img2, size, mode);
+}
+
+static int is_aligned(const void *dst, const void *img1, const void *img2, size_t alignment)	// Buffers from image_alloc() are, at every band offset.
+{
+	return (((uintptr_t)dst | (uintptr_t)img1 | (uintptr_t)img2) & (alignment - 1)) == 0;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_bytes_diff(__m256i avx_pxs1, __m256i avx_pxs2, diff_mode_t mode)
+{
+	switch (mode) {
+		case ABS:
+			return _mm256_or_si256(_mm256_subs_epu8(avx_pxs1, avx_pxs2), _mm256_subs_epu8(avx_pxs2, avx_pxs1));
+		case SAT:
+			return _mm256_subs_epu8(avx_pxs1, avx_pxs2);
+		case MOD:
+		default:
+			return _mm256_sub_epi8(avx_pxs1, avx_pxs2);
+	}
+}
+
+__attribute__((target("avx2")))
+void diff_avx2_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode)
+{
+	size_t num_pixels = size / sizeof(uint32_t);
+	const __m256i alpha_only_mask = _mm256_set1_epi32((int)0xFF000000);
+
+	__m256i avx_pxs1, avx_pxs2, avx_bytes_diff;				// Stores the data for 8 pixels each and the difference between them.
+
+	size_t px_idx = 0;
+	if (is_aligned(dst, img1, img2, sizeof(__m256i))) {			// Aligned loads and stores, no access straddles a cache line.
+		for (; px_idx + 7 < num_pixels; px_idx += 8) {
+			avx_bytes_diff = avx2_bytes_diff(_mm256_load_si256((const __m256i *)(img1 + px_idx)), _mm256_load_si256((const __m256i *)(img2 + px_idx)), mode);
+			_mm256_store_si256((__m256i *)(dst + px_idx), _mm256_or_si256(avx_bytes_diff, alpha_only_mask));
+		}
+	}
+	for (; px_idx + 7 < num_pixels; px_idx += 8) {
+		avx_pxs1 = _mm256_loadu_si256((const __m256i *)(img1 + px_idx));	// Load 8 pixels * 32bits/pixel = 256 bits.
+		avx_pxs2 = _mm256_loadu_si256((const __m256i *)(img2 + px_idx));
+		avx_bytes_diff = avx2_bytes_diff(avx_pxs1, avx_pxs2, mode);
+		_mm256_storeu_si256((__m256i *)(dst + px_idx), _mm256_or_si256(avx_bytes_diff, alpha_only_mask));
+	}
+
+	for (; px_idx < num_pixels; px_idx++) {	// Process the last up to 7 pixels
+		dst[px_idx] = calculate_pixel_difference(img1[px_idx], img2[px_idx], mode);
+	}
+}
+
+void diff_avx2(uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode)
+{
+	diff_avx2_out(img1, img1, img2, size, mode);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i avx512_bytes_diff(__m512i avx_pxs1, __m512i avx_pxs2, diff_mode_t mode)
+{
+	switch (mode) {
+		case ABS:
+			return _mm512_or_si512(_mm512_subs_epu8(avx_pxs1, avx_pxs2), _mm512_subs_epu8(avx_pxs2, avx_pxs1));
+		case SAT:
+			return _mm512_subs_epu8(avx_pxs1, avx_pxs2);
+		case MOD:
+		default:
+			return _mm512_sub_epi8(avx_pxs1, avx_pxs2);
 	}
 }
+
+__attribute__((target("avx512f,avx512bw")))
+void diff_avx512_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode)
+{
+	size_t num_pixels = size / sizeof(uint32_t);
+	const __m512i alpha_only_mask = _mm512_set1_epi32((int)0xFF000000);
+
+	__m512i avx_pxs1, avx_pxs2, avx_bytes_diff;				// Stores the data for 16 pixels each and the difference between them.
+	__mmask16 px_mask = 0xFFFF;						// Full vectors use every lane, the tail only the remaining ones.
+
+	size_t px_idx = 0;
+	if (is_aligned(dst, img1, img2, sizeof(__m512i))) {			// Every 64 byte load and store covers exactly one cache line.
+		for (; px_idx + 15 < num_pixels; px_idx += 16) {
+			avx_bytes_diff = avx512_bytes_diff(_mm512_load_si512(img1 + px_idx), _mm512_load_si512(img2 + px_idx), mode);
+			_mm512_store_si512(dst + px_idx, _mm512_or_si512(avx_bytes_diff, alpha_only_mask));
+		}
+	}
+	for (; px_idx < num_pixels; px_idx += 16) {
+		if (num_pixels - px_idx < 16) {					// Masked loads and stores finish the last up to 15 pixels, no scalar fallback.
+			px_mask = (__mmask16)((1u << (num_pixels - px_idx)) - 1u);
+		}
+		avx_pxs1 = _mm512_maskz_loadu_epi32(px_mask, img1 + px_idx);	// Load 16 pixels * 32bits/pixel = 512 bits.
+		avx_pxs2 = _mm512_maskz_loadu_epi32(px_mask, img2 + px_idx);
+		avx_bytes_diff = avx512_bytes_diff(avx_pxs1, avx_pxs2, mode);
+		_mm512_mask_storeu_epi32(dst + px_idx, px_mask, _mm512_or_si512(avx_bytes_diff, alpha_only_mask));
+	}
+}
+
+void diff_avx512(uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode)
+{
+	diff_avx512_out(img1, img1, img2, size, mode);
+}
 #endif
 
+/*
+Threaded drivers. The buffer is cut into bands of BAND_BYTES of output, a multiple of the cache line
+so no two threads write the same line, and the bands are spread over the pool. A NULL pool runs the
+bands in order on the calling thread. Results that have to be combined, statistics, counts and
+bounding boxes, are kept per band and merged afterwards, so the totals do not depend on the order
+the bands finish in.
+*/
+#define BAND_BYTES	(256u << 10)	// Output bytes per band, sized for a typical L2.
+#define BAND_PIXELS	(BAND_BYTES / sizeof(uint32_t))
+#define BBOX_RGB_MASK	0x00FFFFFFu
+
+typedef struct {
+	diff_out_fn_t diff_fn;
+	diff_stats_fn_t stats_fn;
+	diff_threshold_fn_t threshold_fn;
+	uint32_t *dst;
+	uint8_t *mask;
+	const uint32_t *img1;
+	const uint32_t *img2;
+	size_t num_pixels;
+	diff_mode_t mode;
+	const uint8_t *tolerance;
+	diff_stats_t *band_stats;	// One per band.
+	size_t *band_counts;
+} band_job_t;
+
+static size_t band_count(size_t num_pixels)
+{
+	return (num_pixels + BAND_PIXELS - 1) / BAND_PIXELS;
+}
+
+static size_t band_length(const band_job_t *job, size_t band)	// Pixels in the band, the last one may be short.
+{
+	size_t first = band * BAND_PIXELS;
+	return (job->num_pixels - first < BAND_PIXELS) ? job->num_pixels - first : BAND_PIXELS;
+}
+
+static void diff_band(void *arg, size_t band)
+{
+	const band_job_t *job = arg;
+	size_t offset = band * BAND_PIXELS;
+	job->diff_fn(job->dst + offset, job->img1 + offset, job->img2 + offset, band_length(job, band) * sizeof(uint32_t), job->mode);
+}
+
+void diff_parallel_out(thread_pool_t *pool, diff_out_fn_t diff_fn, uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode)
+{
+	band_job_t job = { .diff_fn = diff_image_out_fn(diff_fn, size), .dst = dst, .img1 = img1, .img2 = img2, .num_pixels = size / sizeof(uint32_t), .mode = mode };
+	thread_pool_parallel_for(pool, band_count(job.num_pixels), diff_band, &job);
+}
+
+static void stats_band(void *arg, size_t band)
+{
+	const band_job_t *job = arg;
+	size_t offset = band * BAND_PIXELS;
+	job->stats_fn(job->dst + offset, job->img1 + offset, job->img2 + offset, band_length(job, band) * sizeof(uint32_t), job->mode, &job->band_stats[band]);
+}
+
+int diff_stats_parallel_out(thread_pool_t *pool, diff_stats_fn_t stats_fn, uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode, diff_stats_t *stats)
+{
+	band_job_t job = { .stats_fn = stats_fn, .dst = dst, .img1 = img1, .img2 = img2, .num_pixels = size / sizeof(uint32_t), .mode = mode };
+	size_t num_bands = band_count(job.num_pixels);
+
+	job.band_stats = calloc(num_bands ? num_bands : 1, sizeof(diff_stats_t));
+	if (job.band_stats == NULL) {
+		fprintf(stderr, "Error(%s): Unable to allocate statistics for %zu bands.\n", __func__, num_bands);
+		return -1;
+	}
+	thread_pool_parallel_for(pool, num_bands, stats_band, &job);
+
+	size_t band;
+	for (band = 0; band < num_bands; ++band) {
+		diff_stats_merge(stats, &job.band_stats[band]);
+	}
+	free(job.band_stats);
+	return 0;
+}
+
+static void threshold_band(void *arg, size_t band)
+{
+	const band_job_t *job = arg;
+	size_t offset = band * BAND_PIXELS;
+	job->band_counts[band] = job->threshold_fn(job->mask + offset, job->img1 + offset, job->img2 + offset, band_length(job, band) * sizeof(uint32_t), job->tolerance);
+}
+
+int diff_threshold_parallel(thread_pool_t *pool, diff_threshold_fn_t threshold_fn, uint8_t *mask, const uint32_t *img1, const uint32_t *img2, size_t size, const uint8_t tolerance[3], size_t *over)
+{
+	band_job_t job = { .threshold_fn = threshold_fn, .mask = mask, .img1 = img1, .img2 = img2, .num_pixels = size / sizeof(uint32_t), .tolerance = tolerance };
+	size_t num_bands = band_count(job.num_pixels);
+
+	job.band_counts = calloc(num_bands ? num_bands : 1, sizeof(size_t));
+	if (job.band_counts == NULL) {
+		fprintf(stderr, "Error(%s): Unable to allocate counts for %zu bands.\n", __func__, num_bands);
+		return -1;
+	}
+	thread_pool_parallel_for(pool, num_bands, threshold_band, &job);
+
+	*over = 0;
+	size_t band;
+	for (band = 0; band < num_bands; ++band) {
+		*over += job.band_counts[band];
+	}
+	free(job.band_counts);
+	return 0;
+}
+
+/*
+The bounding box driver cuts whole rows instead, and scans each band's output for non-zero pixels
+while it is still in cache, so the bounding box of the changes costs no extra trip to memory. Rows
+only need scanning from the right until they reach the widest change seen so far in the band.
+*/
+typedef struct {
+	diff_out_fn_t diff_fn;
+	uint32_t *dst;
+	const uint32_t *img1;
+	const uint32_t *img2;
+	int width;
+	int height;
+	int band_rows;
+	diff_mode_t mode;
+	diff_bbox_t *band_boxes;	// Per band, in image coordinates.
+} bbox_job_t;
+
+static void bbox_band(void *arg, size_t band)
+{
+	const bbox_job_t *job = arg;
+	size_t row_pixels = (size_t)job->width;
+	int width = job->width;
+	int band_y = (int)band * job->band_rows;
+	int rows = (job->height - band_y < job->band_rows) ? job->height - band_y : job->band_rows;
+	size_t offset = (size_t)band_y * row_pixels;
+	job->diff_fn(job->dst + offset, job->img1 + offset, job->img2 + offset, (size_t)rows * row_pixels * sizeof(uint32_t), job->mode);
+
+	int x_min = width, x_max = -1, y_min = -1, y_max = -1;
+
+	int y;
+	for (y = band_y; y < band_y + rows; ++y) {
+		const uint32_t *row = job->dst + (size_t)y * row_pixels;
+
+		int first = 0;
+		while (first < width && !(row[first] & BBOX_RGB_MASK)) {
+			++first;
+		}
+		if (first == width) {		// Nothing changed in this row.
+			continue;
+		}
+
+		int last = width - 1;
+		while (last > x_max && last > first && !(row[last] & BBOX_RGB_MASK)) {
+			--last;
+		}
+
+		if (first < x_min) x_min = first;
+		if (last > x_max) x_max = last;
+		if (y_min < 0) y_min = y;
+		y_max = y;
+	}
+
+	diff_bbox_t *box = &job->band_boxes[band];
+	if (y_max < 0) {
+		box->x = box->y = box->width = box->height = 0;
+		return;
+	}
+	box->x = x_min;
+	box->y = y_min;
+	box->width = x_max - x_min + 1;
+	box->height = y_max - y_min + 1;
+}
+
+int diff_bbox_out(thread_pool_t *pool, diff_out_fn_t diff_fn, uint32_t *dst, const uint32_t *img1, const uint32_t *img2, int width, int height, diff_mode_t mode, diff_bbox_t *bbox)
+{
+	bbox_job_t job = { .diff_fn = diff_image_out_fn(diff_fn, (size_t)width * (size_t)height * sizeof(uint32_t)), .dst = dst, .img1 = img1, .img2 = img2, .width = width, .height = height, .mode = mode };
+	job.band_rows = (int)(BAND_BYTES / ((size_t)width * sizeof(uint32_t)));
+	if (job.band_rows < 1) {
+		job.band_rows = 1;
+	}
+	size_t num_bands = (size_t)((height + job.band_rows - 1) / job.band_rows);
+
+	job.band_boxes = calloc(num_bands ? num_bands : 1, sizeof(diff_bbox_t));
+	if (job.band_boxes == NULL) {
+		fprintf(stderr, "Error(%s): Unable to allocate bounding boxes for %zu bands.\n", __func__, num_bands);
+		return -1;
+	}
+	thread_pool_parallel_for(pool, num_bands, bbox_band, &job);
+
+	int x_min = width, x_max = -1, y_min = height, y_max = -1;
+	size_t band;
+	for (band = 0; band < num_bands; ++band) {
+		const diff_bbox_t *box = &job.band_boxes[band];
+		if (box->width == 0) {
+			continue;
+		}
+		if (box->x < x_min) x_min = box->x;
+		if (box->x + box->width - 1 > x_max) x_max = box->x + box->width - 1;
+		if (box->y < y_min) y_min = box->y;
+		y_max = box->y + box->height - 1;
+	}
+	free(job.band_boxes);
+
+	if (y_max < 0) {
+		bbox->x = bbox->y = bbox->width = bbox->height = 0;
+		return 0;
+	}
+	bbox->x = x_min;
+	bbox->y = y_min;
+	bbox->width = x_max - x_min + 1;
+	bbox->height = y_max - y_min + 1;
+	return 0;
+}
+
+/*
+Runtime kernel dispatch. Kernels are compiled whenever the toolchain can emit them, and the
+processor is queried (cpuid on x86) before one is chosen, so a single static binary runs the
+widest kernel available on whichever machine it lands on.
+*/
+
+static const char *const kernel_names[] = {
+	[KERNEL_AUTO]	= "auto",
+	[KERNEL_SCALAR]	= "scalar",
+	[KERNEL_SWAR]	= "swar",
+	[KERNEL_SSE2]	= "sse2",
+	[KERNEL_AVX2]	= "avx2",
+	[KERNEL_AVX512]	= "avx512",
+	[KERNEL_NEON]	= "neon",
+	[KERNEL_NEON_X4]	= "neon_x4",
+	[KERNEL_SVE]	= "sve",
+};
+
+int diff_kernel_supported(diff_kernel_t kernel)
+{
+	switch (kernel) {
+		case KERNEL_AUTO:
+		case KERNEL_SCALAR:
+		case KERNEL_SWAR:
+			return 1;
+#ifdef PIX_DIFF_X86
+		case KERNEL_SSE2:
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("sse2");
+		case KERNEL_AVX2:
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("avx2");
+		case KERNEL_AVX512:
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+#ifdef __ARM_NEON
+		case KERNEL_NEON:
+			return 1;
+#endif
+#ifdef PIX_DIFF_NEON_X4
+		case KERNEL_NEON_X4:
+			return 1;
+#endif
+#ifdef PIX_DIFF_SVE
+		case KERNEL_SVE:
+			return (getauxval(AT_HWCAP) & HWCAP_SVE) != 0;
+#endif
+		default:
+			return 0;
+	}
+}
+
+diff_kernel_t diff_best_kernel(void)
+{
+	static const diff_kernel_t preference[] = { KERNEL_AVX512, KERNEL_AVX2, KERNEL_SSE2, KERNEL_SVE, KERNEL_NEON_X4, KERNEL_NEON };	// Widest first.
+
+	size_t idx;
+	for (idx = 0; idx < sizeof(preference) / sizeof(preference[0]); ++idx) {
+		if (diff_kernel_supported(preference[idx])) {
+			return preference[idx];
+		}
+	}
+	return KERNEL_SWAR;		// Portable fallback when no vector kernel is available.
+}
+
+diff_fn_t diff_kernel_fn(diff_kernel_t kernel)
+{
+	if (kernel == KERNEL_AUTO) {
+		kernel = diff_best_kernel();
+	}
+	if (!diff_kernel_supported(kernel)) {
+		return NULL;
+	}
+
+	switch (kernel) {
+#ifdef PIX_DIFF_X86
+		case KERNEL_SSE2:
+			return diff_sse2;
+		case KERNEL_AVX2:
+			return diff_avx2;
+		case KERNEL_AVX512:
+			return diff_avx512;
+#endif
+#ifdef __ARM_NEON
+		case KERNEL_NEON:
+			return diff_neon;
+#endif
+#ifdef PIX_DIFF_NEON_X4
+		case KERNEL_NEON_X4:
+			return diff_neon_x4;
+#endif
+#ifdef PIX_DIFF_SVE
+		case KERNEL_SVE:
+			return diff_sve;
+#endif
+		case KERNEL_SWAR:
+			return diff_swar;
+		case KERNEL_SCALAR:
+		default:
+			return diff_scalar;
+	}
+}
+
+diff_out_fn_t diff_kernel_out_fn(diff_kernel_t kernel)
+{
+	if (kernel == KERNEL_AUTO) {
+		kernel = diff_best_kernel();
+	}
+	if (!diff_kernel_supported(kernel)) {
+		return NULL;
+	}
+
+	switch (kernel) {
+#ifdef PIX_DIFF_X86
+		case KERNEL_SSE2:
+			return diff_sse2_out;
+		case KERNEL_AVX2:
+			return diff_avx2_out;
+		case KERNEL_AVX512:
+			return diff_avx512_out;
+#endif
+#ifdef __ARM_NEON
+		case KERNEL_NEON:
+			return diff_neon_out;
+#endif
+#ifdef PIX_DIFF_NEON_X4
+		case KERNEL_NEON_X4:
+			return diff_neon_x4_out;
+#endif
+#ifdef PIX_DIFF_SVE
+		case KERNEL_SVE:
+			return diff_sve_out;
+#endif
+		case KERNEL_SWAR:
+			return diff_swar_out;
+		case KERNEL_SCALAR:
+		default:
+			return diff_scalar_out;
+	}
+}
+
+diff_out_fn_t diff_image_out_fn(diff_out_fn_t diff_fn, size_t image_size)
+{
+#ifdef PIX_DIFF_NEON_X4
+	if (diff_fn == diff_neon_x4_out && image_size * 2 > last_level_cache_bytes()) {	// Both inputs together no longer fit in the last level cache.
+		return diff_neon_x4_nt_out;
+	}
+#endif
+	(void)image_size;
+	return diff_fn;
+}
+
+const char *diff_kernel_name(diff_kernel_t kernel)
+{
+	if ((size_t)kernel >= sizeof(kernel_names) / sizeof(kernel_names[0]) || !kernel_names[kernel]) {
+		return "unknown";
+	}
+	return kernel_names[kernel];
+}
+
+int diff_kernel_parse(const char *name, diff_kernel_t *kernel)
+{
+	if (strcmp(name, "disable_neon") == 0) {	// Kept from when NEON was the only vector kernel.
+		*kernel = KERNEL_SCALAR;
+		return 0;
+	}
+
+	size_t idx;
+	for (idx = 0; idx < sizeof(kernel_names) / sizeof(kernel_names[0]); ++idx) {
+		if (kernel_names[idx] && strcmp(name, kernel_names[idx]) == 0) {
+			*kernel = (diff_kernel_t)idx;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int diff_mode_parse(const char *arg, diff_mode_t *mode)
+{
+	if ((strcmp(arg, "saturated") == 0)||(strcmp(arg, "sat") == 0)) {
+		*mode = SAT;
+	} else if ((strcmp(arg, "modular") == 0)||(strcmp(arg, "mod") == 0)) {
+		*mode = MOD;
+	} else if ((strcmp(arg, "absolute") == 0)||(strcmp(arg, "abs") == 0)) {
+		*mode = ABS;
+	} else {
+		return -1;
+	}
+	return 0;
+}
@@ -3,15 +3,134 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "thread_pool.h"
 
 typedef enum { ABS, SAT, MOD } diff_mode_t;
 
+typedef enum {			// Differencing kernels, ordered from narrowest to widest within each architecture.
+	KERNEL_AUTO,		// Resolves to the widest kernel the running processor supports.
+	KERNEL_SCALAR,
+	KERNEL_SWAR,
+	KERNEL_SSE2,
+	KERNEL_AVX2,
+	KERNEL_AVX512,
+	KERNEL_NEON,
+	KERNEL_NEON_X4,
+	KERNEL_SVE,
+} diff_kernel_t;
+
+/*
+Every kernel comes in two forms. diff_<kernel>() works in place and overwrites img1, which saves a
+buffer for single comparisons. diff_<kernel>_out() writes to dst and leaves both inputs intact, so a
+decoded reference can be compared against many candidates. dst may be img1, but must not otherwise
+overlap either input.
+*/
+typedef void (*diff_fn_t)(uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode);
+typedef void (*diff_out_fn_t)(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode);
+
+typedef struct {			// Filled in by the fused diff_stats_*() kernels in the same pass as the difference.
+	uint64_t changed_pixels;	// Pixels with a non-zero difference in any color channel.
+	uint64_t channel_sum[3];	// Sum of the difference per channel, R G B.
+	uint8_t channel_max[3];		// Largest difference per channel, R G B.
+} diff_stats_t;
+
+typedef void (*diff_stats_fn_t)(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode, diff_stats_t *stats);
+
+typedef struct {		// Smallest rectangle holding every pixel with a non-zero difference, empty when width is 0.
+	int x;
+	int y;
+	int width;
+	int height;
+} diff_bbox_t;
+
+typedef size_t (*diff_compare_fn_t)(const uint32_t *img1, const uint32_t *img2, size_t size);	// Index of the first differing pixel.
+
+typedef size_t (*diff_threshold_fn_t)(uint8_t *mask, const uint32_t *img1, const uint32_t *img2, size_t size, const uint8_t tolerance[3]);	// Count of pixels over tolerance.
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PIX_DIFF_X86	1	// x86 kernels are compiled with per-function target attributes and selected at runtime.
+#endif
+
 uint32_t calculate_pixel_difference(uint32_t pix1, uint32_t pix2, diff_mode_t mode);
 void diff_scalar(uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode);
+void diff_scalar_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode);
+void diff_swar(uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode);
+void diff_swar_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode);
 
 #ifdef __ARM_NEON
 void diff_neon(uint32_t *img1, const uint32_t *img2, size_t sizes, diff_mode_t mode);
+void diff_neon_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode);
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#define PIX_DIFF_NEON_X4	1	// Needs the AArch64 multi-register loads/stores and STNP.
+void diff_neon_x4(uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode);
+void diff_neon_x4_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode);
+void diff_neon_x4_nt_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode);	// Non-temporal stores, for images larger than the last level cache.
+#endif
+
+#ifdef PIX_DIFF_SVE		// Set by the Makefile when pix_diff_sve.c is built with SVE enabled.
+void diff_sve(uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode);
+void diff_sve_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode);
+#endif
+
+#ifdef PIX_DIFF_X86
+void diff_sse2(uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode);
+void diff_sse2_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode);
+void diff_avx2(uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode);
+void diff_avx2_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode);
+void diff_avx512(uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode);
+void diff_avx512_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode);
+#endif
+
+void diff_stats_merge(diff_stats_t *stats, const diff_stats_t *partial);
+void diff_stats_scalar_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode, diff_stats_t *stats);
+#ifdef __ARM_NEON
+void diff_stats_neon_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode, diff_stats_t *stats);
+#endif
+#ifdef PIX_DIFF_X86
+void diff_stats_sse2_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode, diff_stats_t *stats);
+void diff_stats_avx2_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode, diff_stats_t *stats);
+#endif
+
+size_t diff_compare_scalar(const uint32_t *img1, const uint32_t *img2, size_t size);
+#ifdef __ARM_NEON
+size_t diff_compare_neon(const uint32_t *img1, const uint32_t *img2, size_t size);
+#endif
+#ifdef PIX_DIFF_X86
+size_t diff_compare_sse2(const uint32_t *img1, const uint32_t *img2, size_t size);
+size_t diff_compare_avx2(const uint32_t *img1, const uint32_t *img2, size_t size);
+size_t diff_compare_avx512(const uint32_t *img1, const uint32_t *img2, size_t size);
 #endif
 
+size_t diff_threshold_scalar(uint8_t *mask, const uint32_t *img1, const uint32_t *img2, size_t size, const uint8_t tolerance[3]);
+#ifdef __ARM_NEON
+size_t diff_threshold_neon(uint8_t *mask, const uint32_t *img1, const uint32_t *img2, size_t size, const uint8_t tolerance[3]);
+#endif
+#ifdef PIX_DIFF_X86
+size_t diff_threshold_sse2(uint8_t *mask, const uint32_t *img1, const uint32_t *img2, size_t size, const uint8_t tolerance[3]);
+size_t diff_threshold_avx2(uint8_t *mask, const uint32_t *img1, const uint32_t *img2, size_t size, const uint8_t tolerance[3]);
 #endif
 
+/*
+Threaded drivers, splitting the work into bands across pool. pool may be NULL to run on the calling
+thread. The kernel pointers come from the diff_kernel_*_fn() functions below.
+*/
+void diff_parallel_out(thread_pool_t *pool, diff_out_fn_t diff_fn, uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode);
+int diff_stats_parallel_out(thread_pool_t *pool, diff_stats_fn_t stats_fn, uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode, diff_stats_t *stats);
+int diff_threshold_parallel(thread_pool_t *pool, diff_threshold_fn_t threshold_fn, uint8_t *mask, const uint32_t *img1, const uint32_t *img2, size_t size, const uint8_t tolerance[3], size_t *over);
+int diff_bbox_out(thread_pool_t *pool, diff_out_fn_t diff_fn, uint32_t *dst, const uint32_t *img1, const uint32_t *img2, int width, int height, diff_mode_t mode, diff_bbox_t *bbox);
+
+diff_kernel_t diff_best_kernel(void);
+int diff_kernel_supported(diff_kernel_t kernel);
+diff_fn_t diff_kernel_fn(diff_kernel_t kernel);
+diff_out_fn_t diff_kernel_out_fn(diff_kernel_t kernel);
+diff_out_fn_t diff_image_out_fn(diff_out_fn_t diff_fn, size_t image_size);	// The variant of diff_fn for a whole image of image_size bytes, however it is split into bands.
+diff_stats_fn_t diff_kernel_stats_fn(diff_kernel_t kernel);
+diff_compare_fn_t diff_kernel_compare_fn(diff_kernel_t kernel);
+diff_threshold_fn_t diff_kernel_threshold_fn(diff_kernel_t kernel);
+const char *diff_kernel_name(diff_kernel_t kernel);
+int diff_kernel_parse(const char *name, diff_kernel_t *kernel);
+int diff_mode_parse(const char *arg, diff_mode_t *mode);
+
+#endif
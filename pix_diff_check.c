@@ -0,0 +1,150 @@
+#include "pix_diff.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#ifdef PIX_DIFF_X86
+#include <immintrin.h>
+#endif
+
+/*
+Equality check kernels. They return the index of the first pixel whose color channels differ, or
+the number of pixels when the images match, and stop reading at the first difference. Alpha is
+ignored, consistent with the difference modes which force it to 0xFF. The vector kernels test a
+block of pixels with a single branch and only rescan that block to find the exact pixel.
+*/
+
+#define RGB_MASK	0x00FFFFFFu
+
+size_t diff_compare_scalar(const uint32_t *img1, const uint32_t *img2, size_t size)
+{
+	size_t num_pixels = size / sizeof(uint32_t);
+
+	size_t px_idx;
+	for (px_idx = 0; px_idx < num_pixels; ++px_idx) {
+		if ((img1[px_idx] ^ img2[px_idx]) & RGB_MASK) {
+			break;
+		}
+	}
+	return px_idx;
+}
+
+#ifdef __ARM_NEON
+size_t diff_compare_neon(const uint32_t *img1, const uint32_t *img2, size_t size)
+{
+	size_t num_pixels = size / sizeof(uint32_t);
+	const uint32x4_t rgb_mask = vdupq_n_u32(RGB_MASK);
+
+	size_t px_idx;
+	for (px_idx = 0; px_idx + 15 < num_pixels; px_idx += 16) {	// 16 pixels per branch.
+		uint32x4_t neon_diff = vandq_u32(veorq_u32(vld1q_u32(img1 + px_idx), vld1q_u32(img2 + px_idx)), rgb_mask);
+		neon_diff = vorrq_u32(neon_diff, vandq_u32(veorq_u32(vld1q_u32(img1 + px_idx + 4), vld1q_u32(img2 + px_idx + 4)), rgb_mask));
+		neon_diff = vorrq_u32(neon_diff, vandq_u32(veorq_u32(vld1q_u32(img1 + px_idx + 8), vld1q_u32(img2 + px_idx + 8)), rgb_mask));
+		neon_diff = vorrq_u32(neon_diff, vandq_u32(veorq_u32(vld1q_u32(img1 + px_idx + 12), vld1q_u32(img2 + px_idx + 12)), rgb_mask));
+
+		uint64x2_t neon_any = vreinterpretq_u64_u32(neon_diff);
+		if (vgetq_lane_u64(neon_any, 0) | vgetq_lane_u64(neon_any, 1)) {
+			break;
+		}
+	}
+	return px_idx + diff_compare_scalar(img1 + px_idx, img2 + px_idx, (num_pixels - px_idx) * sizeof(uint32_t));	// Locates the pixel, or checks the last up to 15.
+}
+#endif
+
+#ifdef PIX_DIFF_X86
+__attribute__((target("sse2")))
+size_t diff_compare_sse2(const uint32_t *img1, const uint32_t *img2, size_t size)
+{
+	size_t num_pixels = size / sizeof(uint32_t);
+	const __m128i rgb_mask = _mm_set1_epi32((int)RGB_MASK);
+	const __m128i zero = _mm_setzero_si128();
+
+	size_t px_idx;
+	for (px_idx = 0; px_idx + 15 < num_pixels; px_idx += 16) {	// 16 pixels per branch.
+		__m128i sse_diff = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(img1 + px_idx)), _mm_loadu_si128((const __m128i *)(img2 + px_idx)));
+		sse_diff = _mm_or_si128(sse_diff, _mm_xor_si128(_mm_loadu_si128((const __m128i *)(img1 + px_idx + 4)), _mm_loadu_si128((const __m128i *)(img2 + px_idx + 4))));
+		sse_diff = _mm_or_si128(sse_diff, _mm_xor_si128(_mm_loadu_si128((const __m128i *)(img1 + px_idx + 8)), _mm_loadu_si128((const __m128i *)(img2 + px_idx + 8))));
+		sse_diff = _mm_or_si128(sse_diff, _mm_xor_si128(_mm_loadu_si128((const __m128i *)(img1 + px_idx + 12)), _mm_loadu_si128((const __m128i *)(img2 + px_idx + 12))));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(sse_diff, rgb_mask), zero)) != 0xFFFF) {
+			break;
+		}
+	}
+	return px_idx + diff_compare_scalar(img1 + px_idx, img2 + px_idx, (num_pixels - px_idx) * sizeof(uint32_t));
+}
+
+__attribute__((target("avx2")))
+size_t diff_compare_avx2(const uint32_t *img1, const uint32_t *img2, size_t size)
+{
+	size_t num_pixels = size / sizeof(uint32_t);
+	const __m256i rgb_mask = _mm256_set1_epi32((int)RGB_MASK);
+
+	size_t px_idx;
+	for (px_idx = 0; px_idx + 31 < num_pixels; px_idx += 32) {	// 32 pixels per branch.
+		__m256i avx_diff = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(img1 + px_idx)), _mm256_loadu_si256((const __m256i *)(img2 + px_idx)));
+		avx_diff = _mm256_or_si256(avx_diff, _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(img1 + px_idx + 8)), _mm256_loadu_si256((const __m256i *)(img2 + px_idx + 8))));
+		avx_diff = _mm256_or_si256(avx_diff, _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(img1 + px_idx + 16)), _mm256_loadu_si256((const __m256i *)(img2 + px_idx + 16))));
+		avx_diff = _mm256_or_si256(avx_diff, _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(img1 + px_idx + 24)), _mm256_loadu_si256((const __m256i *)(img2 + px_idx + 24))));
+
+		if (!_mm256_testz_si256(avx_diff, rgb_mask)) {		// Any color bit set in the combined XOR.
+			break;
+		}
+	}
+	return px_idx + diff_compare_scalar(img1 + px_idx, img2 + px_idx, (num_pixels - px_idx) * sizeof(uint32_t));
+}
+
+__attribute__((target("avx512f")))
+size_t diff_compare_avx512(const uint32_t *img1, const uint32_t *img2, size_t size)
+{
+	size_t num_pixels = size / sizeof(uint32_t);
+	const __m512i rgb_mask = _mm512_set1_epi32((int)RGB_MASK);
+	__mmask16 px_mask = 0xFFFF;
+
+	size_t px_idx;
+	for (px_idx = 0; px_idx < num_pixels; px_idx += 16) {
+		if (num_pixels - px_idx < 16) {				// Masked tail, as in diff_avx512().
+			px_mask = (__mmask16)((1u << (num_pixels - px_idx)) - 1u);
+		}
+		__m512i avx_diff = _mm512_xor_si512(_mm512_maskz_loadu_epi32(px_mask, img1 + px_idx), _mm512_maskz_loadu_epi32(px_mask, img2 + px_idx));
+		__mmask16 differing = _mm512_test_epi32_mask(avx_diff, rgb_mask);	// One bit per pixel, so the index comes straight from the mask.
+		if (differing) {
+			return px_idx + (size_t)__builtin_ctz(differing);
+		}
+	}
+	return num_pixels;
+}
+#endif
+
+diff_compare_fn_t diff_kernel_compare_fn(diff_kernel_t kernel)	// Kernels without a compare variant use the closest narrower one.
+{
+	if (kernel == KERNEL_AUTO) {
+		kernel = diff_best_kernel();
+	}
+	if (!diff_kernel_supported(kernel)) {
+		return NULL;
+	}
+
+	switch (kernel) {
+#ifdef PIX_DIFF_X86
+		case KERNEL_SSE2:
+			return diff_compare_sse2;
+		case KERNEL_AVX2:
+			return diff_compare_avx2;
+		case KERNEL_AVX512:
+			return diff_compare_avx512;
+#endif
+#ifdef __ARM_NEON
+		case KERNEL_NEON:
+		case KERNEL_NEON_X4:
+		case KERNEL_SVE:
+			return diff_compare_neon;
+#endif
+		case KERNEL_SWAR:
+		case KERNEL_SCALAR:
+		default:
+			return diff_compare_scalar;
+	}
+}
@@ -0,0 +1,304 @@
+#include "pix_diff.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#ifdef PIX_DIFF_X86
+#include <immintrin.h>
+#endif
+
+/*
+Fused difference and statistics kernels. They write the same output as the plain kernels and, in
+the same pass, count the changed pixels and accumulate the per-channel maximum and sum of the
+difference, so the numbers never need a second read of the output. Results are added to *stats,
+which lets callers merge several partial runs; start from a zeroed diff_stats_t.
+*/
+
+void diff_stats_merge(diff_stats_t *stats, const diff_stats_t *partial)
+{
+	stats->changed_pixels += partial->changed_pixels;
+
+	int channel;
+	for (channel = 0; channel < 3; ++channel) {
+		stats->channel_sum[channel] += partial->channel_sum[channel];
+		if (partial->channel_max[channel] > stats->channel_max[channel]) {
+			stats->channel_max[channel] = partial->channel_max[channel];
+		}
+	}
+}
+
+void diff_stats_scalar_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode, diff_stats_t *stats)
+{
+	size_t num_pixels = size / sizeof(uint32_t);
+	diff_stats_t local = { 0 };
+
+	size_t px_idx;
+	for (px_idx = 0; px_idx < num_pixels; ++px_idx) {
+		uint32_t pixout = calculate_pixel_difference(img1[px_idx], img2[px_idx], mode);
+		dst[px_idx] = pixout;
+
+		if ((pixout & 0x00FFFFFF) == 0) {	// Alpha is always forced to 0xFF, so only the color channels count.
+			continue;
+		}
+		local.changed_pixels++;
+
+		int channel;
+		for (channel = 0; channel < 3; ++channel) {
+			uint8_t channel_diff = (uint8_t)(pixout >> (channel * 8));
+			local.channel_sum[channel] += channel_diff;
+			if (channel_diff > local.channel_max[channel]) {
+				local.channel_max[channel] = channel_diff;
+			}
+		}
+	}
+
+	diff_stats_merge(stats, &local);
+}
+
+#ifdef __ARM_NEON
+#define NEON_STATS_BLOCK	(1u << 16)	// Iterations between flushes of the 32-bit sums, 65536 * 4 * 255 fits in a lane.
+
+void diff_stats_neon_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode, diff_stats_t *stats)
+{
+	size_t num_pixels = size / sizeof(uint32_t);
+	const uint8x16_t alpha_channel = vdupq_n_u8(0xFF);
+	const uint8x16_t zero = vdupq_n_u8(0);
+
+	uint8x16x4_t neon_pxs1, neon_pxs2, neon_result;		// vld4q_u8 splits 16 pixels into one register per channel.
+	uint8x16_t neon_max[3] = { zero, zero, zero };
+	uint64x2_t neon_sum64[3] = { vdupq_n_u64(0), vdupq_n_u64(0), vdupq_n_u64(0) };
+	uint64x2_t neon_unchanged64 = vdupq_n_u64(0);
+	diff_stats_t local = { 0 };
+
+	size_t px_idx = 0;
+	while (px_idx + 15 < num_pixels) {
+		uint32x4_t neon_sum32[3] = { vdupq_n_u32(0), vdupq_n_u32(0), vdupq_n_u32(0) };
+		uint32x4_t neon_unchanged32 = vdupq_n_u32(0);
+
+		size_t block_idx;
+		for (block_idx = 0; block_idx < NEON_STATS_BLOCK && px_idx + 15 < num_pixels; ++block_idx, px_idx += 16) {
+			neon_pxs1 = vld4q_u8((const uint8_t *)(img1 + px_idx));
+			neon_pxs2 = vld4q_u8((const uint8_t *)(img2 + px_idx));
+
+			int channel;
+			for (channel = 0; channel < 3; ++channel) {
+				switch (mode) {
+					case ABS:
+						neon_result.val[channel] = vabdq_u8(neon_pxs1.val[channel], neon_pxs2.val[channel]);
+						break;
+					case SAT:
+						neon_result.val[channel] = vqsubq_u8(neon_pxs1.val[channel], neon_pxs2.val[channel]);
+						break;
+					case MOD:
+					default:
+						neon_result.val[channel] = vsubq_u8(neon_pxs1.val[channel], neon_pxs2.val[channel]);
+						break;
+				}
+				neon_max[channel] = vmaxq_u8(neon_max[channel], neon_result.val[channel]);
+				neon_sum32[channel] = vpadalq_u16(neon_sum32[channel], vpaddlq_u8(neon_result.val[channel]));	// Widen 8 -> 16 -> 32 bits.
+			}
+			neon_result.val[3] = alpha_channel;
+			vst4q_u8((uint8_t *)(dst + px_idx), neon_result);	// Interleave back into RGBA with full opacity.
+
+			uint8x16_t neon_any = vorrq_u8(neon_result.val[0], vorrq_u8(neon_result.val[1], neon_result.val[2]));
+			uint8x16_t neon_unchanged = vshrq_n_u8(vceqq_u8(neon_any, zero), 7);	// 1 for every pixel with no difference.
+			neon_unchanged32 = vpadalq_u16(neon_unchanged32, vpaddlq_u8(neon_unchanged));
+		}
+
+		int channel;
+		for (channel = 0; channel < 3; ++channel) {
+			neon_sum64[channel] = vpadalq_u32(neon_sum64[channel], neon_sum32[channel]);
+		}
+		neon_unchanged64 = vpadalq_u32(neon_unchanged64, neon_unchanged32);
+	}
+
+	uint64_t unchanged = vgetq_lane_u64(neon_unchanged64, 0) + vgetq_lane_u64(neon_unchanged64, 1);
+	local.changed_pixels = px_idx - unchanged;
+
+	int channel;
+	for (channel = 0; channel < 3; ++channel) {
+		uint8_t lanes[16];
+		vst1q_u8(lanes, neon_max[channel]);
+		int lane;
+		for (lane = 0; lane < 16; ++lane) {
+			if (lanes[lane] > local.channel_max[channel]) {
+				local.channel_max[channel] = lanes[lane];
+			}
+		}
+		local.channel_sum[channel] = vgetq_lane_u64(neon_sum64[channel], 0) + vgetq_lane_u64(neon_sum64[channel], 1);
+	}
+
+	diff_stats_merge(stats, &local);
+	diff_stats_scalar_out(dst + px_idx, img1 + px_idx, img2 + px_idx, (num_pixels - px_idx) * sizeof(uint32_t), mode, stats);	// The last up to 15 pixels.
+}
+#endif
+
+#ifdef PIX_DIFF_X86
+/*
+The x86 kernels keep each channel's sum in 64-bit lanes by masking one channel at a time and
+summing it with a sum of absolute differences against zero (psadbw), the unsigned max of every
+byte is tracked in one register, and unchanged pixels come from a 32-bit compare with zero.
+*/
+static void stats_reduce_max(const uint8_t *max_bytes, size_t num_bytes, diff_stats_t *local)
+{
+	size_t byte_idx;
+	for (byte_idx = 0; byte_idx < num_bytes; ++byte_idx) {
+		size_t channel = byte_idx % sizeof(uint32_t);
+		if (channel < 3 && max_bytes[byte_idx] > local->channel_max[channel]) {
+			local->channel_max[channel] = max_bytes[byte_idx];
+		}
+	}
+}
+
+__attribute__((target("sse2")))
+void diff_stats_sse2_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode, diff_stats_t *stats)
+{
+	size_t num_pixels = size / sizeof(uint32_t);
+	const __m128i alpha_only_mask = _mm_set1_epi32((int)0xFF000000);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i channel_mask[3] = { _mm_set1_epi32(0x000000FF), _mm_set1_epi32(0x0000FF00), _mm_set1_epi32(0x00FF0000) };
+
+	__m128i sse_pxs1, sse_pxs2, sse_bytes_diff;
+	__m128i sse_max = zero;
+	__m128i sse_sum[3] = { zero, zero, zero };
+	diff_stats_t local = { 0 };
+	uint64_t unchanged = 0;
+
+	size_t px_idx;
+	for (px_idx = 0; px_idx + 3 < num_pixels; px_idx += 4) {
+		sse_pxs1 = _mm_loadu_si128((const __m128i *)(img1 + px_idx));
+		sse_pxs2 = _mm_loadu_si128((const __m128i *)(img2 + px_idx));
+
+		switch (mode) {
+			case ABS:
+				sse_bytes_diff = _mm_or_si128(_mm_subs_epu8(sse_pxs1, sse_pxs2), _mm_subs_epu8(sse_pxs2, sse_pxs1));
+				break;
+			case SAT:
+				sse_bytes_diff = _mm_subs_epu8(sse_pxs1, sse_pxs2);
+				break;
+			case MOD:
+			default:
+				sse_bytes_diff = _mm_sub_epi8(sse_pxs1, sse_pxs2);
+				break;
+		}
+		sse_bytes_diff = _mm_andnot_si128(alpha_only_mask, sse_bytes_diff);	// Drop alpha before it reaches the statistics.
+
+		int channel;
+		for (channel = 0; channel < 3; ++channel) {
+			sse_sum[channel] = _mm_add_epi64(sse_sum[channel], _mm_sad_epu8(_mm_and_si128(sse_bytes_diff, channel_mask[channel]), zero));
+		}
+		sse_max = _mm_max_epu8(sse_max, sse_bytes_diff);
+		unchanged += (uint64_t)__builtin_popcount((unsigned)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(sse_bytes_diff, zero))));
+
+		_mm_storeu_si128((__m128i *)(dst + px_idx), _mm_or_si128(sse_bytes_diff, alpha_only_mask));
+	}
+
+	local.changed_pixels = px_idx - unchanged;
+
+	uint64_t sum_lanes[2];
+	int channel;
+	for (channel = 0; channel < 3; ++channel) {
+		_mm_storeu_si128((__m128i *)sum_lanes, sse_sum[channel]);
+		local.channel_sum[channel] = sum_lanes[0] + sum_lanes[1];
+	}
+	uint8_t max_bytes[16];
+	_mm_storeu_si128((__m128i *)max_bytes, sse_max);
+	stats_reduce_max(max_bytes, sizeof(max_bytes), &local);
+
+	diff_stats_merge(stats, &local);
+	diff_stats_scalar_out(dst + px_idx, img1 + px_idx, img2 + px_idx, (num_pixels - px_idx) * sizeof(uint32_t), mode, stats);	// The last up to 3 pixels.
+}
+
+__attribute__((target("avx2")))
+void diff_stats_avx2_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode, diff_stats_t *stats)
+{
+	size_t num_pixels = size / sizeof(uint32_t);
+	const __m256i alpha_only_mask = _mm256_set1_epi32((int)0xFF000000);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i channel_mask[3] = { _mm256_set1_epi32(0x000000FF), _mm256_set1_epi32(0x0000FF00), _mm256_set1_epi32(0x00FF0000) };
+
+	__m256i avx_pxs1, avx_pxs2, avx_bytes_diff;
+	__m256i avx_max = zero;
+	__m256i avx_sum[3] = { zero, zero, zero };
+	diff_stats_t local = { 0 };
+	uint64_t unchanged = 0;
+
+	size_t px_idx;
+	for (px_idx = 0; px_idx + 7 < num_pixels; px_idx += 8) {
+		avx_pxs1 = _mm256_loadu_si256((const __m256i *)(img1 + px_idx));
+		avx_pxs2 = _mm256_loadu_si256((const __m256i *)(img2 + px_idx));
+
+		switch (mode) {
+			case ABS:
+				avx_bytes_diff = _mm256_or_si256(_mm256_subs_epu8(avx_pxs1, avx_pxs2), _mm256_subs_epu8(avx_pxs2, avx_pxs1));
+				break;
+			case SAT:
+				avx_bytes_diff = _mm256_subs_epu8(avx_pxs1, avx_pxs2);
+				break;
+			case MOD:
+			default:
+				avx_bytes_diff = _mm256_sub_epi8(avx_pxs1, avx_pxs2);
+				break;
+		}
+		avx_bytes_diff = _mm256_andnot_si256(alpha_only_mask, avx_bytes_diff);
+
+		int channel;
+		for (channel = 0; channel < 3; ++channel) {
+			avx_sum[channel] = _mm256_add_epi64(avx_sum[channel], _mm256_sad_epu8(_mm256_and_si256(avx_bytes_diff, channel_mask[channel]), zero));
+		}
+		avx_max = _mm256_max_epu8(avx_max, avx_bytes_diff);
+		unchanged += (uint64_t)__builtin_popcount((unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(avx_bytes_diff, zero))));
+
+		_mm256_storeu_si256((__m256i *)(dst + px_idx), _mm256_or_si256(avx_bytes_diff, alpha_only_mask));
+	}
+
+	local.changed_pixels = px_idx - unchanged;
+
+	uint64_t sum_lanes[4];
+	int channel;
+	for (channel = 0; channel < 3; ++channel) {
+		_mm256_storeu_si256((__m256i *)sum_lanes, avx_sum[channel]);
+		local.channel_sum[channel] = sum_lanes[0] + sum_lanes[1] + sum_lanes[2] + sum_lanes[3];
+	}
+	uint8_t max_bytes[32];
+	_mm256_storeu_si256((__m256i *)max_bytes, avx_max);
+	stats_reduce_max(max_bytes, sizeof(max_bytes), &local);
+
+	diff_stats_merge(stats, &local);
+	diff_stats_scalar_out(dst + px_idx, img1 + px_idx, img2 + px_idx, (num_pixels - px_idx) * sizeof(uint32_t), mode, stats);	// The last up to 7 pixels.
+}
+#endif
+
+diff_stats_fn_t diff_kernel_stats_fn(diff_kernel_t kernel)	// Kernels without a stats variant use the closest narrower one.
+{
+	if (kernel == KERNEL_AUTO) {
+		kernel = diff_best_kernel();
+	}
+	if (!diff_kernel_supported(kernel)) {
+		return NULL;
+	}
+
+	switch (kernel) {
+#ifdef PIX_DIFF_X86
+		case KERNEL_SSE2:
+			return diff_stats_sse2_out;
+		case KERNEL_AVX2:
+		case KERNEL_AVX512:
+			return diff_stats_avx2_out;
+#endif
+#ifdef __ARM_NEON
+		case KERNEL_NEON:
+		case KERNEL_NEON_X4:
+		case KERNEL_SVE:
+			return diff_stats_neon_out;
+#endif
+		case KERNEL_SWAR:
+		case KERNEL_SCALAR:
+		default:
+			return diff_stats_scalar_out;
+	}
+}
@@ -0,0 +1,54 @@
+#include "pix_diff.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Built as its own translation unit with SVE enabled, while the rest of the program keeps the
+baseline target flags. Nothing here runs unless diff_kernel_supported() found SVE in AT_HWCAP,
+so the same binary still runs on cores without it (e.g. the Pi 5's Cortex-A76).
+*/
+
+#ifdef __ARM_FEATURE_SVE
+#include <arm_sve.h>
+
+void diff_sve_out(uint32_t *dst, const uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode)
+{
+	uint64_t num_bytes = size - size % sizeof(uint32_t);			// Only whole pixels, matching the other kernels.
+	const uint64_t vector_bytes = svcntb();					// Hardware vector length, 16 to 256 bytes.
+	const svuint8_t alpha_only_mask = svreinterpret_u8_u32(svdup_n_u32(0xFF000000));
+
+	uint8_t *dst_bytes = (uint8_t *)dst;
+	const uint8_t *img1_bytes = (const uint8_t *)img1;
+	const uint8_t *img2_bytes = (const uint8_t *)img2;
+
+	svbool_t sve_pred;
+	svuint8_t sve_pxs1, sve_pxs2, sve_bytes_diff;
+
+	uint64_t byte_idx;
+	for (byte_idx = 0; byte_idx < num_bytes; byte_idx += vector_bytes) {
+		sve_pred = svwhilelt_b8_u64(byte_idx, num_bytes);		// Governs the partial last vector, so there is no scalar tail.
+		sve_pxs1 = svld1_u8(sve_pred, img1_bytes + byte_idx);
+		sve_pxs2 = svld1_u8(sve_pred, img2_bytes + byte_idx);
+
+		switch (mode) {
+			case ABS:
+				sve_bytes_diff = svabd_u8_x(sve_pred, sve_pxs1, sve_pxs2);	// |px1_channel - px2_channel|
+				break;
+			case SAT:
+				sve_bytes_diff = svqsub_u8(sve_pxs1, sve_pxs2);			// max(0, px1_channel - px2_channel)
+				break;
+			case MOD:
+			default:
+				sve_bytes_diff = svsub_u8_x(sve_pred, sve_pxs1, sve_pxs2);	// (px1_channel - px2_channel) % 256
+				break;
+		}
+
+		svst1_u8(sve_pred, dst_bytes + byte_idx, svorr_u8_x(sve_pred, sve_bytes_diff, alpha_only_mask));
+	}
+}
+
+void diff_sve(uint32_t *img1, const uint32_t *img2, size_t size, diff_mode_t mode)
+{
+	diff_sve_out(img1, img1, img2, size, mode);
+}
+#endif
@@ -0,0 +1,157 @@
+#include "pix_diff.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#ifdef PIX_DIFF_X86
+#include <immintrin.h>
+#endif
+
+/*
+Threshold kernels. A pixel is changed when the absolute difference of any color channel is larger
+than that channel's tolerance (R G B). The kernels write one mask byte per pixel, 0xFF changed or
+0x00 unchanged, and return how many pixels were changed, all in one pass over the inputs. Alpha is
+ignored: its tolerance byte is 0xFF, which no difference can exceed.
+*/
+
+#define MASK_CHANGED	0xFF
+
+size_t diff_threshold_scalar(uint8_t *mask, const uint32_t *img1, const uint32_t *img2, size_t size, const uint8_t tolerance[3])
+{
+	size_t num_pixels = size / sizeof(uint32_t);
+	size_t changed = 0;
+
+	size_t px_idx;
+	for (px_idx = 0; px_idx < num_pixels; ++px_idx) {
+		uint32_t pixout = calculate_pixel_difference(img1[px_idx], img2[px_idx], ABS);
+		int over = ((pixout & 0xFF) > tolerance[0]) ||
+			   (((pixout >> 8) & 0xFF) > tolerance[1]) ||
+			   (((pixout >> 16) & 0xFF) > tolerance[2]);
+		mask[px_idx] = over ? MASK_CHANGED : 0;
+		changed += (size_t)over;
+	}
+	return changed;
+}
+
+static uint32_t tolerance_pixel(const uint8_t tolerance[3])	// The tolerances laid out like a pixel, with alpha never exceeded.
+{
+	return (uint32_t)tolerance[0] | ((uint32_t)tolerance[1] << 8) | ((uint32_t)tolerance[2] << 16) | 0xFF000000;
+}
+
+#ifdef __ARM_NEON
+size_t diff_threshold_neon(uint8_t *mask, const uint32_t *img1, const uint32_t *img2, size_t size, const uint8_t tolerance[3])
+{
+	size_t num_pixels = size / sizeof(uint32_t);
+	const uint8x16_t neon_tolerance = vreinterpretq_u8_u32(vdupq_n_u32(tolerance_pixel(tolerance)));
+	uint32x4_t neon_count = vdupq_n_u32(0);
+
+	size_t px_idx;
+	for (px_idx = 0; px_idx + 15 < num_pixels; px_idx += 16) {	// 16 pixels give one full register of mask bytes.
+		uint32x4_t neon_over[4];
+		int quarter;
+		for (quarter = 0; quarter < 4; ++quarter) {
+			uint8x16_t neon_pxs1 = vld1q_u8((const uint8_t *)(img1 + px_idx + quarter * 4));
+			uint8x16_t neon_pxs2 = vld1q_u8((const uint8_t *)(img2 + px_idx + quarter * 4));
+			uint32x4_t neon_excess = vreinterpretq_u32_u8(vqsubq_u8(vabdq_u8(neon_pxs1, neon_pxs2), neon_tolerance));	// Non-zero above tolerance.
+			neon_over[quarter] = vtstq_u32(neon_excess, neon_excess);
+		}
+		uint8x16_t neon_mask = vcombine_u8(vmovn_u16(vcombine_u16(vmovn_u32(neon_over[0]), vmovn_u32(neon_over[1]))),
+						   vmovn_u16(vcombine_u16(vmovn_u32(neon_over[2]), vmovn_u32(neon_over[3]))));	// Narrow 32 -> 8 bits per pixel.
+		vst1q_u8(mask + px_idx, neon_mask);
+		neon_count = vpadalq_u16(neon_count, vpaddlq_u8(vshrq_n_u8(neon_mask, 7)));
+	}
+
+	uint64x2_t neon_count64 = vpaddlq_u32(neon_count);
+	size_t changed = (size_t)(vgetq_lane_u64(neon_count64, 0) + vgetq_lane_u64(neon_count64, 1));
+	return changed + diff_threshold_scalar(mask + px_idx, img1 + px_idx, img2 + px_idx, (num_pixels - px_idx) * sizeof(uint32_t), tolerance);	// The last up to 15 pixels.
+}
+#endif
+
+#ifdef PIX_DIFF_X86
+__attribute__((target("sse2")))
+size_t diff_threshold_sse2(uint8_t *mask, const uint32_t *img1, const uint32_t *img2, size_t size, const uint8_t tolerance[3])
+{
+	size_t num_pixels = size / sizeof(uint32_t);
+	const __m128i sse_tolerance = _mm_set1_epi32((int)tolerance_pixel(tolerance));
+	const __m128i zero = _mm_setzero_si128();
+	size_t changed = 0;
+
+	size_t px_idx;
+	for (px_idx = 0; px_idx + 15 < num_pixels; px_idx += 16) {
+		__m128i sse_within[4];
+		int quarter;
+		for (quarter = 0; quarter < 4; ++quarter) {
+			__m128i sse_pxs1 = _mm_loadu_si128((const __m128i *)(img1 + px_idx + quarter * 4));
+			__m128i sse_pxs2 = _mm_loadu_si128((const __m128i *)(img2 + px_idx + quarter * 4));
+			__m128i sse_abs = _mm_or_si128(_mm_subs_epu8(sse_pxs1, sse_pxs2), _mm_subs_epu8(sse_pxs2, sse_pxs1));
+			sse_within[quarter] = _mm_cmpeq_epi32(_mm_subs_epu8(sse_abs, sse_tolerance), zero);	// All ones when every channel is within tolerance.
+		}
+		__m128i sse_mask = _mm_packs_epi16(_mm_packs_epi32(sse_within[0], sse_within[1]), _mm_packs_epi32(sse_within[2], sse_within[3]));	// Signed saturation keeps 0 and -1.
+		sse_mask = _mm_xor_si128(sse_mask, _mm_cmpeq_epi8(zero, zero));	// Invert to 0xFF for changed pixels.
+		_mm_storeu_si128((__m128i *)(mask + px_idx), sse_mask);
+		changed += (size_t)__builtin_popcount((unsigned)_mm_movemask_epi8(sse_mask));
+	}
+	return changed + diff_threshold_scalar(mask + px_idx, img1 + px_idx, img2 + px_idx, (num_pixels - px_idx) * sizeof(uint32_t), tolerance);
+}
+
+__attribute__((target("avx2")))
+size_t diff_threshold_avx2(uint8_t *mask, const uint32_t *img1, const uint32_t *img2, size_t size, const uint8_t tolerance[3])
+{
+	size_t num_pixels = size / sizeof(uint32_t);
+	const __m256i avx_tolerance = _mm256_set1_epi32((int)tolerance_pixel(tolerance));
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i lane_order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);	// Undo the per-lane interleave of the packs.
+	size_t changed = 0;
+
+	size_t px_idx;
+	for (px_idx = 0; px_idx + 31 < num_pixels; px_idx += 32) {
+		__m256i avx_within[4];
+		int quarter;
+		for (quarter = 0; quarter < 4; ++quarter) {
+			__m256i avx_pxs1 = _mm256_loadu_si256((const __m256i *)(img1 + px_idx + quarter * 8));
+			__m256i avx_pxs2 = _mm256_loadu_si256((const __m256i *)(img2 + px_idx + quarter * 8));
+			__m256i avx_abs = _mm256_or_si256(_mm256_subs_epu8(avx_pxs1, avx_pxs2), _mm256_subs_epu8(avx_pxs2, avx_pxs1));
+			avx_within[quarter] = _mm256_cmpeq_epi32(_mm256_subs_epu8(avx_abs, avx_tolerance), zero);
+		}
+		__m256i avx_mask = _mm256_packs_epi16(_mm256_packs_epi32(avx_within[0], avx_within[1]), _mm256_packs_epi32(avx_within[2], avx_within[3]));
+		avx_mask = _mm256_permutevar8x32_epi32(avx_mask, lane_order);
+		avx_mask = _mm256_xor_si256(avx_mask, _mm256_cmpeq_epi8(zero, zero));
+		_mm256_storeu_si256((__m256i *)(mask + px_idx), avx_mask);
+		changed += (size_t)__builtin_popcount((unsigned)_mm256_movemask_epi8(avx_mask));
+	}
+	return changed + diff_threshold_scalar(mask + px_idx, img1 + px_idx, img2 + px_idx, (num_pixels - px_idx) * sizeof(uint32_t), tolerance);
+}
+#endif
+
+diff_threshold_fn_t diff_kernel_threshold_fn(diff_kernel_t kernel)	// Kernels without a threshold variant use the closest narrower one.
+{
+	if (kernel == KERNEL_AUTO) {
+		kernel = diff_best_kernel();
+	}
+	if (!diff_kernel_supported(kernel)) {
+		return NULL;
+	}
+
+	switch (kernel) {
+#ifdef PIX_DIFF_X86
+		case KERNEL_SSE2:
+			return diff_threshold_sse2;
+		case KERNEL_AVX2:
+		case KERNEL_AVX512:
+			return diff_threshold_avx2;
+#endif
+#ifdef __ARM_NEON
+		case KERNEL_NEON:
+		case KERNEL_NEON_X4:
+		case KERNEL_SVE:
+			return diff_threshold_neon;
+#endif
+		case KERNEL_SWAR:
+		case KERNEL_SCALAR:
+		default:
+			return diff_threshold_scalar;
+	}
+}
@@ -0,0 +1,692 @@
+#include "png_stream.h"
+#include "deflate.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PNG_GRAY	0		// Color types.
+#define PNG_RGB		2
+#define PNG_PALETTE	3
+#define PNG_GRAY_ALPHA	4
+#define PNG_RGBA	6
+#define IDAT_READ_BYTES	(64u << 10)	// Compressed bytes read from the file at a time.
+#define MAX_DIMENSION	(1 << 24)	// The same limit as stb_image.
+
+static const uint8_t PNG_SIGNATURE[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+static uint32_t load_be32(const uint8_t *bytes)
+{
+	return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+static void store_be32(uint8_t *bytes, uint32_t value)
+{
+	bytes[0] = (uint8_t)(value >> 24);
+	bytes[1] = (uint8_t)(value >> 16);
+	bytes[2] = (uint8_t)(value >> 8);
+	bytes[3] = (uint8_t)value;
+}
+
+static int paeth(int a, int b, int c)	// Left, up, up-left.
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	if (pa <= pb && pa <= pc) {
+		return a;
+	}
+	return (pb <= pc) ? b : c;
+}
+
+struct png_reader {
+	FILE *file;
+	int width;
+	int height;
+	int rows_read;
+	int color_type;
+	size_t channels;
+	size_t row_bytes;		// Without the filter byte.
+	uint8_t *row;			// Filter byte and the current row.
+	uint8_t *prev;			// The previous row, zero before the first.
+	uint8_t palette[256 * 4];
+	int has_key;			// tRNS color key for gray and RGB images.
+	uint8_t key[3];
+
+	inflate_stream_t *inflate;
+	uint32_t idat_left;		// Bytes left in the current IDAT chunk.
+	int idat_done;
+	uint8_t idat[IDAT_READ_BYTES];
+};
+
+static int idat_source(void *ctx, const uint8_t **data, size_t *len)	// Feeds the data of consecutive IDAT chunks to inflate.
+{
+	png_reader_t *reader = ctx;
+	*len = 0;
+	while (reader->idat_left == 0) {
+		uint8_t header[12];		// CRC of the previous chunk, then length and type of the next.
+		if (reader->idat_done) {
+			return 0;
+		}
+		if (fread(header, 1, sizeof(header), reader->file) != sizeof(header)) {
+			fprintf(stderr, "Error(%s): The PNG ended inside its image data.\n", __func__);
+			return -1;
+		}
+		if (memcmp(header + 8, "IDAT", 4) != 0) {
+			reader->idat_done = 1;
+			return 0;
+		}
+		reader->idat_left = load_be32(header + 4);
+	}
+
+	size_t chunk = (reader->idat_left < IDAT_READ_BYTES) ? reader->idat_left : IDAT_READ_BYTES;
+	if (fread(reader->idat, 1, chunk, reader->file) != chunk) {
+		fprintf(stderr, "Error(%s): Unable to read the PNG image data.\n", __func__);
+		return -1;
+	}
+	reader->idat_left -= (uint32_t)chunk;
+	*data = reader->idat;
+	*len = chunk;
+	return 0;
+}
+
+static int read_header_chunks(png_reader_t *reader)	// Reads up to the first IDAT, 0 when the image is one this reader handles.
+{
+	uint8_t signature[8];
+	if (fread(signature, 1, sizeof(signature), reader->file) != sizeof(signature) || memcmp(signature, PNG_SIGNATURE, sizeof(signature)) != 0) {
+		return -1;
+	}
+
+	int have_header = 0, have_palette = 0;
+	for (;;) {
+		uint8_t chunk_header[8];
+		if (fread(chunk_header, 1, sizeof(chunk_header), reader->file) != sizeof(chunk_header)) {
+			return -1;
+		}
+		uint32_t len = load_be32(chunk_header);
+		const uint8_t *type = chunk_header + 4;
+
+		if (!have_header) {
+			uint8_t ihdr[13];
+			if (memcmp(type, "IHDR", 4) != 0 || len != sizeof(ihdr) || fread(ihdr, 1, sizeof(ihdr), reader->file) != sizeof(ihdr)) {
+				return -1;	// Also CgBI images, which stb_image converts.
+			}
+			uint32_t width = load_be32(ihdr), height = load_be32(ihdr + 4);
+			reader->color_type = ihdr[9];
+			if (width == 0 || height == 0 || width > MAX_DIMENSION || height > MAX_DIMENSION ||
+			    ihdr[8] != 8 || ihdr[10] != 0 || ihdr[11] != 0 || ihdr[12] != 0) {	// 8 bits per channel, deflate, adaptive filters, not interlaced.
+				return -1;
+			}
+			switch (reader->color_type) {
+				case PNG_GRAY:		reader->channels = 1; break;
+				case PNG_RGB:		reader->channels = 3; break;
+				case PNG_PALETTE:	reader->channels = 1; break;
+				case PNG_GRAY_ALPHA:	reader->channels = 2; break;
+				case PNG_RGBA:		reader->channels = 4; break;
+				default:		return -1;
+			}
+			reader->width = (int)width;
+			reader->height = (int)height;
+			reader->row_bytes = (size_t)width * reader->channels;
+			have_header = 1;
+		} else if (memcmp(type, "PLTE", 4) == 0) {
+			uint8_t entries[256 * 3];
+			if (len > sizeof(entries) || len % 3 != 0 || fread(entries, 1, len, reader->file) != len) {
+				return -1;
+			}
+			uint32_t entry;
+			for (entry = 0; entry < len / 3; ++entry) {
+				memcpy(reader->palette + entry * 4, entries + entry * 3, 3);
+				reader->palette[entry * 4 + 3] = 0xFF;
+			}
+			have_palette = 1;
+		} else if (memcmp(type, "tRNS", 4) == 0) {
+			uint8_t trns[256];
+			if (len > sizeof(trns) || fread(trns, 1, len, reader->file) != len) {
+				return -1;
+			}
+			if (reader->color_type == PNG_PALETTE) {	// Alpha for the first len palette entries.
+				uint32_t entry;
+				for (entry = 0; entry < len; ++entry) {
+					reader->palette[entry * 4 + 3] = trns[entry];
+				}
+			} else if ((reader->color_type == PNG_GRAY && len == 2) || (reader->color_type == PNG_RGB && len == 6)) {
+				size_t channel;
+				for (channel = 0; channel < len / 2; ++channel) {
+					reader->key[channel] = trns[channel * 2 + 1];	// Low byte of the 16-bit sample, as stb_image.
+				}
+				reader->has_key = 1;
+			} else {
+				return -1;
+			}
+		} else if (memcmp(type, "IDAT", 4) == 0) {
+			if (reader->color_type == PNG_PALETTE && !have_palette) {
+				return -1;
+			}
+			reader->idat_left = len;
+			return 0;
+		} else if (memcmp(type, "IEND", 4) == 0 || (type[0] & 0x20) == 0) {	// No image data, or a critical chunk this reader does not know.
+			return -1;
+		} else if (fseek(reader->file, (long)len, SEEK_CUR) != 0) {
+			return -1;
+		}
+
+		uint8_t crc[4];
+		if (fread(crc, 1, sizeof(crc), reader->file) != sizeof(crc)) {
+			return -1;
+		}
+	}
+}
+
+png_reader_t *png_reader_open(const char *filename, int *width, int *height)
+{
+	png_reader_t *reader = calloc(1, sizeof(*reader));
+	if (reader == NULL) {
+		fprintf(stderr, "Error(%s): Unable to allocate the PNG reader for '%s'.\n", __func__, filename);
+		return NULL;
+	}
+	size_t entry;
+	for (entry = 0; entry < 256; ++entry) {
+		reader->palette[entry * 4 + 3] = 0xFF;
+	}
+
+	reader->file = fopen(filename, "rb");
+	if (reader->file == NULL || read_header_chunks(reader) == -1) {
+		png_reader_close(reader);
+		return NULL;
+	}
+
+	reader->row = malloc(reader->row_bytes + 1);
+	reader->prev = calloc(reader->row_bytes, 1);
+	if (reader->row == NULL || reader->prev == NULL) {
+		fprintf(stderr, "Error(%s): Unable to allocate the row buffers for '%s'.\n", __func__, filename);
+		png_reader_close(reader);
+		return NULL;
+	}
+	reader->inflate = inflate_open(idat_source, reader);
+	if (reader->inflate == NULL) {
+		png_reader_close(reader);
+		return NULL;
+	}
+
+	*width = reader->width;
+	*height = reader->height;
+	return reader;
+}
+
+static int unfilter_row(uint8_t *row, const uint8_t *prev, size_t row_bytes, size_t bpp, int filter)
+{
+	size_t idx;
+	switch (filter) {
+		case 0:
+			break;
+		case 1:
+			for (idx = bpp; idx < row_bytes; ++idx) {
+				row[idx] = (uint8_t)(row[idx] + row[idx - bpp]);
+			}
+			break;
+		case 2:
+			for (idx = 0; idx < row_bytes; ++idx) {
+				row[idx] = (uint8_t)(row[idx] + prev[idx]);
+			}
+			break;
+		case 3:
+			for (idx = 0; idx < row_bytes; ++idx) {
+				int left = (idx >= bpp) ? row[idx - bpp] : 0;
+				row[idx] = (uint8_t)(row[idx] + ((left + prev[idx]) >> 1));
+			}
+			break;
+		case 4:
+			for (idx = 0; idx < row_bytes; ++idx) {
+				int left = (idx >= bpp) ? row[idx - bpp] : 0;
+				int up_left = (idx >= bpp) ? prev[idx - bpp] : 0;
+				row[idx] = (uint8_t)(row[idx] + paeth(left, prev[idx], up_left));
+			}
+			break;
+		default:
+			return -1;
+	}
+	return 0;
+}
+
+static void expand_row(const png_reader_t *reader, const uint8_t *samples, uint8_t *out)	// One row of samples to RGBA.
+{
+	int x;
+	for (x = 0; x < reader->width; ++x, out += 4) {
+		switch (reader->color_type) {
+			case PNG_GRAY:
+				out[0] = out[1] = out[2] = samples[x];
+				out[3] = (reader->has_key && samples[x] == reader->key[0]) ? 0 : 0xFF;
+				break;
+			case PNG_GRAY_ALPHA:
+				out[0] = out[1] = out[2] = samples[x * 2];
+				out[3] = samples[x * 2 + 1];
+				break;
+			case PNG_RGB: {
+				const uint8_t *rgb = samples + x * 3;
+				memcpy(out, rgb, 3);
+				out[3] = (reader->has_key && rgb[0] == reader->key[0] && rgb[1] == reader->key[1] && rgb[2] == reader->key[2]) ? 0 : 0xFF;
+				break;
+			}
+			case PNG_PALETTE:
+				memcpy(out, reader->palette + samples[x] * 4, 4);
+				break;
+			default:
+				memcpy(out, samples + x * 4, 4);
+				break;
+		}
+	}
+}
+
+int png_reader_read_rows(png_reader_t *reader, uint32_t *rows, int num_rows)
+{
+	if (num_rows > reader->height - reader->rows_read) {
+		fprintf(stderr, "Error(%s): Asked for %d rows, only %d are left.\n", __func__, num_rows, reader->height - reader->rows_read);
+		return -1;
+	}
+
+	int row_idx;
+	for (row_idx = 0; row_idx < num_rows; ++row_idx) {
+		if (inflate_read(reader->inflate, reader->row, reader->row_bytes + 1) == -1) {
+			fprintf(stderr, "Error(%s): Unable to decompress row %d.\n", __func__, reader->rows_read);
+			return -1;
+		}
+		uint8_t *samples = reader->row + 1;
+		if (unfilter_row(samples, reader->prev, reader->row_bytes, reader->channels, reader->row[0]) == -1) {
+			fprintf(stderr, "Error(%s): Row %d has an invalid filter type %u.\n", __func__, reader->rows_read, reader->row[0]);
+			return -1;
+		}
+		expand_row(reader, samples, (uint8_t *)(rows + (size_t)row_idx * (size_t)reader->width));
+		memcpy(reader->prev, samples, reader->row_bytes);
+		reader->rows_read++;
+	}
+	return 0;
+}
+
+void png_reader_close(png_reader_t *reader)
+{
+	if (reader == NULL) {
+		return;
+	}
+	if (reader->inflate) {
+		inflate_close(reader->inflate);
+	}
+	if (reader->file) {
+		fclose(reader->file);
+	}
+	free(reader->row);
+	free(reader->prev);
+	free(reader);
+}
+
+/*
+The writer filters each row with whichever of the five PNG filters gives the smallest sum of
+absolute signed bytes, the heuristic stb_image_write uses, and deflates it straight into IDAT
+chunks.
+*/
+
+#define NUM_FILTERS	5
+
+struct png_writer {
+	FILE *file;
+	int failed;
+	int width;
+	int height;
+	int rows_written;
+	size_t row_bytes;
+	uint8_t *prev;			// The previous unfiltered row, zero before the first.
+	uint8_t *filtered[2];		// Filter type byte and filtered row: the best so far and the one being tried.
+	deflate_stream_t *deflate;
+};
+
+static int write_chunk(FILE *file, const char *type, const uint8_t *data, size_t len)
+{
+	uint8_t header[8];
+	store_be32(header, (uint32_t)len);
+	memcpy(header + 4, type, 4);
+	uint8_t crc[4];
+	store_be32(crc, crc32_update(crc32_update(0, header + 4, 4), data, len));
+
+	if (fwrite(header, 1, sizeof(header), file) != sizeof(header) ||
+	    (len > 0 && fwrite(data, 1, len, file) != len) ||
+	    fwrite(crc, 1, sizeof(crc), file) != sizeof(crc)) {
+		fprintf(stderr, "Error(%s): Unable to write a %s chunk.\n", __func__, type);
+		return -1;
+	}
+	return 0;
+}
+
+static int write_header(FILE *file, int width, int height, uint8_t color_type)	// Signature and IHDR for 8 bits per channel.
+{
+	uint8_t ihdr[13];
+	store_be32(ihdr, (uint32_t)width);
+	store_be32(ihdr + 4, (uint32_t)height);
+	ihdr[8] = 8;
+	ihdr[9] = color_type;
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;
+	if (fwrite(PNG_SIGNATURE, 1, sizeof(PNG_SIGNATURE), file) != sizeof(PNG_SIGNATURE)) {
+		return -1;
+	}
+	return write_chunk(file, "IHDR", ihdr, sizeof(ihdr));
+}
+
+static int idat_sink(void *ctx, const uint8_t *data, size_t len)	// Every block of compressed bytes becomes one IDAT chunk.
+{
+	png_writer_t *writer = ctx;
+	if (write_chunk(writer->file, "IDAT", data, len) == -1) {
+		writer->failed = 1;
+		return -1;
+	}
+	return 0;
+}
+
+png_writer_t *png_writer_open(const char *filename, int width, int height)
+{
+	if (width < 1 || height < 1) {
+		fprintf(stderr, "Error(%s): Dimensions %dx%d for writing PNG '%s' are invalid.\n", __func__, width, height, filename);
+		return NULL;
+	}
+	png_writer_t *writer = calloc(1, sizeof(*writer));
+	if (writer == NULL) {
+		fprintf(stderr, "Error(%s): Unable to allocate the PNG writer for '%s'.\n", __func__, filename);
+		return NULL;
+	}
+	writer->width = width;
+	writer->height = height;
+	writer->row_bytes = (size_t)width * 4;
+	writer->prev = calloc(writer->row_bytes, 1);
+	writer->filtered[0] = malloc(writer->row_bytes + 1);
+	writer->filtered[1] = malloc(writer->row_bytes + 1);
+	if (writer->prev == NULL || writer->filtered[0] == NULL || writer->filtered[1] == NULL) {
+		fprintf(stderr, "Error(%s): Unable to allocate the row buffers for '%s'.\n", __func__, filename);
+		goto err;
+	}
+
+	writer->file = fopen(filename, "wb");
+	if (writer->file == NULL) {
+		fprintf(stderr, "Error(%s): Unable to open or create '%s' for writing.\n", __func__, filename);
+		goto err;
+	}
+
+	if (write_header(writer->file, width, height, PNG_RGBA) == -1) {
+		fprintf(stderr, "Error(%s): Unable to write the PNG header to '%s'.\n", __func__, filename);
+		goto err;
+	}
+	writer->deflate = deflate_open(idat_sink, writer);
+	if (writer->deflate == NULL) {
+		goto err;
+	}
+	return writer;
+
+err:
+	writer->failed = 1;		// Already reported, close() only has to free.
+	png_writer_close(writer);
+	return NULL;
+}
+
+static unsigned long filter_row(uint8_t *out, const uint8_t *row, const uint8_t *prev, size_t row_bytes, size_t bpp, int filter)	// Returns the heuristic cost.
+{
+	unsigned long cost = 0;
+	out[0] = (uint8_t)filter;
+	size_t idx;
+	for (idx = 0; idx < row_bytes; ++idx) {
+		int left = (idx >= bpp) ? row[idx - bpp] : 0;
+		int up_left = (idx >= bpp) ? prev[idx - bpp] : 0;
+		int predictor;
+		switch (filter) {
+			case 1:		predictor = left; break;
+			case 2:		predictor = prev[idx]; break;
+			case 3:		predictor = (left + prev[idx]) >> 1; break;
+			case 4:		predictor = paeth(left, prev[idx], up_left); break;
+			default:	predictor = 0; break;
+		}
+		uint8_t value = (uint8_t)(row[idx] - predictor);
+		out[idx + 1] = value;
+		cost += (unsigned long)abs((int)(int8_t)value);
+	}
+	return cost;
+}
+
+static const uint8_t *filter_best(uint8_t *filtered[2], const uint8_t *row, const uint8_t *prev, size_t row_bytes, size_t bpp)	// Returns filtered[0], the cheapest.
+{
+	unsigned long best_cost = filter_row(filtered[0], row, prev, row_bytes, bpp, 0);
+	int filter;
+	for (filter = 1; filter < NUM_FILTERS; ++filter) {
+		unsigned long cost = filter_row(filtered[1], row, prev, row_bytes, bpp, filter);
+		if (cost < best_cost) {
+			uint8_t *swap = filtered[0];
+			filtered[0] = filtered[1];
+			filtered[1] = swap;
+			best_cost = cost;
+		}
+	}
+	return filtered[0];
+}
+
+int png_writer_write_rows(png_writer_t *writer, const uint32_t *rows, int num_rows)
+{
+	if (writer->failed || num_rows > writer->height - writer->rows_written) {
+		fprintf(stderr, "Error(%s): Can not write %d more rows.\n", __func__, num_rows);
+		writer->failed = 1;
+		return -1;
+	}
+
+	int row_idx;
+	for (row_idx = 0; row_idx < num_rows; ++row_idx) {
+		const uint8_t *row = (const uint8_t *)(rows + (size_t)row_idx * (size_t)writer->width);
+		const uint8_t *filtered = filter_best(writer->filtered, row, writer->prev, writer->row_bytes, 4);
+		if (deflate_write(writer->deflate, filtered, writer->row_bytes + 1) == -1) {
+			writer->failed = 1;
+			return -1;
+		}
+		memcpy(writer->prev, row, writer->row_bytes);
+		writer->rows_written++;
+	}
+	return 0;
+}
+
+int png_writer_close(png_writer_t *writer)
+{
+	if (writer->deflate && deflate_close(writer->deflate) == -1) {
+		writer->failed = 1;
+	}
+	if (writer->file) {
+		if (!writer->failed && write_chunk(writer->file, "IEND", NULL, 0) == -1) {
+			writer->failed = 1;
+		}
+		if (fclose(writer->file) != 0) {
+			fprintf(stderr, "Error(%s): Unable to finish writing the PNG.\n", __func__);
+			writer->failed = 1;
+		}
+	}
+	if (!writer->failed && writer->rows_written != writer->height) {
+		fprintf(stderr, "Error(%s): Only %d of %d rows were written.\n", __func__, writer->rows_written, writer->height);
+		writer->failed = 1;
+	}
+	int result = writer->failed ? -1 : 0;
+	free(writer->prev);
+	free(writer->filtered[0]);
+	free(writer->filtered[1]);
+	free(writer);
+	return result;
+}
+
+/*
+The whole-image writer cuts the filtered rows into strips of about STRIP_BYTES and deflates each on
+its own pool thread, primed with the 32KB before it so matches still cross the seams. Every strip
+ends on a byte boundary, so the strips are written back to back as IDAT chunks of one zlib stream
+whose Adler-32 is combined from the per-strip checksums. Strips depend only on the image, so the
+file is the same for every thread count.
+*/
+
+#define STRIP_BYTES	(256u << 10)
+
+typedef struct {
+	uint8_t *data;			// Compressed bytes, the zlib header in the first strip and the checksum in the last.
+	size_t len;
+	size_t capacity;
+	uint32_t adler;			// Of this strip's filtered bytes only.
+	size_t raw_len;
+	int failed;
+} png_strip_t;
+
+typedef struct {
+	const uint8_t *pixels;
+	size_t stride;			// Bytes from one row to the next.
+	int height;
+	size_t bpp;
+	size_t row_bytes;
+	int strip_rows;
+	int num_strips;
+	const uint8_t *zero_row;	// The row above the first.
+	png_strip_t *strips;
+} png_strip_job_t;
+
+static int strip_sink(void *ctx, const uint8_t *data, size_t len)
+{
+	png_strip_t *strip = ctx;
+	if (len > strip->capacity - strip->len) {
+		size_t capacity = (strip->capacity > 0) ? strip->capacity : 4096;
+		while (len > capacity - strip->len) {
+			capacity *= 2;
+		}
+		uint8_t *grown = realloc(strip->data, capacity);
+		if (grown == NULL) {
+			fprintf(stderr, "Error(%s): Unable to grow a compressed strip to %zu bytes.\n", __func__, capacity);
+			return -1;
+		}
+		strip->data = grown;
+		strip->capacity = capacity;
+	}
+	memcpy(strip->data + strip->len, data, len);
+	strip->len += len;
+	return 0;
+}
+
+static void compress_strip(void *arg, size_t index)
+{
+	const png_strip_job_t *job = arg;
+	png_strip_t *strip = &job->strips[index];
+	strip->failed = 1;
+
+	int first = (int)index * job->strip_rows;
+	int end = (job->height - first < job->strip_rows) ? job->height : first + job->strip_rows;
+	size_t filtered_bytes = job->row_bytes + 1;
+	int dict_rows = (int)((32768 + filtered_bytes - 1) / filtered_bytes);	// Enough rows before the strip to fill the window.
+	if (dict_rows > first) {
+		dict_rows = first;
+	}
+
+	size_t total_rows = (size_t)(end - first + dict_rows);
+	uint8_t *rows = malloc(total_rows * filtered_bytes);
+	uint8_t *filtered[2] = { malloc(filtered_bytes), malloc(filtered_bytes) };
+	if (rows == NULL || filtered[0] == NULL || filtered[1] == NULL) {
+		fprintf(stderr, "Error(%s): Unable to allocate the buffers for strip %zu.\n", __func__, index);
+		goto done;
+	}
+
+	int row;
+	for (row = first - dict_rows; row < end; ++row) {
+		const uint8_t *pixels = job->pixels + (size_t)row * job->stride;
+		const uint8_t *prev = (row > 0) ? pixels - job->stride : job->zero_row;
+		memcpy(rows + (size_t)(row - first + dict_rows) * filtered_bytes, filter_best(filtered, pixels, prev, job->row_bytes, job->bpp), filtered_bytes);
+	}
+
+	size_t dict_len = (size_t)dict_rows * filtered_bytes;
+	strip->raw_len = total_rows * filtered_bytes - dict_len;
+	strip->adler = adler32_update(1, rows + dict_len, strip->raw_len);
+
+	static const uint8_t zlib_header[2] = { 0x78, 0x01 };
+	if (index == 0 && strip_sink(strip, zlib_header, sizeof(zlib_header)) == -1) {
+		goto done;
+	}
+	deflate_stream_t *deflate = deflate_open_raw(strip_sink, strip, rows, dict_len);
+	if (deflate == NULL) {
+		goto done;
+	}
+	int write_result = deflate_write(deflate, rows + dict_len, strip->raw_len);
+	if (deflate_close_raw(deflate, index + 1 == (size_t)job->num_strips) == -1 || write_result == -1) {
+		goto done;
+	}
+	strip->failed = 0;
+
+done:
+	free(rows);
+	free(filtered[0]);
+	free(filtered[1]);
+}
+
+int png_write_image(const char *filename, const uint8_t *pixels, int width, int height, int channels, size_t stride, thread_pool_t *pool)
+{
+	if (width < 1 || height < 1 || (channels != 1 && channels != 4)) {
+		fprintf(stderr, "Error(%s): Can not write a %dx%d image with %d channels to PNG '%s'.\n", __func__, width, height, channels, filename);
+		return -1;
+	}
+
+	png_strip_job_t job;
+	job.pixels = pixels;
+	job.stride = stride;
+	job.height = height;
+	job.bpp = (size_t)channels;
+	job.row_bytes = (size_t)width * job.bpp;
+	job.strip_rows = (job.row_bytes + 1 < STRIP_BYTES) ? (int)(STRIP_BYTES / (job.row_bytes + 1)) : 1;
+	if (job.strip_rows > height) {
+		job.strip_rows = height;
+	}
+	job.num_strips = (height + job.strip_rows - 1) / job.strip_rows;
+	uint8_t *zero_row = calloc(job.row_bytes, 1);
+	job.zero_row = zero_row;
+	job.strips = calloc((size_t)job.num_strips, sizeof(png_strip_t));
+	if (zero_row == NULL || job.strips == NULL) {
+		fprintf(stderr, "Error(%s): Unable to allocate %d strips for '%s'.\n", __func__, job.num_strips, filename);
+		free(zero_row);
+		free(job.strips);
+		return -1;
+	}
+
+	thread_pool_parallel_for(pool, (size_t)job.num_strips, compress_strip, &job);
+
+	int result = 0;
+	uint32_t adler = 1;
+	int strip_idx;
+	for (strip_idx = 0; strip_idx < job.num_strips; ++strip_idx) {
+		result |= job.strips[strip_idx].failed ? -1 : 0;
+		adler = adler32_combine(adler, job.strips[strip_idx].adler, job.strips[strip_idx].raw_len);
+	}
+	uint8_t trailer[4];
+	store_be32(trailer, adler);
+	if (result == 0 && strip_sink(&job.strips[job.num_strips - 1], trailer, sizeof(trailer)) == -1) {
+		result = -1;
+	}
+
+	FILE *file = NULL;
+	if (result == 0) {
+		file = fopen(filename, "wb");
+		if (file == NULL) {
+			fprintf(stderr, "Error(%s): Unable to open or create '%s' for writing.\n", __func__, filename);
+			result = -1;
+		}
+	}
+	if (file) {
+		if (write_header(file, width, height, (channels == 4) ? PNG_RGBA : PNG_GRAY) == -1) {
+			result = -1;
+		}
+		for (strip_idx = 0; strip_idx < job.num_strips && result == 0; ++strip_idx) {
+			result = write_chunk(file, "IDAT", job.strips[strip_idx].data, job.strips[strip_idx].len);
+		}
+		if (result == 0) {
+			result = write_chunk(file, "IEND", NULL, 0);
+		}
+		if (fclose(file) != 0) {
+			result = -1;
+		}
+		if (result == -1) {
+			fprintf(stderr, "Error(%s): Failed to write PNG image to '%s'.\n", __func__, filename);
+		}
+	}
+
+	for (strip_idx = 0; strip_idx < job.num_strips; ++strip_idx) {
+		free(job.strips[strip_idx].data);
+	}
+	free(job.strips);
+	free(zero_row);
+	return result;
+}
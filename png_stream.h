@@ -0,0 +1,33 @@
+#ifndef PNG_STREAM_H
+#define PNG_STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "thread_pool.h"
+
+/*
+Row-at-a-time PNG decoding and encoding, so an image never has to be whole in memory. Rows are
+RGBA, 4 bytes per pixel, laid out like the stb_image buffers used everywhere else.
+
+The reader handles 8-bit non-interlaced gray, gray+alpha, RGB, RGBA and palette images, converted
+to RGBA the way stb_image does. png_reader_open() returns NULL without a message for anything else,
+so the caller can fall back to decoding the whole image with stb_image.
+
+png_write_image() encodes an image that is already whole in memory, compressing row strips in
+parallel on the pool. channels is 4 for RGBA or 1 for an 8-bit grayscale image.
+*/
+
+typedef struct png_reader png_reader_t;
+typedef struct png_writer png_writer_t;
+
+png_reader_t *png_reader_open(const char *filename, int *width, int *height);
+int png_reader_read_rows(png_reader_t *reader, uint32_t *rows, int num_rows);
+void png_reader_close(png_reader_t *reader);
+
+png_writer_t *png_writer_open(const char *filename, int width, int height);
+int png_writer_write_rows(png_writer_t *writer, const uint32_t *rows, int num_rows);
+int png_writer_close(png_writer_t *writer);	// Fails unless every row was written, frees the writer either way.
+
+int png_write_image(const char *filename, const uint8_t *pixels, int width, int height, int channels, size_t stride, thread_pool_t *pool);	// stride in bytes.
+
+#endif
@@ -0,0 +1,307 @@
+#include "deflate.h"
+#include "test_util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+Round trips through deflate.c and the malformed streams inflate has to turn down. The stored and
+dynamic blocks come from outside, the encoder only writes fixed Huffman blocks and empty stored ones
+for sync flushes: stored blocks are built here, the dynamic block is zlib's level 9 output for
+quick_brown() below.
+*/
+
+typedef struct {
+	uint8_t *data;
+	size_t len;
+	size_t capacity;
+	size_t pos;			// Read position for the source.
+	size_t piece;			// Bytes handed out per source call, to split every structure somewhere.
+} buffer_t;
+
+static int put_bytes(void *ctx, const uint8_t *data, size_t len)
+{
+	buffer_t *buf = ctx;
+	if (buf->len + len > buf->capacity) {
+		size_t capacity = (buf->len + len) * 2;
+		uint8_t *grown = realloc(buf->data, capacity);
+		if (grown == NULL) {
+			return -1;
+		}
+		buf->data = grown;
+		buf->capacity = capacity;
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	return 0;
+}
+
+static int get_bytes(void *ctx, const uint8_t **data, size_t *len)
+{
+	buffer_t *buf = ctx;
+	size_t left = buf->len - buf->pos;
+	*len = (left < buf->piece) ? left : buf->piece;
+	*data = buf->data + buf->pos;
+	buf->pos += *len;
+	return 0;
+}
+
+static int inflate_all(buffer_t *compressed, uint8_t *out, size_t len)	// -1 when inflate rejects the stream.
+{
+	compressed->pos = 0;
+	inflate_stream_t *stream = inflate_open(get_bytes, compressed);
+	if (stream == NULL) {
+		return -1;
+	}
+	int result = inflate_read(stream, out, len);
+	inflate_close(stream);
+	return result;
+}
+
+static void fill_sample(uint8_t *data, size_t len, uint32_t seed)	// Runs, repeats near and far, and noise.
+{
+	size_t idx;
+	for (idx = 0; idx < len; ++idx) {
+		seed = seed * 1664525u + 1013904223u;
+		if ((idx / 1000) % 3 == 0) {
+			data[idx] = (uint8_t)(seed >> 24);
+		} else if ((idx / 1000) % 3 == 1) {
+			data[idx] = (uint8_t)(idx / 50);
+		} else {
+			data[idx] = data[idx - 1000 + (seed >> 30)];
+		}
+	}
+}
+
+static void quick_brown(uint8_t *data, size_t len)
+{
+	static const char text[] = "the quick brown fox ";
+	size_t idx;
+	for (idx = 0; idx < len; ++idx) {
+		data[idx] = (uint8_t)((uint8_t)text[idx % 20] + (idx / 97) % 3);
+	}
+}
+
+static const uint8_t DYNAMIC_BLOCK[] = {	// zlib.compress(quick_brown(4000), 9), a single dynamic block.
+	0x78, 0xda, 0xb5, 0xd7, 0x31, 0x02, 0x83, 0x20, 0x10, 0x44, 0xd1, 0xab, 0x2c, 0x1c, 0x4d, 0x41,
+	0x50, 0x8c, 0x80, 0xa0, 0x88, 0xa7, 0x4f, 0x4a, 0x9b, 0x74, 0xfe, 0x76, 0x3a, 0x96, 0x57, 0xcc,
+	0x54, 0x6f, 0x25, 0x1f, 0xf3, 0x18, 0x64, 0xd8, 0x63, 0xdb, 0x64, 0x8a, 0x97, 0xd4, 0x37, 0xb3,
+	0xd4, 0xd5, 0x31, 0x4f, 0x6a, 0x3f, 0x17, 0xb3, 0xaa, 0xb1, 0xa4, 0x2b, 0x2a, 0xf7, 0x6a, 0x96,
+	0xb4, 0xcf, 0xb7, 0x3e, 0x17, 0xa7, 0x4b, 0x0b, 0xf6, 0xa3, 0x4d, 0xcd, 0xfd, 0xd5, 0x8c, 0xb9,
+	0xcb, 0x23, 0x63, 0xee, 0xf2, 0xc8, 0x98, 0xbb, 0x3c, 0x32, 0xd8, 0x50, 0xbc, 0x60, 0x43, 0x51,
+	0xc1, 0x86, 0x6a, 0x86, 0x0d, 0x05, 0x81, 0x0d, 0xfd, 0x3e, 0x99, 0x35, 0xe4, 0x34, 0x6c, 0x48,
+	0x2a, 0x6c, 0xc8, 0x25, 0xd8, 0x50, 0x4f, 0xb0, 0xa1, 0x61, 0x87, 0x0d, 0x99, 0x15, 0x36, 0x54,
+	0x1a, 0x6c, 0xc8, 0x5b, 0xd8, 0x50, 0x57, 0xb0, 0x21, 0xed, 0x61, 0x43, 0xb1, 0xc1, 0x86, 0xd4,
+	0x08, 0x1b, 0x0a, 0x16, 0x36, 0x24, 0x19, 0x36, 0x74, 0xcc, 0xb0, 0xa1, 0x7c, 0xc3, 0x86, 0x36,
+	0x71, 0x74, 0x77, 0xec, 0x74, 0x77, 0x1c, 0xe8, 0xee, 0x68, 0xe8, 0xee, 0x58, 0xe8, 0xee, 0x48,
+	0xef, 0x8f, 0x48, 0xef, 0x8f, 0x48, 0xef, 0x8f, 0x4a, 0xef, 0x8f, 0x40, 0xef, 0x8f, 0x93, 0xde,
+	0x1f, 0x8e, 0xde, 0x1f, 0x42, 0xef, 0x0f, 0xf7, 0xe7, 0x6d, 0x5f, 0x44, 0xc0, 0xc8, 0x7a
+};
+
+typedef struct {		// LSB-first bit writer for building streams by hand.
+	buffer_t *buf;
+	uint32_t bits;
+	unsigned count;
+} bit_writer_t;
+
+static void put_bits(bit_writer_t *writer, uint32_t value, unsigned num_bits)
+{
+	writer->bits |= value << writer->count;
+	writer->count += num_bits;
+	while (writer->count >= 8) {
+		uint8_t byte = (uint8_t)writer->bits;
+		put_bytes(writer->buf, &byte, 1);
+		writer->bits >>= 8;
+		writer->count -= 8;
+	}
+}
+
+static void put_code(bit_writer_t *writer, uint32_t code, unsigned len)	// Huffman codes go most significant bit first.
+{
+	while (len-- > 0) {
+		put_bits(writer, (code >> len) & 1u, 1);
+	}
+}
+
+static void flush_bits(bit_writer_t *writer)
+{
+	if (writer->count > 0) {
+		put_bits(writer, 0, 8 - writer->count);
+	}
+}
+
+static void put_zlib_header(buffer_t *buf)
+{
+	static const uint8_t header[2] = { 0x78, 0x01 };
+	put_bytes(buf, header, sizeof(header));
+}
+
+static void test_round_trip(size_t len, size_t piece)
+{
+	uint8_t *data = malloc(len);
+	uint8_t *out = malloc(len);
+	buffer_t compressed = { .piece = piece };
+	fill_sample(data, len, (uint32_t)len);
+
+	deflate_stream_t *stream = deflate_open(put_bytes, &compressed);
+	CHECK(stream != NULL);
+	size_t written = 0;
+	while (written < len) {			// Uneven writes, so input crosses the window refills at odd places.
+		size_t chunk = (len - written < 777) ? len - written : 777;
+		CHECK(deflate_write(stream, data + written, chunk) == 0);
+		written += chunk;
+	}
+	CHECK(deflate_close(stream) == 0);
+	CHECK(len < 10000 || compressed.len < len);	// Two thirds of the sample repeat.
+	CHECK(inflate_all(&compressed, out, len) == 0);
+	CHECK(memcmp(data, out, len) == 0);
+
+	free(compressed.data);
+	free(data);
+	free(out);
+}
+
+static void test_raw_pieces(void)	// Pieces joined by sync flushes, as png_write_image() joins its strips.
+{
+	size_t len = 200000, split = 70001;
+	uint8_t *data = malloc(len);
+	uint8_t *out = malloc(len);
+	buffer_t compressed = { .piece = 4096 };
+	fill_sample(data, len, 7);
+
+	put_zlib_header(&compressed);
+	deflate_stream_t *first = deflate_open_raw(put_bytes, &compressed, NULL, 0);
+	CHECK(first != NULL && deflate_write(first, data, split) == 0 && deflate_close_raw(first, 0) == 0);
+	deflate_stream_t *second = deflate_open_raw(put_bytes, &compressed, data + split - 32768, 32768);
+	CHECK(second != NULL && deflate_write(second, data + split, len - split) == 0 && deflate_close_raw(second, 1) == 0);
+	CHECK(inflate_all(&compressed, out, len) == 0);
+	CHECK(memcmp(data, out, len) == 0);
+
+	free(compressed.data);
+	free(data);
+	free(out);
+}
+
+static void test_stored_blocks(void)
+{
+	uint8_t data[1000];
+	uint8_t out[1000];
+	buffer_t compressed = { .piece = 3 };
+	fill_sample(data, sizeof(data), 3);
+
+	put_zlib_header(&compressed);
+	size_t offset = 0, block_len = 400;
+	while (offset < sizeof(data)) {
+		size_t len = (sizeof(data) - offset < block_len) ? sizeof(data) - offset : block_len;
+		uint8_t header[5] = { (uint8_t)(offset + len == sizeof(data)), (uint8_t)len, (uint8_t)(len >> 8), (uint8_t)~len, (uint8_t)(~len >> 8) };
+		put_bytes(&compressed, header, sizeof(header));
+		put_bytes(&compressed, data + offset, len);
+		offset += len;
+	}
+	CHECK(inflate_all(&compressed, out, sizeof(out)) == 0);
+	CHECK(memcmp(data, out, sizeof(data)) == 0);
+
+	compressed.data[3] ^= 1;		// NLEN no longer the complement of LEN.
+	CHECK(inflate_all(&compressed, out, sizeof(out)) == -1);
+	free(compressed.data);
+}
+
+static void test_dynamic_block(void)
+{
+	uint8_t data[4000];
+	uint8_t out[4000];
+	buffer_t compressed = { .data = (uint8_t *)(uintptr_t)DYNAMIC_BLOCK, .len = sizeof(DYNAMIC_BLOCK), .piece = 5 };
+	quick_brown(data, sizeof(data));
+	CHECK(inflate_all(&compressed, out, sizeof(out)) == 0);
+	CHECK(memcmp(data, out, sizeof(data)) == 0);
+}
+
+static void test_oversized_tables(unsigned hlit, unsigned hdist)	// HLIT and HDIST past 286 and 30 codes, with lengths for all of them.
+{
+	buffer_t compressed = { .piece = 64 };
+	bit_writer_t writer = { .buf = &compressed };
+	put_zlib_header(&compressed);
+	put_bits(&writer, 1, 1);		// Final block,
+	put_bits(&writer, 2, 2);		// dynamic.
+	put_bits(&writer, hlit, 5);
+	put_bits(&writer, hdist, 5);
+	put_bits(&writer, 0, 4);		// Four code length codes: 16, 17, 18 and 0.
+	put_bits(&writer, 0, 3);
+	put_bits(&writer, 0, 3);
+	put_bits(&writer, 1, 3);		// 18 and 0 both one bit long, 0 codes as 0 and 18 as 1.
+	put_bits(&writer, 1, 3);
+	unsigned total = hlit + 257 + hdist + 1, count = 0;
+	while (total - count >= 11) {		// Zero runs of up to 138, then single zeros.
+		unsigned repeat = (total - count < 138) ? total - count : 138;
+		put_code(&writer, 1, 1);
+		put_bits(&writer, repeat - 11, 7);
+		count += repeat;
+	}
+	while (count < total) {
+		put_code(&writer, 0, 1);
+		count++;
+	}
+	flush_bits(&writer);
+
+	uint8_t out[16];
+	CHECK(inflate_all(&compressed, out, sizeof(out)) == -1);
+	free(compressed.data);
+}
+
+static void test_distance(unsigned dist_code, int expected)	// Code 1 reaches back before the first byte, code 0 does not.
+{
+	buffer_t compressed = { .piece = 64 };
+	bit_writer_t writer = { .buf = &compressed };
+	put_zlib_header(&compressed);
+	put_bits(&writer, 1, 1);		// Final block,
+	put_bits(&writer, 1, 2);		// fixed Huffman.
+	put_code(&writer, 0x30 + 'a', 8);	// Literal 'a'.
+	put_code(&writer, 1, 7);		// Length 3,
+	put_code(&writer, dist_code, 5);	// distance 1 or 2.
+	put_code(&writer, 0, 7);		// End of block.
+	flush_bits(&writer);
+
+	uint8_t out[4];
+	CHECK(inflate_all(&compressed, out, sizeof(out)) == expected);
+	CHECK(expected == -1 || memcmp(out, "aaaa", 4) == 0);
+	free(compressed.data);
+}
+
+static void test_truncated(void)
+{
+	size_t len = 50000;
+	uint8_t *data = malloc(len);
+	uint8_t *out = malloc(len);
+	buffer_t compressed = { .piece = 1000 };
+	fill_sample(data, len, 11);
+	deflate_stream_t *stream = deflate_open(put_bytes, &compressed);
+	CHECK(stream != NULL && deflate_write(stream, data, len) == 0 && deflate_close(stream) == 0);
+
+	compressed.len /= 2;
+	CHECK(inflate_all(&compressed, out, len) == -1);
+	compressed.len = 1;			// Not even the zlib header.
+	CHECK(inflate_all(&compressed, out, len) == -1);
+
+	free(compressed.data);
+	free(data);
+	free(out);
+}
+
+int main(void)
+{
+	test_round_trip(1, 1);
+	test_round_trip(1000, 7);
+	test_round_trip(300000, 65536);		// Past the 64KB window, so it slides.
+	test_raw_pieces();
+	test_stored_blocks();
+	test_dynamic_block();
+	test_oversized_tables(31, 31);		// 288 and 32 codes, 4 lengths past 286 + 30.
+	test_oversized_tables(29, 30);		// 286 and 31.
+	test_distance(0, 0);
+	test_distance(1, -1);
+	test_truncated();
+
+	fprintf(stderr, "test_deflate: %s\n", failures ? "FAILED" : "passed");
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,431 @@
+#include "pix_diff.h"
+#include "thread_pool.h"
+#include "test_util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+Every kernel the build and the processor support against calculate_pixel_difference(), which
+diff_scalar() has to match as well. Lengths run from 0 to MAX_PIXELS so every vector body, masked
+tail and scalar tail is crossed, and the inputs and output start a random number of pixels into
+their buffers so no pointer is vector aligned for long. Each kernel runs in all three modes, out
+of place and in place (dst == img1), with the stats, compare and threshold forms alongside. The
+threaded drivers run with and without a pool over images of several bands.
+*/
+
+#define ROUNDS		300		// Random lengths per kernel and mode.
+#define MAX_PIXELS	300
+#define MAX_OFFSET	7		// Pixels into each buffer, enough to miss the alignment of a 64-byte vector.
+#define GUARD		16		// Pixels past the end of the output that must be left alone.
+#define GUARD_PIXEL	0x5A5A5A5Au
+#define POOL_THREADS	4
+#define BAND_PIXELS	((256u << 10) / 4)	// One band of the threaded drivers.
+
+static const diff_mode_t modes[] = { ABS, SAT, MOD };
+static const char *const mode_names[] = { "abs", "sat", "mod" };
+
+typedef struct {
+	const char *name;
+	diff_fn_t diff_fn;			// NULL for the out-of-place variants with no in-place form.
+	diff_out_fn_t out_fn;
+	diff_stats_fn_t stats_fn;
+	diff_compare_fn_t compare_fn;
+	diff_threshold_fn_t threshold_fn;
+} kernel_fns_t;
+
+static uint32_t state = 12345;
+
+static uint32_t next_random(void)
+{
+	state = state * 1664525u + 1013904223u;
+	return state ^ (state >> 16);
+}
+
+static size_t random_below(size_t limit)
+{
+	return limit ? (size_t)next_random() % limit : 0;
+}
+
+static void fill_pair(uint32_t *img1, uint32_t *img2, size_t num_pixels)	// About half the pixels equal, some only in alpha, the rest random.
+{
+	size_t px_idx;
+	for (px_idx = 0; px_idx < num_pixels; ++px_idx) {
+		img1[px_idx] = next_random();
+		switch (next_random() % 4) {
+			case 0:
+			case 1:
+				img2[px_idx] = img1[px_idx];
+				break;
+			case 2:
+				img2[px_idx] = img1[px_idx] ^ (next_random() & 0xFF000000u);
+				break;
+			default:
+				img2[px_idx] = next_random();
+				break;
+		}
+	}
+}
+
+static void reference_diff(uint32_t *expected, const uint32_t *img1, const uint32_t *img2, size_t num_pixels, diff_mode_t mode)
+{
+	size_t px_idx;
+	for (px_idx = 0; px_idx < num_pixels; ++px_idx) {
+		expected[px_idx] = calculate_pixel_difference(img1[px_idx], img2[px_idx], mode);
+	}
+}
+
+static void reference_stats(const uint32_t *expected, size_t num_pixels, diff_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	size_t px_idx;
+	int channel;
+	for (px_idx = 0; px_idx < num_pixels; ++px_idx) {
+		if ((expected[px_idx] & 0x00FFFFFFu) == 0) {
+			continue;
+		}
+		stats->changed_pixels++;
+		for (channel = 0; channel < 3; ++channel) {
+			uint8_t channel_diff = (uint8_t)(expected[px_idx] >> (channel * 8));
+			stats->channel_sum[channel] += channel_diff;
+			if (channel_diff > stats->channel_max[channel]) {
+				stats->channel_max[channel] = channel_diff;
+			}
+		}
+	}
+}
+
+static int same_stats(const diff_stats_t *a, const diff_stats_t *b)
+{
+	int channel;
+	if (a->changed_pixels != b->changed_pixels) {
+		return 0;
+	}
+	for (channel = 0; channel < 3; ++channel) {
+		if (a->channel_sum[channel] != b->channel_sum[channel] || a->channel_max[channel] != b->channel_max[channel]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static size_t reference_threshold(uint8_t *mask, const uint32_t *img1, const uint32_t *img2, size_t num_pixels, const uint8_t tolerance[3])
+{
+	size_t over = 0;
+	size_t px_idx;
+	for (px_idx = 0; px_idx < num_pixels; ++px_idx) {
+		uint32_t pixout = calculate_pixel_difference(img1[px_idx], img2[px_idx], ABS);
+		int is_over = ((pixout & 0xFF) > tolerance[0]) || (((pixout >> 8) & 0xFF) > tolerance[1]) || (((pixout >> 16) & 0xFF) > tolerance[2]);
+		mask[px_idx] = is_over ? 0xFF : 0;
+		over += (size_t)is_over;
+	}
+	return over;
+}
+
+static int guard_intact(const uint32_t *guard)
+{
+	size_t px_idx;
+	for (px_idx = 0; px_idx < GUARD; ++px_idx) {
+		if (guard[px_idx] != GUARD_PIXEL) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void set_guard(uint32_t *guard)
+{
+	size_t px_idx;
+	for (px_idx = 0; px_idx < GUARD; ++px_idx) {
+		guard[px_idx] = GUARD_PIXEL;
+	}
+}
+
+static void test_kernel(const kernel_fns_t *fns)
+{
+	static uint32_t buf1[MAX_OFFSET + MAX_PIXELS], buf2[MAX_OFFSET + MAX_PIXELS], out[MAX_OFFSET + MAX_PIXELS + GUARD];
+	static uint32_t saved1[MAX_PIXELS], saved2[MAX_PIXELS], expected[MAX_PIXELS];
+	static uint8_t mask_buf[MAX_OFFSET + MAX_PIXELS + GUARD], expected_mask[MAX_PIXELS];
+	int failures_before = failures;
+
+	size_t mode_idx;
+	int round;
+	for (mode_idx = 0; mode_idx < sizeof(modes) / sizeof(modes[0]); ++mode_idx) {
+		diff_mode_t mode = modes[mode_idx];
+		for (round = 0; round < ROUNDS; ++round) {
+			size_t num_pixels = random_below(MAX_PIXELS + 1);
+			size_t size = num_pixels * sizeof(uint32_t);
+			uint32_t *img1 = buf1 + random_below(MAX_OFFSET + 1);
+			uint32_t *img2 = buf2 + random_below(MAX_OFFSET + 1);
+			uint32_t *dst = out + random_below(MAX_OFFSET + 1);
+			fill_pair(img1, img2, num_pixels);
+			memcpy(saved1, img1, size);
+			memcpy(saved2, img2, size);
+			reference_diff(expected, img1, img2, num_pixels, mode);
+
+			set_guard(dst + num_pixels);				// Out of place.
+			fns->out_fn(dst, img1, img2, size, mode);
+			CHECK(memcmp(dst, expected, size) == 0);
+			CHECK(guard_intact(dst + num_pixels));
+			CHECK(memcmp(img1, saved1, size) == 0 && memcmp(img2, saved2, size) == 0);
+
+			memcpy(dst, saved1, size);				// In place through the out-of-place form.
+			set_guard(dst + num_pixels);
+			fns->out_fn(dst, dst, img2, size, mode);
+			CHECK(memcmp(dst, expected, size) == 0);
+			CHECK(guard_intact(dst + num_pixels));
+
+			if (fns->diff_fn) {					// In place.
+				memcpy(dst, saved1, size);
+				set_guard(dst + num_pixels);
+				fns->diff_fn(dst, img2, size, mode);
+				CHECK(memcmp(dst, expected, size) == 0);
+				CHECK(guard_intact(dst + num_pixels));
+			}
+
+			if (fns->stats_fn) {
+				diff_stats_t stats, expected_stats;
+				reference_stats(expected, num_pixels, &expected_stats);
+				memset(&stats, 0, sizeof(stats));
+				memset(dst, 0, size);
+				set_guard(dst + num_pixels);
+				fns->stats_fn(dst, img1, img2, size, mode, &stats);
+				CHECK(memcmp(dst, expected, size) == 0);
+				CHECK(same_stats(&stats, &expected_stats));
+				CHECK(guard_intact(dst + num_pixels));
+
+				memcpy(dst, saved1, size);			// In place.
+				memset(&stats, 0, sizeof(stats));
+				fns->stats_fn(dst, dst, img2, size, mode, &stats);
+				CHECK(memcmp(dst, expected, size) == 0);
+				CHECK(same_stats(&stats, &expected_stats));
+			}
+		}
+	}
+
+	if (fns->compare_fn) {
+		for (round = 0; round < ROUNDS; ++round) {
+			size_t num_pixels = random_below(MAX_PIXELS + 1);
+			uint32_t *img1 = buf1 + random_below(MAX_OFFSET + 1);
+			uint32_t *img2 = buf2 + random_below(MAX_OFFSET + 1);
+			size_t px_idx;
+			for (px_idx = 0; px_idx < num_pixels; ++px_idx) {
+				img1[px_idx] = next_random();
+				img2[px_idx] = img1[px_idx] ^ (next_random() & 0xFF000000u);	// Alpha is ignored.
+			}
+			size_t first = random_below(num_pixels + 1);	// num_pixels leaves them identical.
+			if (first < num_pixels) {
+				img2[first] ^= 1u << (random_below(24));
+			}
+			CHECK(fns->compare_fn(img1, img2, num_pixels * sizeof(uint32_t)) == first);
+			CHECK(diff_compare_scalar(img1, img2, num_pixels * sizeof(uint32_t)) == first);
+		}
+	}
+
+	if (fns->threshold_fn) {
+		for (round = 0; round < ROUNDS; ++round) {
+			size_t num_pixels = random_below(MAX_PIXELS + 1);
+			uint32_t *img1 = buf1 + random_below(MAX_OFFSET + 1);
+			uint32_t *img2 = buf2 + random_below(MAX_OFFSET + 1);
+			uint8_t *mask = mask_buf + random_below(MAX_OFFSET + 1);
+			uint8_t tolerance[3];
+			int channel;
+			for (channel = 0; channel < 3; ++channel) {
+				tolerance[channel] = (round % 8 == 0) ? 0 : (uint8_t)next_random();	// Zero counts every change.
+			}
+			fill_pair(img1, img2, num_pixels);
+			size_t expected_over = reference_threshold(expected_mask, img1, img2, num_pixels, tolerance);
+			memset(mask + num_pixels, 0x5A, GUARD);
+			CHECK(fns->threshold_fn(mask, img1, img2, num_pixels * sizeof(uint32_t), tolerance) == expected_over);
+			CHECK(memcmp(mask, expected_mask, num_pixels) == 0);
+			CHECK(mask[num_pixels] == 0x5A && mask[num_pixels + GUARD - 1] == 0x5A);
+		}
+	}
+
+	if (failures != failures_before) {
+		fprintf(stderr, "FAIL(%s): Kernel '%s' differs from calculate_pixel_difference().\n", __func__, fns->name);
+	}
+}
+
+static void reference_bbox(const uint32_t *expected, int width, int height, diff_bbox_t *bbox)
+{
+	int x_min = width, x_max = -1, y_min = height, y_max = -1;
+	int y, x;
+	for (y = 0; y < height; ++y) {
+		for (x = 0; x < width; ++x) {
+			if (expected[(size_t)y * (size_t)width + (size_t)x] & 0x00FFFFFFu) {
+				if (x < x_min) x_min = x;
+				if (x > x_max) x_max = x;
+				if (y < y_min) y_min = y;
+				y_max = y;
+			}
+		}
+	}
+	if (y_max < 0) {
+		bbox->x = bbox->y = bbox->width = bbox->height = 0;
+		return;
+	}
+	bbox->x = x_min;
+	bbox->y = y_min;
+	bbox->width = x_max - x_min + 1;
+	bbox->height = y_max - y_min + 1;
+}
+
+static void fill_region(uint32_t *img1, uint32_t *img2, int width, int height, int x0, int y0, int x1, int y1)	// Differences only inside [x0, x1) x [y0, y1).
+{
+	int y, x;
+	for (y = 0; y < height; ++y) {
+		for (x = 0; x < width; ++x) {
+			size_t px_idx = (size_t)y * (size_t)width + (size_t)x;
+			img1[px_idx] = next_random();
+			img2[px_idx] = img1[px_idx] ^ (next_random() & 0xFF000000u);
+			if (x >= x0 && x < x1 && y >= y0 && y < y1 && next_random() % 4 == 0) {
+				img2[px_idx] = next_random();
+			}
+		}
+	}
+	if (x1 > x0 && y1 > y0) {			// Pin the corners, so the box is exactly the region.
+		img2[(size_t)y0 * (size_t)width + (size_t)x0] = ~img1[(size_t)y0 * (size_t)width + (size_t)x0];
+		img2[(size_t)(y1 - 1) * (size_t)width + (size_t)(x1 - 1)] = ~img1[(size_t)(y1 - 1) * (size_t)width + (size_t)(x1 - 1)];
+	}
+}
+
+static void test_drivers(const kernel_fns_t *fns, thread_pool_t *pool)	// pool may be NULL.
+{
+	size_t capacity = 3 * BAND_PIXELS + MAX_PIXELS + MAX_OFFSET;	// Three full bands and a short one.
+	uint32_t *buf1 = malloc(capacity * sizeof(uint32_t));
+	uint32_t *buf2 = malloc(capacity * sizeof(uint32_t));
+	uint32_t *out = malloc((capacity + GUARD) * sizeof(uint32_t));
+	uint32_t *expected = malloc(capacity * sizeof(uint32_t));
+	uint8_t *mask = malloc(capacity);
+	uint8_t *expected_mask = malloc(capacity);
+	if (!buf1 || !buf2 || !out || !expected || !mask || !expected_mask) {
+		fprintf(stderr, "FAIL(%s): Unable to allocate the driver buffers.\n", __func__);
+		failures++;
+		goto done;
+	}
+	int failures_before = failures;
+
+	size_t mode_idx;
+	for (mode_idx = 0; mode_idx < sizeof(modes) / sizeof(modes[0]); ++mode_idx) {
+		diff_mode_t mode = modes[mode_idx];
+		size_t num_pixels = 3 * BAND_PIXELS + random_below(MAX_PIXELS + 1);
+		size_t size = num_pixels * sizeof(uint32_t);
+		uint32_t *img1 = buf1 + random_below(MAX_OFFSET + 1);
+		uint32_t *img2 = buf2 + random_below(MAX_OFFSET + 1);
+		uint32_t *dst = out + random_below(MAX_OFFSET + 1);
+		fill_pair(img1, img2, num_pixels);
+		reference_diff(expected, img1, img2, num_pixels, mode);
+
+		set_guard(dst + num_pixels);
+		diff_parallel_out(pool, fns->out_fn, dst, img1, img2, size, mode);
+		CHECK(memcmp(dst, expected, size) == 0);
+		CHECK(guard_intact(dst + num_pixels));
+
+		memcpy(dst, img1, size);			// In place.
+		diff_parallel_out(pool, fns->out_fn, dst, dst, img2, size, mode);
+		CHECK(memcmp(dst, expected, size) == 0);
+
+		if (fns->stats_fn) {
+			diff_stats_t stats, expected_stats;
+			reference_stats(expected, num_pixels, &expected_stats);
+			memset(&stats, 0, sizeof(stats));
+			memset(dst, 0, size);
+			CHECK(diff_stats_parallel_out(pool, fns->stats_fn, dst, img1, img2, size, mode, &stats) == 0);
+			CHECK(memcmp(dst, expected, size) == 0);
+			CHECK(same_stats(&stats, &expected_stats));
+		}
+
+		if (fns->threshold_fn) {
+			uint8_t tolerance[3] = { (uint8_t)next_random(), (uint8_t)next_random(), (uint8_t)next_random() };
+			size_t expected_over = reference_threshold(expected_mask, img1, img2, num_pixels, tolerance);
+			size_t over = 0;
+			CHECK(diff_threshold_parallel(pool, fns->threshold_fn, mask, img1, img2, size, tolerance, &over) == 0);
+			CHECK(over == expected_over);
+			CHECK(memcmp(mask, expected_mask, num_pixels) == 0);
+		}
+
+		int width = 1 + (int)random_below(1500);		// Odd widths, bands of whole rows that do not fill BAND_BYTES.
+		int height = (int)(num_pixels / (size_t)width);
+		int regions[3][4] = {
+			{ 0, 0, 0, 0 },					// Nothing changed.
+			{ 0, 0, width, height },			// The whole image.
+			{ (int)random_below((size_t)width), (int)random_below((size_t)height), 0, 0 },
+		};
+		regions[2][2] = regions[2][0] + 1 + (int)random_below((size_t)(width - regions[2][0]));
+		regions[2][3] = regions[2][1] + 1 + (int)random_below((size_t)(height - regions[2][1]));
+		size_t region;
+		for (region = 0; region < 3; ++region) {
+			size_t image_pixels = (size_t)width * (size_t)height;
+			fill_region(img1, img2, width, height, regions[region][0], regions[region][1], regions[region][2], regions[region][3]);
+			reference_diff(expected, img1, img2, image_pixels, mode);
+			diff_bbox_t bbox, expected_bbox;
+			reference_bbox(expected, width, height, &expected_bbox);
+			CHECK(diff_bbox_out(pool, fns->out_fn, dst, img1, img2, width, height, mode, &bbox) == 0);
+			CHECK(memcmp(dst, expected, image_pixels * sizeof(uint32_t)) == 0);
+			CHECK(bbox.x == expected_bbox.x && bbox.y == expected_bbox.y && bbox.width == expected_bbox.width && bbox.height == expected_bbox.height);
+		}
+		if (failures != failures_before) {
+			fprintf(stderr, "FAIL(%s): Kernel '%s' in mode %s on %s.\n", __func__, fns->name, mode_names[mode_idx], pool ? "a pool" : "one thread");
+			break;
+		}
+	}
+
+done:
+	free(buf1);
+	free(buf2);
+	free(out);
+	free(expected);
+	free(mask);
+	free(expected_mask);
+}
+
+int main(void)
+{
+	thread_pool_t *pool = thread_pool_create(POOL_THREADS);
+	if (pool == NULL) {
+		fprintf(stderr, "FAIL(%s): Unable to create a pool of %d threads.\n", __func__, POOL_THREADS);
+		return EXIT_FAILURE;
+	}
+
+	size_t num_pixels;
+	for (num_pixels = 0; num_pixels <= MAX_PIXELS; ++num_pixels) {	// diff_scalar() itself, against the pixel function.
+		static uint32_t img1[MAX_PIXELS], img2[MAX_PIXELS], expected[MAX_PIXELS];
+		size_t mode_idx;
+		fill_pair(img1, img2, num_pixels);
+		for (mode_idx = 0; mode_idx < sizeof(modes) / sizeof(modes[0]); ++mode_idx) {
+			uint32_t in_place[MAX_PIXELS];
+			memcpy(in_place, img1, num_pixels * sizeof(uint32_t));
+			reference_diff(expected, img1, img2, num_pixels, modes[mode_idx]);
+			diff_scalar(in_place, img2, num_pixels * sizeof(uint32_t), modes[mode_idx]);
+			CHECK(memcmp(in_place, expected, num_pixels * sizeof(uint32_t)) == 0);
+		}
+	}
+
+	int tested = 0;
+	int kernel_idx;
+	for (kernel_idx = KERNEL_SCALAR; kernel_idx <= KERNEL_SVE; ++kernel_idx) {
+		diff_kernel_t kernel = (diff_kernel_t)kernel_idx;
+		if (!diff_kernel_supported(kernel)) {
+			continue;
+		}
+		kernel_fns_t fns = { diff_kernel_name(kernel), diff_kernel_fn(kernel), diff_kernel_out_fn(kernel), diff_kernel_stats_fn(kernel),
+				     diff_kernel_compare_fn(kernel), diff_kernel_threshold_fn(kernel) };
+		test_kernel(&fns);
+		test_drivers(&fns, NULL);
+		test_drivers(&fns, pool);
+		tested++;
+	}
+#ifdef PIX_DIFF_NEON_X4
+	kernel_fns_t nontemporal = { "neon_x4 non-temporal", NULL, diff_neon_x4_nt_out, NULL, NULL, NULL };	// Only chosen for images past the last level cache.
+	test_kernel(&nontemporal);
+	test_drivers(&nontemporal, pool);
+	tested++;
+#endif
+
+	thread_pool_destroy(pool);
+
+	fprintf(stderr, "test_kernels: %s, %d kernels\n", failures ? "FAILED" : "passed", tested);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,329 @@
+#define _DEFAULT_SOURCE			// mkdtemp()
+#include "deflate.h"
+#include "png_stream.h"
+#include "diff_stream.h"
+#include "diff_job.h"
+#include "image_io.h"
+#include "pix_diff.h"
+#include "stb_image.h"
+#include "test_util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+The row-band PNG reader against stb_image, and --stream against the whole-image path, for every
+color type the reader takes. The PNGs are written here, one filter type per row in turn and IDAT
+split into small chunks, so unfiltering and chunk boundaries are crossed everywhere. Truncated image
+data has to fail in both the reader and the stream, and the stream must not write over an input.
+*/
+
+#define WIDTH		301
+#define HEIGHT		203
+#define IDAT_CHUNK	1000
+
+typedef struct {
+	uint8_t *data;
+	size_t len;
+} bytes_t;
+
+static int append(void *ctx, const uint8_t *data, size_t len)
+{
+	bytes_t *bytes = ctx;
+	uint8_t *grown = realloc(bytes->data, bytes->len + len);
+	if (grown == NULL) {
+		return -1;
+	}
+	memcpy(grown + bytes->len, data, len);
+	bytes->data = grown;
+	bytes->len += len;
+	return 0;
+}
+
+static void put_chunk(FILE *file, const char *type, const uint8_t *data, size_t len)
+{
+	uint8_t word[4] = { (uint8_t)(len >> 24), (uint8_t)(len >> 16), (uint8_t)(len >> 8), (uint8_t)len };
+	fwrite(word, 1, 4, file);
+	fwrite(type, 1, 4, file);
+	fwrite(data, 1, len, file);
+	uint32_t crc = crc32_update(crc32_update(0, (const uint8_t *)type, 4), data, len);
+	uint8_t crc_bytes[4] = { (uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc };
+	fwrite(crc_bytes, 1, 4, file);
+}
+
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+	int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	return (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+}
+
+static void filter_row(uint8_t *out, const uint8_t *row, const uint8_t *prev, size_t row_bytes, size_t bpp, uint8_t type)
+{
+	out[0] = type;
+	size_t idx;
+	for (idx = 0; idx < row_bytes; ++idx) {
+		uint8_t left = (idx >= bpp) ? row[idx - bpp] : 0;
+		uint8_t up = prev ? prev[idx] : 0;
+		uint8_t up_left = (prev && idx >= bpp) ? prev[idx - bpp] : 0;
+		uint8_t predicted = 0;
+		switch (type) {
+			case 1: predicted = left; break;
+			case 2: predicted = up; break;
+			case 3: predicted = (uint8_t)((left + up) / 2); break;
+			case 4: predicted = paeth(left, up, up_left); break;
+			default: break;
+		}
+		out[1 + idx] = (uint8_t)(row[idx] - predicted);
+	}
+}
+
+static int write_test_png(const char *filename, uint8_t color_type, size_t channels, const uint8_t *samples, const uint8_t *plte, size_t plte_len, const uint8_t *trns, size_t trns_len)
+{
+	size_t row_bytes = WIDTH * channels;
+	uint8_t *filtered = malloc(row_bytes + 1);
+	bytes_t idat = { NULL, 0 };
+	deflate_stream_t *stream = deflate_open(append, &idat);
+	if (filtered == NULL || stream == NULL) {
+		free(filtered);
+		return -1;
+	}
+	int row;
+	for (row = 0; row < HEIGHT; ++row) {	// Filter types 0 to 4 in turn.
+		const uint8_t *samples_row = samples + (size_t)row * row_bytes;
+		filter_row(filtered, samples_row, row ? samples_row - row_bytes : NULL, row_bytes, channels, (uint8_t)(row % 5));
+		deflate_write(stream, filtered, row_bytes + 1);
+	}
+	deflate_close(stream);
+	free(filtered);
+
+	FILE *file = fopen(filename, "wb");
+	if (file == NULL) {
+		free(idat.data);
+		return -1;
+	}
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	uint8_t ihdr[13] = { 0, 0, WIDTH >> 8, WIDTH & 0xFF, 0, 0, HEIGHT >> 8, HEIGHT & 0xFF, 8, color_type, 0, 0, 0 };
+	fwrite(signature, 1, sizeof(signature), file);
+	put_chunk(file, "IHDR", ihdr, sizeof(ihdr));
+	if (plte) {
+		put_chunk(file, "PLTE", plte, plte_len);
+	}
+	if (trns) {
+		put_chunk(file, "tRNS", trns, trns_len);
+	}
+	size_t offset;
+	for (offset = 0; offset < idat.len; offset += IDAT_CHUNK) {
+		put_chunk(file, "IDAT", idat.data + offset, (idat.len - offset < IDAT_CHUNK) ? idat.len - offset : IDAT_CHUNK);
+	}
+	put_chunk(file, "IEND", NULL, 0);
+	free(idat.data);
+	return fclose(file);
+}
+
+static void make_samples(uint8_t *samples, size_t count, uint32_t seed, uint8_t modulo)	// Smooth gradients with noise, modulo keeps palette indices in range.
+{
+	size_t idx;
+	for (idx = 0; idx < count; ++idx) {
+		seed = seed * 1664525u + 1013904223u;
+		unsigned value = (unsigned)(idx % 97 + idx / 1231) + ((seed >> 28) & 3u);
+		samples[idx] = (uint8_t)(modulo ? value % modulo : value);
+	}
+}
+
+typedef struct {
+	const char *name;
+	uint8_t color_type;
+	size_t channels;
+} png_kind_t;
+
+static const png_kind_t KINDS[] = {
+	{ "gray.png", 0, 1 },
+	{ "gray_key.png", 0, 1 },		// With a tRNS color key.
+	{ "gray_alpha.png", 4, 2 },
+	{ "rgb_key.png", 2, 3 },
+	{ "palette.png", 3, 1 },		// With alpha for part of the palette.
+	{ "rgba.png", 6, 4 },
+};
+#define NUM_KINDS	(sizeof(KINDS) / sizeof(KINDS[0]))
+
+static int write_kind(const png_kind_t *kind, uint32_t seed)
+{
+	size_t count = (size_t)WIDTH * HEIGHT * kind->channels;
+	uint8_t *samples = malloc(count);
+	if (samples == NULL) {
+		return -1;
+	}
+	make_samples(samples, count, seed, kind->color_type == 3 ? 200 : 0);
+	uint8_t plte[200 * 3], trns[200];
+	size_t entry;
+	for (entry = 0; entry < 200; ++entry) {
+		plte[entry * 3] = (uint8_t)entry;
+		plte[entry * 3 + 1] = (uint8_t)(255 - entry);
+		plte[entry * 3 + 2] = (uint8_t)(entry * 7);
+		trns[entry] = (uint8_t)(entry * 5);
+	}
+	static const uint8_t gray_key[2] = { 0, 40 }, rgb_key[6] = { 0, 40, 0, 41, 0, 42 };
+	int result;
+	if (strcmp(kind->name, "gray_key.png") == 0) {
+		result = write_test_png(path(kind->name), kind->color_type, kind->channels, samples, NULL, 0, gray_key, sizeof(gray_key));
+	} else if (strcmp(kind->name, "rgb_key.png") == 0) {
+		result = write_test_png(path(kind->name), kind->color_type, kind->channels, samples, NULL, 0, rgb_key, sizeof(rgb_key));
+	} else if (kind->color_type == 3) {
+		result = write_test_png(path(kind->name), kind->color_type, kind->channels, samples, plte, sizeof(plte), trns, 50);
+	} else {
+		result = write_test_png(path(kind->name), kind->color_type, kind->channels, samples, NULL, 0, NULL, 0);
+	}
+	free(samples);
+	return result;
+}
+
+static void test_reader_matches_stb(const png_kind_t *kind)
+{
+	int width, height, channels;
+	uint8_t *expected = stbi_load(path(kind->name), &width, &height, &channels, 4);
+	png_reader_t *reader = png_reader_open(path(kind->name), &width, &height);
+	CHECK(expected != NULL && reader != NULL);
+	if (expected == NULL || reader == NULL) {
+		fprintf(stderr, "FAIL(%s): '%s' did not open.\n", __func__, kind->name);
+		stbi_image_free(expected);
+		png_reader_close(reader);
+		return;
+	}
+	CHECK(width == WIDTH && height == HEIGHT);
+	uint32_t *rows = malloc((size_t)WIDTH * 7 * sizeof(uint32_t));
+	int row = 0, mismatched = 0;
+	while (row < HEIGHT) {				// Odd band heights, as the stream asks for.
+		int num_rows = (HEIGHT - row < 7) ? HEIGHT - row : 7;
+		CHECK(png_reader_read_rows(reader, rows, num_rows) == 0);
+		mismatched |= memcmp(rows, expected + (size_t)row * WIDTH * 4, (size_t)num_rows * WIDTH * 4) != 0;
+		row += num_rows;
+	}
+	CHECK(!mismatched);
+	if (mismatched) {
+		fprintf(stderr, "FAIL(%s): '%s' decodes differently from stb_image.\n", __func__, kind->name);
+	}
+	free(rows);
+	png_reader_close(reader);
+	stbi_image_free(expected);
+}
+
+static int same_pixels(const char *name1, const char *name2)
+{
+	int width1, height1, width2, height2, channels;
+	char path1[256];
+	snprintf(path1, sizeof(path1), "%s", path(name1));
+	uint8_t *pixels1 = stbi_load(path1, &width1, &height1, &channels, 4);
+	uint8_t *pixels2 = stbi_load(path(name2), &width2, &height2, &channels, 4);
+	int same = pixels1 != NULL && pixels2 != NULL && width1 == width2 && height1 == height2 &&
+		   memcmp(pixels1, pixels2, (size_t)width1 * (size_t)height1 * 4) == 0;
+	stbi_image_free(pixels1);
+	stbi_image_free(pixels2);
+	return same;
+}
+
+static int run_stream(const char *image1, const char *image2, const char *output, diff_mode_t mode)
+{
+	char path1[256], path2[256], path_out[256];
+	snprintf(path1, sizeof(path1), "%s", path(image1));
+	snprintf(path2, sizeof(path2), "%s", path(image2));
+	snprintf(path_out, sizeof(path_out), "%s", path(output));
+	diff_stream_t stream = { .image1 = path1, .image2 = path2, .output = path_out, .diff_fn = diff_kernel_out_fn(KERNEL_AUTO), .mode = mode };
+	return diff_stream_run(&stream);
+}
+
+static int run_whole(const char *image1, const char *image2, const char *output, diff_mode_t mode)
+{
+	char path1[256], path2[256], path_out[256];
+	snprintf(path1, sizeof(path1), "%s", path(image1));
+	snprintf(path2, sizeof(path2), "%s", path(image2));
+	snprintf(path_out, sizeof(path_out), "%s", path(output));
+	diff_job_t job = { .image1 = path1, .image2 = path2, .output = path_out, .mode = mode, .kernel = diff_best_kernel(), .map = IMAGE_MAP_OFF, .out = stdout, .err = stderr };
+	diff_job_buffers_t buffers = { { NULL, NULL }, { 0, 0 }, NULL, 0 };
+	int status = diff_job_run(&job, &buffers);
+	diff_job_buffers_free(&buffers);
+	return status;
+}
+
+static void test_stream_matches_whole(const png_kind_t *kind1, const png_kind_t *kind2, diff_mode_t mode)
+{
+	CHECK(run_stream(kind1->name, kind2->name, "stream.png", mode) == 0);
+	CHECK(run_whole(kind1->name, kind2->name, "whole.png", mode) == EXIT_SUCCESS);
+	int same = same_pixels("stream.png", "whole.png");
+	CHECK(same);
+	if (!same) {
+		fprintf(stderr, "FAIL(%s): '%s' against '%s' differs between --stream and the whole image.\n", __func__, kind1->name, kind2->name);
+	}
+}
+
+static void test_truncated_idat(void)
+{
+	FILE *source = fopen(path("rgba.png"), "rb");
+	uint8_t *data = malloc((size_t)WIDTH * HEIGHT * 8);
+	size_t len = source ? fread(data, 1, (size_t)WIDTH * HEIGHT * 8, source) : 0;
+	if (source) {
+		fclose(source);
+	}
+	FILE *truncated = fopen(path("truncated.png"), "wb");
+	CHECK(truncated != NULL && len > 2000);
+	if (truncated == NULL) {
+		free(data);
+		return;
+	}
+	fwrite(data, 1, len / 2, truncated);		// Cut halfway through the image data.
+	fclose(truncated);
+	free(data);
+
+	int width, height;
+	png_reader_t *reader = png_reader_open(path("truncated.png"), &width, &height);
+	CHECK(reader != NULL);
+	if (reader != NULL) {
+		uint32_t *rows = malloc((size_t)WIDTH * HEIGHT * sizeof(uint32_t));
+		CHECK(png_reader_read_rows(reader, rows, HEIGHT) == -1);
+		free(rows);
+		png_reader_close(reader);
+	}
+	CHECK(run_stream("truncated.png", "rgba.png", "stream.png", ABS) == -1);
+}
+
+static void test_output_is_input(void)	// Streamed inputs are read while the output is written, so the output may not be one of them.
+{
+	struct stat before, after;
+	CHECK(stat(path("rgba.png"), &before) == 0);
+	CHECK(run_stream("gray.png", "rgba.png", "rgba.png", ABS) == -1);
+	CHECK(stat(path("rgba.png"), &after) == 0 && after.st_size == before.st_size);
+	CHECK(run_stream("gray.png", "rgba.png", "stream.png", ABS) == 0);
+}
+
+int main(void)
+{
+	if (mkdtemp(dir) == NULL) {
+		fprintf(stderr, "FAIL(%s): Unable to create a scratch directory.\n", __func__);
+		return EXIT_FAILURE;
+	}
+	size_t kind_idx;
+	for (kind_idx = 0; kind_idx < NUM_KINDS; ++kind_idx) {
+		CHECK(write_kind(&KINDS[kind_idx], (uint32_t)kind_idx + 1) == 0);
+	}
+
+	for (kind_idx = 0; kind_idx < NUM_KINDS; ++kind_idx) {
+		test_reader_matches_stb(&KINDS[kind_idx]);
+		test_stream_matches_whole(&KINDS[kind_idx], &KINDS[NUM_KINDS - 1], ABS);	// Against RGBA,
+		test_stream_matches_whole(&KINDS[kind_idx], &KINDS[(kind_idx + 1) % NUM_KINDS], (diff_mode_t)(kind_idx % 3));	// and a different kind in every mode.
+	}
+	test_truncated_idat();
+	test_output_is_input();
+
+	for (kind_idx = 0; kind_idx < NUM_KINDS; ++kind_idx) {
+		unlink(path(KINDS[kind_idx].name));
+	}
+	unlink(path("stream.png"));
+	unlink(path("whole.png"));
+	unlink(path("truncated.png"));
+	rmdir(dir);
+
+	fprintf(stderr, "test_png_stream: %s\n", failures ? "FAILED" : "passed");
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
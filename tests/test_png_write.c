@@ -0,0 +1,135 @@
+#define _DEFAULT_SOURCE			// mkdtemp()
+#include "png_stream.h"
+#include "thread_pool.h"
+#include "stb_image.h"
+#include "test_util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+png_write_image() with one thread against a pool. Both files have to decode with stb_image to the
+source pixels and be the same bytes, whatever the width, the number of strips or the stride. The
+shapes cover a single strip, odd widths cut into many strips, and rows longer than a whole strip.
+*/
+
+#define POOL_THREADS	4
+
+static uint8_t *read_file(const char *filename, size_t *len)
+{
+	FILE *file = fopen(filename, "rb");
+	if (file == NULL) {
+		return NULL;
+	}
+	uint8_t *data = NULL;
+	*len = 0;
+	uint8_t chunk[65536];
+	size_t got;
+	while ((got = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+		uint8_t *grown = realloc(data, *len + got);
+		if (grown == NULL) {
+			break;
+		}
+		memcpy(grown + *len, chunk, got);
+		data = grown;
+		*len += got;
+	}
+	fclose(file);
+	return data;
+}
+
+static void fill(uint8_t *pixels, int width, int height, int channels, size_t stride, uint32_t seed)	// Gradients with noise in flat runs, so every filter type is chosen somewhere.
+{
+	uint32_t state = seed;
+	int y, x, c;
+	for (y = 0; y < height; ++y) {
+		uint8_t *row = pixels + (size_t)y * stride;
+		for (x = 0; x < width; ++x) {
+			for (c = 0; c < channels; ++c) {
+				state = state * 1664525u + 1013904223u;
+				uint8_t noise = ((x / 64 + y / 32) % 3 == 0) ? (uint8_t)(state >> 24) : 0;
+				row[x * channels + c] = (uint8_t)(x * (c + 1) + y * 3 + noise);
+			}
+		}
+	}
+}
+
+static int same_pixels(const char *filename, const uint8_t *pixels, int width, int height, int channels, size_t stride)
+{
+	int w, h, n;
+	uint8_t *decoded = stbi_load(filename, &w, &h, &n, channels);
+	if (decoded == NULL) {
+		fprintf(stderr, "FAIL(%s): stb_image can not decode '%s': %s\n", __func__, filename, stbi_failure_reason());
+		return 0;
+	}
+	int same = (w == width && h == height && n == channels);
+	size_t row_bytes = (size_t)width * (size_t)channels;
+	int y;
+	for (y = 0; y < height && same; ++y) {
+		same = memcmp(decoded + (size_t)y * row_bytes, pixels + (size_t)y * stride, row_bytes) == 0;
+	}
+	stbi_image_free(decoded);
+	return same;
+}
+
+static void test_pool_matches_one_thread(thread_pool_t *pool, int width, int height, int channels, size_t padding)
+{
+	size_t stride = (size_t)width * (size_t)channels + padding;
+	uint8_t *pixels = malloc(stride * (size_t)height);
+	if (pixels == NULL) {
+		CHECK(pixels != NULL);
+		return;
+	}
+	fill(pixels, width, height, channels, stride, (uint32_t)(width * 31 + height + channels));
+
+	char one_name[64], pool_name[64];
+	snprintf(one_name, sizeof(one_name), "%dx%dx%d-one.png", width, height, channels);
+	snprintf(pool_name, sizeof(pool_name), "%dx%dx%d-pool.png", width, height, channels);
+	char one_path[256];
+	snprintf(one_path, sizeof(one_path), "%s", path(one_name));
+
+	CHECK(png_write_image(one_path, pixels, width, height, channels, stride, NULL) == 0);
+	CHECK(png_write_image(path(pool_name), pixels, width, height, channels, stride, pool) == 0);
+	CHECK(same_pixels(one_path, pixels, width, height, channels, stride));
+	CHECK(same_pixels(path(pool_name), pixels, width, height, channels, stride));
+
+	size_t one_len, pool_len;
+	uint8_t *one_file = read_file(one_path, &one_len);
+	uint8_t *pool_file = read_file(path(pool_name), &pool_len);
+	CHECK(one_file != NULL && pool_file != NULL && one_len == pool_len && memcmp(one_file, pool_file, one_len) == 0);
+	free(one_file);
+	free(pool_file);
+
+	unlink(one_path);
+	unlink(path(pool_name));
+	free(pixels);
+}
+
+int main(void)
+{
+	if (mkdtemp(dir) == NULL) {
+		fprintf(stderr, "FAIL(%s): Unable to create a scratch directory.\n", __func__);
+		return EXIT_FAILURE;
+	}
+	thread_pool_t *pool = thread_pool_create(POOL_THREADS);
+	if (pool == NULL) {
+		fprintf(stderr, "FAIL(%s): Unable to create a pool of %d threads.\n", __func__, POOL_THREADS);
+		rmdir(dir);
+		return EXIT_FAILURE;
+	}
+
+	test_pool_matches_one_thread(pool, 1, 1, 1, 0);		// Single strip, single pixel.
+	test_pool_matches_one_thread(pool, 37, 19, 4, 0);	// Single strip.
+	test_pool_matches_one_thread(pool, 1037, 613, 4, 0);	// Odd width, ten strips and a short last one.
+	test_pool_matches_one_thread(pool, 1037, 613, 1, 0);	// The same as a gray mask.
+	test_pool_matches_one_thread(pool, 1037, 613, 4, 12);	// Rows padded past the width.
+	test_pool_matches_one_thread(pool, 70001, 5, 4, 0);	// A row longer than a strip, one strip per row.
+
+	thread_pool_destroy(pool);
+	rmdir(dir);
+
+	fprintf(stderr, "test_png_write: %s\n", failures ? "FAILED" : "passed");
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,32 @@
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include <stdio.h>
+
+/*
+The harness shared by the programs under tests/. CHECK() counts a failure and reports the condition
+with its file and line, and carries on, so one run lists every failure. Tests that write files do
+so under dir, made with mkdtemp() in main() and removed again at the end.
+*/
+
+#define CHECK(cond)	check((cond), #cond, __FILE__, __LINE__)
+
+static int failures = 0;
+static char dir[] = "/tmp/image-diff-test.XXXXXX";
+
+static inline void check(int ok, const char *what, const char *file, int line)
+{
+	if (!ok) {
+		fprintf(stderr, "FAIL(%s:%d): %s\n", file, line, what);
+		failures++;
+	}
+}
+
+static inline const char *path(const char *name)	// In the scratch directory, valid until the next call.
+{
+	static char buf[256];
+	snprintf(buf, sizeof(buf), "%s/%s", dir, name);
+	return buf;
+}
+
+#endif
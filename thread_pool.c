@@ -0,0 +1,417 @@
+#define _GNU_SOURCE			// pthread_setaffinity_np().
+#include "thread_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INITIAL_TASKS	64		// Deque capacity before it first grows, a power of two.
+
+/*
+Work stealing. Every thread has a deque of index ranges. A thread takes a range from the bottom of
+its own deque, pushes the upper half back and keeps splitting the lower half until one index is
+left, which it runs, so the ranges it leaves behind are the largest ones. Idle threads steal the
+oldest, largest range from the top of another deque.
+
+parallel_for() may be called again from inside a task, which is how a batch of pairs splits its
+large images into bands. While a thread waits for such a nested job it only helps with tasks nested
+at least as deep, so it never starts a whole unrelated pair and returns late.
+
+Once the threads are pinned, parallel_for() hands every thread a contiguous share of the indices
+up front instead of splitting from the calling thread. The same index then starts on the same
+thread in every job of that count, so memory first touched in one job is local to the thread that
+uses it in the next, and stealing only moves the indices left over at the end.
+*/
+
+typedef struct {
+	pool_task_fn_t fn;
+	void *arg;
+	atomic_size_t remaining;	// Indices not yet run.
+	int depth;			// Nesting level, 0 for a call from outside the pool.
+} pool_job_t;
+
+typedef struct {
+	pool_job_t *job;
+	size_t begin;
+	size_t end;
+} pool_task_t;
+
+typedef struct {
+	_Alignas(64) pthread_mutex_t lock;	// Each slot on its own cache lines.
+	pool_task_t *tasks;		// Ring of capacity entries, a power of two.
+	size_t capacity;
+	size_t top;			// Oldest task, where thieves take from.
+	size_t bottom;			// One past the newest task, where the owner pushes and pops.
+	atomic_uint_least64_t tasks_run;
+	atomic_uint_least64_t steals;
+	atomic_uint_least64_t idle_ns;
+} pool_slot_t;
+
+struct thread_pool {
+	pthread_t *workers;
+	int num_workers;		// Started threads, the thread calling parallel_for makes one more.
+	pool_slot_t *slots;		// Slot 0 belongs to the thread calling from outside, then one per worker.
+	int num_slots;
+	pthread_mutex_t lock;		// Guards sleeping and waking only.
+	pthread_cond_t wake;
+	atomic_ulong pushes;		// Bumped for every push so sleeping threads notice new work.
+	atomic_int sleepers;
+	int spread;			// Deal out contiguous shares of every job, set once the threads are pinned.
+	int shutdown;
+};
+
+typedef struct {
+	thread_pool_t *pool;		// The pool this thread is working for, NULL outside of any.
+	int slot;
+	int depth;			// Depth of jobs started from the task this thread is running.
+} pool_context_t;
+
+static _Thread_local pool_context_t context;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int push_task(thread_pool_t *pool, pool_slot_t *slot, pool_task_t task)
+{
+	pthread_mutex_lock(&slot->lock);
+	if (slot->bottom - slot->top == slot->capacity) {
+		size_t capacity = slot->capacity ? 2 * slot->capacity : INITIAL_TASKS;
+		pool_task_t *tasks = malloc(capacity * sizeof(pool_task_t));
+		if (tasks == NULL) {
+			pthread_mutex_unlock(&slot->lock);
+			return -1;		// The caller runs the range itself.
+		}
+		size_t idx;
+		for (idx = slot->top; idx != slot->bottom; ++idx) {
+			tasks[idx & (capacity - 1)] = slot->tasks[idx & (slot->capacity - 1)];
+		}
+		free(slot->tasks);
+		slot->tasks = tasks;
+		slot->capacity = capacity;
+	}
+	slot->tasks[slot->bottom++ & (slot->capacity - 1)] = task;
+	pthread_mutex_unlock(&slot->lock);
+
+	atomic_fetch_add(&pool->pushes, 1);
+	if (atomic_load(&pool->sleepers) > 0) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_broadcast(&pool->wake);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return 0;
+}
+
+static int pop_task(pool_slot_t *slot, int min_depth, pool_task_t *task)	// Newest task of the own deque deep enough.
+{
+	int found = 0;
+	pthread_mutex_lock(&slot->lock);
+	size_t idx;
+	for (idx = slot->bottom; idx != slot->top; --idx) {	// Shares dealt out by other threads may sit under shallower tasks.
+		if (slot->tasks[(idx - 1) & (slot->capacity - 1)].job->depth >= min_depth) {
+			*task = slot->tasks[(idx - 1) & (slot->capacity - 1)];
+			for (; idx != slot->bottom; ++idx) {	// Close the gap, keeping the order.
+				slot->tasks[(idx - 1) & (slot->capacity - 1)] = slot->tasks[idx & (slot->capacity - 1)];
+			}
+			slot->bottom--;
+			found = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&slot->lock);
+	return found;
+}
+
+static int steal_task(pool_slot_t *victim, int min_depth, pool_task_t *task)	// Oldest task deep enough.
+{
+	int found = 0;
+	pthread_mutex_lock(&victim->lock);
+	size_t idx;
+	for (idx = victim->top; idx != victim->bottom; ++idx) {
+		if (victim->tasks[idx & (victim->capacity - 1)].job->depth >= min_depth) {
+			*task = victim->tasks[idx & (victim->capacity - 1)];
+			for (; idx != victim->top; --idx) {	// Close the gap, keeping the order.
+				victim->tasks[idx & (victim->capacity - 1)] = victim->tasks[(idx - 1) & (victim->capacity - 1)];
+			}
+			victim->top++;
+			found = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&victim->lock);
+	return found;
+}
+
+static int find_task(thread_pool_t *pool, int own, int min_depth, pool_task_t *task)
+{
+	if (pop_task(&pool->slots[own], min_depth, task)) {
+		return 1;
+	}
+	int offset;
+	for (offset = 1; offset < pool->num_slots; ++offset) {	// Starting next to the own slot spreads the thieves out.
+		int victim = (own + offset) % pool->num_slots;
+		if (steal_task(&pool->slots[victim], min_depth, task)) {
+			atomic_fetch_add_explicit(&pool->slots[own].steals, 1, memory_order_relaxed);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void run_task(thread_pool_t *pool, int own, pool_task_t task)
+{
+	while (task.end - task.begin > 1) {	// Leave the upper half for others, down to single indices.
+		size_t mid = task.begin + (task.end - task.begin) / 2;
+		if (push_task(pool, &pool->slots[own], (pool_task_t){ task.job, mid, task.end }) == -1) {
+			break;
+		}
+		task.end = mid;
+	}
+
+	pool_job_t *job = task.job;
+	pool_task_fn_t fn = job->fn;
+	void *arg = job->arg;
+	int depth = context.depth;
+	context.depth = job->depth + 1;
+	size_t index;
+	for (index = task.begin; index < task.end; ++index) {
+		fn(arg, index);
+	}
+	context.depth = depth;
+
+	size_t ran = task.end - task.begin;
+	atomic_fetch_add_explicit(&pool->slots[own].tasks_run, ran, memory_order_relaxed);
+	if (atomic_fetch_sub(&job->remaining, ran) == ran) {	// The job may be gone once this hits zero.
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_broadcast(&pool->wake);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+static int wait_for_work(thread_pool_t *pool, int own, unsigned long seen_pushes, pool_job_t *job)	// Returns 0 on shutdown.
+{
+	uint64_t start = now_ns();
+	pthread_mutex_lock(&pool->lock);
+	atomic_fetch_add(&pool->sleepers, 1);
+	while (!pool->shutdown && atomic_load(&pool->pushes) == seen_pushes && (job == NULL || atomic_load(&job->remaining) > 0)) {
+		pthread_cond_wait(&pool->wake, &pool->lock);
+	}
+	atomic_fetch_sub(&pool->sleepers, 1);
+	int running = !pool->shutdown;
+	pthread_mutex_unlock(&pool->lock);
+	atomic_fetch_add_explicit(&pool->slots[own].idle_ns, now_ns() - start, memory_order_relaxed);
+	return running;
+}
+
+typedef struct {
+	thread_pool_t *pool;
+	int slot;
+} worker_start_t;
+
+static void *worker_main(void *arg)
+{
+	worker_start_t *start = arg;
+	thread_pool_t *pool = start->pool;
+	int own = start->slot;
+	free(start);
+	context.pool = pool;
+	context.slot = own;
+	context.depth = 0;
+
+	for (;;) {
+		unsigned long seen_pushes = atomic_load(&pool->pushes);
+		pool_task_t task;
+		if (find_task(pool, own, 0, &task)) {
+			run_task(pool, own, task);
+		} else if (!wait_for_work(pool, own, seen_pushes, NULL)) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+thread_pool_t *thread_pool_create(int num_threads)
+{
+	if (num_threads < 1) {
+		fprintf(stderr, "Error(%s): A thread pool needs at least one thread, got %d.\n", __func__, num_threads);
+		return NULL;
+	}
+
+	thread_pool_t *pool = calloc(1, sizeof(*pool));
+	if (pool == NULL) {
+		fprintf(stderr, "Error(%s): Unable to allocate the thread pool.\n", __func__);
+		return NULL;
+	}
+	pool->workers = calloc((size_t)num_threads, sizeof(pthread_t));	// One spare keeps the size non-zero.
+	pool->slots = aligned_alloc(_Alignof(pool_slot_t), (size_t)num_threads * sizeof(pool_slot_t));
+	if (pool->workers == NULL || pool->slots == NULL) {
+		fprintf(stderr, "Error(%s): Unable to allocate the thread pool.\n", __func__);
+		free(pool->workers);
+		free(pool->slots);
+		free(pool);
+		return NULL;
+	}
+	memset(pool->slots, 0, (size_t)num_threads * sizeof(pool_slot_t));
+	int slot;
+	for (slot = 0; slot < num_threads; ++slot) {
+		pthread_mutex_init(&pool->slots[slot].lock, NULL);
+		atomic_init(&pool->slots[slot].tasks_run, 0);
+		atomic_init(&pool->slots[slot].steals, 0);
+		atomic_init(&pool->slots[slot].idle_ns, 0);
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	atomic_init(&pool->pushes, 0);
+	atomic_init(&pool->sleepers, 0);
+
+	int wanted_workers = num_threads - 1;		// The caller always takes part.
+	pool->num_slots = num_threads;			// Slots of workers that fail to start just stay empty.
+	while (pool->num_workers < wanted_workers) {
+		worker_start_t *start = malloc(sizeof(*start));
+		if (start != NULL) {
+			start->pool = pool;
+			start->slot = pool->num_workers + 1;
+		}
+		if (start == NULL || pthread_create(&pool->workers[pool->num_workers], NULL, worker_main, start) != 0) {
+			fprintf(stderr, "Warning(%s): Could only start %d of %d threads.\n", __func__, pool->num_workers + 1, num_threads);
+			free(start);
+			break;
+		}
+		pool->num_workers++;
+	}
+	return pool;
+}
+
+void thread_pool_destroy(thread_pool_t *pool)
+{
+	if (pool == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	int worker;
+	for (worker = 0; worker < pool->num_workers; ++worker) {
+		pthread_join(pool->workers[worker], NULL);
+	}
+
+	int slot;
+	for (slot = 0; slot < pool->num_slots; ++slot) {
+		pthread_mutex_destroy(&pool->slots[slot].lock);
+		free(pool->slots[slot].tasks);
+	}
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->slots);
+	free(pool->workers);
+	free(pool);
+}
+
+int thread_pool_size(const thread_pool_t *pool)
+{
+	return pool ? pool->num_workers + 1 : 1;
+}
+
+void thread_pool_parallel_for(thread_pool_t *pool, size_t count, pool_task_fn_t fn, void *arg)
+{
+	if (pool == NULL || pool->num_workers == 0 || count <= 1) {	// Nothing to share, run on the calling thread.
+		size_t index;
+		for (index = 0; index < count; ++index) {
+			fn(arg, index);
+		}
+		return;
+	}
+
+	pool_context_t outer = context;
+	if (context.pool != pool) {		// Called from outside, the caller works from slot 0.
+		context.pool = pool;
+		context.slot = 0;
+		context.depth = 0;
+	}
+	int own = context.slot;
+
+	pool_job_t job;
+	job.fn = fn;
+	job.arg = arg;
+	job.depth = context.depth;
+	atomic_init(&job.remaining, count);
+
+	pool_task_t task = { &job, 0, count };
+	if (pool->spread) {			// Every thread gets its own share, the caller runs its share below.
+		int slot;
+		for (slot = 0; slot < pool->num_slots; ++slot) {
+			pool_task_t share = { &job, count * (size_t)slot / (size_t)pool->num_slots, count * (size_t)(slot + 1) / (size_t)pool->num_slots };
+			if (slot == own) {
+				task = share;
+			} else if (share.begin != share.end && push_task(pool, &pool->slots[slot], share) == -1) {
+				run_task(pool, own, share);
+			}
+		}
+	}
+	if (task.begin != task.end) {
+		run_task(pool, own, task);	// Splits the range, leaving halves for the others.
+	}
+	while (atomic_load(&job.remaining) > 0) {
+		unsigned long seen_pushes = atomic_load(&pool->pushes);
+		if (find_task(pool, own, job.depth, &task)) {
+			run_task(pool, own, task);
+		} else {
+			wait_for_work(pool, own, seen_pushes, &job);
+		}
+	}
+	context = outer;
+}
+
+int thread_pool_pin(thread_pool_t *pool, const int *cpus)
+{
+	if (pool == NULL) {
+		return 0;
+	}
+	int result = 0;
+	int thread;
+	for (thread = 0; thread <= pool->num_workers; ++thread) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET((size_t)cpus[thread], &set);
+		pthread_t target = thread ? pool->workers[thread - 1] : pthread_self();
+		if (pthread_setaffinity_np(target, sizeof(set), &set) != 0) {
+			fprintf(stderr, "Warning(%s): Unable to pin thread %d to processor %d.\n", __func__, thread, cpus[thread]);
+			result = -1;
+		}
+	}
+	pool->spread = 1;
+	return result;
+}
+
+int thread_pool_is_pinned(const thread_pool_t *pool)
+{
+	return pool != NULL && pool->spread;
+}
+
+void thread_pool_stats(const thread_pool_t *pool, int thread, thread_pool_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (pool == NULL || thread < 0 || thread > pool->num_workers) {
+		return;
+	}
+	const pool_slot_t *slot = &pool->slots[thread];
+	stats->tasks = atomic_load_explicit(&slot->tasks_run, memory_order_relaxed);
+	stats->steals = atomic_load_explicit(&slot->steals, memory_order_relaxed);
+	stats->idle_ns = atomic_load_explicit(&slot->idle_ns, memory_order_relaxed);
+}
+
+int thread_pool_online_cpus(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return (cpus < 1) ? 1 : (int)cpus;
+}
@@ -0,0 +1,33 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stddef.h>
+
+#include <stdint.h>
+
+/*
+A small persistent pool of worker threads. thread_pool_parallel_for() runs fn(arg, index) for every
+index in [0, count) across the workers and the calling thread, and returns once all have finished.
+Work is balanced by stealing, so uneven indices even out. fn may call parallel_for again on the same
+pool, and those indices are shared out too. From outside the pool, one thread calls at a time.
+*/
+
+typedef struct thread_pool thread_pool_t;
+typedef void (*pool_task_fn_t)(void *arg, size_t index);
+
+typedef struct {		// Per thread, counted since the pool was created.
+	uint64_t tasks;		// Indices run.
+	uint64_t steals;	// Ranges taken from another thread's deque.
+	uint64_t idle_ns;	// Time spent waiting for work.
+} thread_pool_stats_t;
+
+thread_pool_t *thread_pool_create(int num_threads);
+void thread_pool_destroy(thread_pool_t *pool);
+int thread_pool_size(const thread_pool_t *pool);
+void thread_pool_parallel_for(thread_pool_t *pool, size_t count, pool_task_fn_t fn, void *arg);
+int thread_pool_pin(thread_pool_t *pool, const int *cpus);	// cpus[thread] for every thread, thread 0 being the caller. Jobs are then dealt out in contiguous shares.
+int thread_pool_is_pinned(const thread_pool_t *pool);	// NULL is not.
+void thread_pool_stats(const thread_pool_t *pool, int thread, thread_pool_stats_t *stats);	// thread 0 is the one calling from outside.
+int thread_pool_online_cpus(void);
+
+#endif